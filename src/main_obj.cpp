@@ -65,6 +65,8 @@ int main(int argc, char *argv[])
   const bool use_crf = false;
   const int crf_skip_frames = 500;
   const int crf_iterations = 10;
+  // Keep only this many classes per surfel, 0 for all of them
+  const int table_top_k = 0;
   
   // Load the network model and parameters
   CaffeInterface caffe;
@@ -85,6 +87,7 @@ int main(int argc, char *argv[])
   // TODO : init num_classes???
   std::cout<<"initialising ObjectFusionInterface" << std::endl;
   std::unique_ptr<ObjectFusionInterface> object_fusion(new ObjectFusionInterface(num_classes,100));
+  object_fusion->SetSparseTable(table_top_k);
 
   // Initialise the Gui, Map, and Kinect Log Reader
   const int width = 640;
@@ -24,6 +24,7 @@
 
 #include <cnn_interface/CaffeInterface.h>
 #include <map_interface/ElasticFusionInterface.h>
+#include <semantic_fusion/ImageCrfRefiner.h>
 #include <semantic_fusion/SemanticFusionInterface.h>
 #include <utilities/LiveLogReader.h>
 #include <utilities/RawLogReader.h>
@@ -58,11 +59,60 @@ int main_0(int argc, char *argv[])
 {
   // CNN Skip params
   const int cnn_skip_frames = 10;
+  // Fuse and render the probability table on the CPU instead of with CUDA
+  const bool cpu_semantic_fusion = false;
+  // Keep each surfel's class probabilities together in the table rather than
+  // a row per class
+  const bool surfel_major_table = false;
+  // Store the table as 8 or 16 bit log probabilities instead, 0 for floats
+  const int table_code_bits = 0;
+  // Or keep only this many classes per surfel, 0 for all of them
+  const int table_top_k = 0;
+  
+  // Option 2D CRF over each CNN output before it is fused, with at most this
+  // many steps and milliseconds (0 for no limit) per frame
+  const bool use_image_crf = false;
+  const int image_crf_iterations = 5;
+  const double image_crf_budget_ms = 30.0;
   
   // Option CPU-based CRF smoothing
   const bool use_crf = false;
   const int crf_skip_frames = 500;
   const int crf_iterations = 10;
+  // Stop iterating early once no probability changes by more than this, 0 runs
+  // every iteration
+  const float crf_tolerance = 0.0;
+  // Start each blocking CRF update from the result of the previous one, see
+  // crf_in_background
+  const bool crf_warm_start = false;
+  // Restrict the blocking CRF update to the surfels fused in the last this many
+  // CNN updates and a halo (in metres) around them, 0 runs over the whole map,
+  // see crf_in_background
+  const int crf_window_fusions = 0;
+  const float crf_window_halo = 0.1;
+  // Run the CRF on a background thread and merge it in when done, instead of
+  // stalling the frame it starts on. The background update always runs over the
+  // whole map from the unaries, so it can't be combined with the warm start or
+  // the window above.
+  const bool crf_in_background = false;
+  static_assert(!crf_in_background || (!crf_warm_start && crf_window_fusions == 0),
+                "crf_warm_start and crf_window_fusions only apply to the blocking CRF update");
+  // Memory (in MB) each CRF may use before it switches to its lean layout, 0
+  // for no limit
+  const int crf_memory_budget_mb = 0;
+  // Run the CRF variables in spatial rather than table order, which makes the
+  // lattice passes mostly sequential in memory
+  const bool crf_spatial_ordering = false;
+  // Labels the CRF keeps per surfel, 0 for all. A handful is plenty for
+  // models with many classes, like the 81 of the mask path.
+  const int crf_label_budget = 0;
+  // Size (in metres) of the cells the blocking CRF merges surfels into, 0 for
+  // one variable per surfel, and how much of each surfel's result comes from
+  // its cell rather than its own probability
+  const float crf_voxel_size = 0.0;
+  const float crf_cell_weight = 1.0;
+  // Save the final map and probabilities here for tools/crf_sweep, empty for none
+  const std::string crf_snapshot_file = "";
   
   // Load the network model and parameters
   CaffeInterface caffe;
@@ -79,6 +129,21 @@ int main_0(int argc, char *argv[])
   
   std::cout<<"initialising SemanticFusionInterface" << std::endl;
   std::unique_ptr<SemanticFusionInterface> semantic_fusion(new SemanticFusionInterface(num_classes,100));
+  semantic_fusion->SetCpuBackend(cpu_semantic_fusion);
+  semantic_fusion->SetSurfelMajorTable(surfel_major_table);
+  if (table_code_bits > 0) {
+    semantic_fusion->SetQuantizedTable(table_code_bits);
+  }
+  if (table_top_k > 0) {
+    semantic_fusion->SetSparseTable(table_top_k);
+  }
+  semantic_fusion->SetCRFMemoryBudget(static_cast<size_t>(crf_memory_budget_mb) << 20);
+  semantic_fusion->SetCRFSpatialOrdering(crf_spatial_ordering);
+  semantic_fusion->SetCRFLabelBudget(crf_label_budget);
+  semantic_fusion->SetCRFVoxelSize(crf_voxel_size,crf_cell_weight);
+  ImageCrfRefiner image_crf(num_classes);
+  image_crf.set_iterations(image_crf_iterations);
+  image_crf.set_time_budget(image_crf_budget_ms);
   
   // Initialise the Gui, Map, and Kinect Log Reader
   const int width = 640;
@@ -156,13 +221,29 @@ int main_0(int argc, char *argv[])
         }
         //printf("%f\n", segmented_prob->shape());
         //const float* prob_cpu = segmented_prob->cpu_data();
+        if (use_image_crf) {
+          image_crf.Refine(log_reader->rgb,height,width,segmented_prob->mutable_cpu_data(),
+                           segmented_prob->height(),segmented_prob->width());
+        }
        	semantic_fusion->UpdateProbabilities(segmented_prob,map);
       }
       
       //crf update
+      if (use_crf && crf_in_background && semantic_fusion->MergeCRFUpdate(map)) {
+        std::cout<<"CRF update merged after "<<semantic_fusion->merged_crf_iterations()<<" iterations"<<std::endl;
+      }
       if (use_crf && frame_num % crf_skip_frames == 0) {
         //std::cout<<"Performing CRF Update..."<<std::endl;
-        semantic_fusion->CRFUpdate(map,crf_iterations);
+        if (crf_in_background) {
+          semantic_fusion->StartCRFUpdate(map,crf_iterations,crf_tolerance);
+        } else {
+          const int iterations = (crf_window_fusions > 0)
+            ? semantic_fusion->WindowedCRFUpdate(map,crf_iterations,crf_window_fusions,crf_window_halo,
+                                                 crf_tolerance,crf_warm_start)
+            : semantic_fusion->CRFUpdate(map,crf_iterations,crf_tolerance,crf_warm_start);
+          std::cout<<"CRF update took "<<iterations<<" iterations, "
+                   <<(semantic_fusion->crf_peak_bytes() >> 20)<<" MB"<<std::endl;
+        }
       } 
     }
     frame_num++;
@@ -201,6 +282,9 @@ int main_0(int argc, char *argv[])
       }
     }
   }
+  if (!crf_snapshot_file.empty() && !semantic_fusion->SaveCRFSnapshot(crf_snapshot_file,map)) {
+    std::cout<<"Failed to save the CRF snapshot to "<<crf_snapshot_file<<std::endl;
+  }
   std::cout<<"Finished SemanticFusion"<<std::endl;
   // std::cin.get(); 
   return 0;
@@ -26,14 +26,27 @@
 */
 
 #include "densecrf.h"
-#include "fastmath.h"
+#include "kernels.h"
+#include "knn.h"
 #include "permutohedral.h"
 #include "util.h"
+#include <utilities/ThreadPool.h>
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
 #include <cmath>
 #include <cstring>
 
+// Variables per chunk of expAndNormalize
+static const int NORMALIZE_GRAIN = 1024;
+// Variables sliced at a time by the lean layout
+static const int LEAN_SLICE_ROWS = 16384;
+
 PairwisePotential::~PairwisePotential() {
 }
+void PairwisePotential::applyChunked( float * out_values, const float * in_values, float * tmp, int tmp_rows, int value_size ) const {
+	apply( out_values, in_values, tmp, value_size );
+}
 
 SemiMetricFunction::~SemiMetricFunction() {
 }
@@ -45,13 +58,24 @@ protected:
 	int N_;
 	float w_;
 	float *norm_;
+	size_t norm_capacity_;
 public:
 	~PottsPotential(){
-		deallocate( norm_ );
+		releaseBuffer( norm_, norm_capacity_ );
+	}
+	PottsPotential(const float* features, int D, int N, float w, bool per_pixel_normalization=true) :norm_(NULL), norm_capacity_(0) {
+		reset( features, D, N, w );
 	}
-	PottsPotential(const float* features, int D, int N, float w, bool per_pixel_normalization=true) :N_(N), w_(w) {
-		lattice_.init( features, D, N );
-		norm_ = allocate( N );
+	// An empty potential, reset must be called before it is used
+	PottsPotential() :N_(0), w_(0), norm_(NULL), norm_capacity_(0) {
+	}
+	// Rebuild the potential for new features, reusing the lattice memory. options
+	// are those of Permutohedral::init.
+	void reset(const float* features, int D, int N, float w, int options=0) {
+		N_ = N;
+		w_ = w;
+		lattice_.init( features, D, N, options );
+		reserveBuffer( norm_, norm_capacity_, N );
 		for ( int i=0; i<N; i++ )
 			norm_[i] = 1;
 		// Compute the normalization factor
@@ -60,12 +84,24 @@ public:
 		for ( int i=0; i<N; i++ )
 	    norm_[i] = 1.f / (norm_[i]+1e-20f);
 	}
+	// Filter with shared lattice values, see Permutohedral::shareBuffers
+	void shareBuffers( LatticeBuffers * buffers ) {
+		lattice_.shareBuffers( buffers );
+	}
+	void applyChunked(float* out_values, const float* in_values, float* tmp, int tmp_rows, int value_size) const {
+		lattice_.filter( in_values, value_size );
+		for ( int first=0; first<N_; first+=tmp_rows ) {
+			const int n = std::min( tmp_rows, N_-first );
+			lattice_.slice( tmp, first, n );
+			float * out = out_values + (size_t)first*value_size;
+			for ( int i=0,k=0; i<n; i++ )
+				for ( int j=0; j<value_size; j++, k++ ) {
+					out[k] += w_*norm_[first+i]*tmp[k];
+				}
+		}
+	}
 	void apply(float* out_values, const float* in_values, float* tmp, int value_size) const {
-		lattice_.compute( tmp, in_values, value_size );
-		for ( int i=0,k=0; i<N_; i++ )
-			for ( int j=0; j<value_size; j++, k++ ) {
-				out_values[k] += w_*norm_[i]*tmp[k];
-			}
+		applyChunked( out_values, in_values, tmp, N_, value_size );
 		/*
 		// Added by John - this is the form in the paper, it results in an almost
 		// identical output as the code they gave, but it's much slower
@@ -89,31 +125,155 @@ public:
 /////////////////////////////
 /////  Alloc / Dealloc  /////
 /////////////////////////////
-DenseCRF::DenseCRF(int N, int M) : N_(N), M_(M) {
-	unary_ = allocate( N_*M_ );
-	current_ = allocate( N_*M_ );
-	next_ = allocate( N_*M_ );
-	tmp_ = allocate( 2*N_*M_ );
+DenseCRF::DenseCRF(int N, int M) : N_(N), M_(M), unary_(NULL), additional_unary_(NULL), current_(NULL), next_(NULL), tmp_(NULL), label_values_(NULL), features_(NULL), accumulators_(NULL), chunk_changes_(NULL), max_change_(0), mean_change_(0), iterations_(0),
+                                    memory_budget_(0), lean_(false), tmp_rows_(N), lattice_buffers_(new LatticeBuffers), ordered_lattices_(false),
+                                    label_budget_(0), label_mass_(0), sparse_labels_(false), active_labels_(NULL), active_unary_(NULL), residual_(NULL), sparse_current_(NULL), compact_(NULL), active_channels_(0),
+                                    initial_marginals_(NULL), initial_source_(NULL), time_budget_(0), step_time_(0),
+                                    unary_capacity_(0), current_capacity_(0), next_capacity_(0), tmp_capacity_(0), label_values_capacity_(0), features_capacity_(0), accumulators_capacity_(0), chunk_changes_capacity_(0),
+                                    active_labels_capacity_(0), active_unary_capacity_(0), residual_capacity_(0), sparse_current_capacity_(0), compact_capacity_(0) {
+	reserve();
 }
 
 DenseCRF::~DenseCRF() {
-	deallocate( unary_ );
-	deallocate( current_ );
-	deallocate( next_ );
-	deallocate( tmp_ );
+	releaseBuffer( unary_, unary_capacity_ );
+	releaseBuffer( current_, current_capacity_ );
+	releaseBuffer( next_, next_capacity_ );
+	releaseBuffer( tmp_, tmp_capacity_ );
+	releaseBuffer( features_, features_capacity_ );
+	releaseBuffer( accumulators_, accumulators_capacity_ );
+	releaseBuffer( label_values_, label_values_capacity_ );
+	releaseBuffer( chunk_changes_, chunk_changes_capacity_ );
+	releaseBuffer( active_labels_, active_labels_capacity_ );
+	releaseBuffer( active_unary_, active_unary_capacity_ );
+	releaseBuffer( residual_, residual_capacity_ );
+	releaseBuffer( sparse_current_, sparse_current_capacity_ );
+	releaseBuffer( compact_, compact_capacity_ );
 	for( unsigned int i=0; i<pairwise_.size(); i++ )
 		delete pairwise_[i];
+	for( unsigned int i=0; i<spare_potentials_.size(); i++ )
+		delete spare_potentials_[i];
+	delete lattice_buffers_;
+}
+
+void DenseCRF::reserve() {
+	const size_t NM = (size_t)N_*M_;
+	if (lean_)
+		releaseBuffer( accumulators_, accumulators_capacity_ );
+	reserveBuffer( unary_, unary_capacity_, NM, lean_ );
+	reserveBuffer( current_, current_capacity_, NM, lean_ );
+	reserveBuffer( next_, next_capacity_, NM, lean_ );
+	// A tmp_ slice for each potential applied at the same time, see stepInference.
+	// The lean layout applies them one by one, a block of variables at a time,
+	// which only potentials that can work in pieces support.
+	tmp_rows_ = N_;
+	size_t tmp_size = std::max<size_t>( pairwise_.size(), 2 )*NM;
+	if (lean_) {
+		bool chunked_only = true;
+		for( unsigned int i=0; i<pairwise_.size(); i++ )
+			if (!dynamic_cast<PottsPotential*>( pairwise_[i] ) && !dynamic_cast<KnnPotential*>( pairwise_[i] ))
+				chunked_only = false;
+		if (chunked_only)
+			tmp_rows_ = std::min( N_, LEAN_SLICE_ROWS );
+		tmp_size = (size_t)tmp_rows_*M_;
+		// Don't hang on to the tmp_ of the usual layout
+		if (tmp_capacity_ > 2*tmp_size)
+			releaseBuffer( tmp_, tmp_capacity_ );
+	}
+	reserveBuffer( tmp_, tmp_capacity_, tmp_size );
+	// A padded label row and the change statistics for each chunk of expAndNormalize
+	const int chunks = (N_ + NORMALIZE_GRAIN - 1) / NORMALIZE_GRAIN;
+	reserveBuffer( label_values_, label_values_capacity_, chunks*simdPad( M_, meanFieldKernels( M_ ).width ) );
+	reserveBuffer( chunk_changes_, chunk_changes_capacity_, 2*chunks );
+}
+
+void DenseCRF::reset( int N ) {
+	N_ = N;
+	lean_ = memory_budget_ > 0 && estimateMemory( N_, M_, false ) > memory_budget_;
+	if (!lean_) {
+		releaseBuffer( lattice_buffers_->values, lattice_buffers_->values_capacity );
+		releaseBuffer( lattice_buffers_->new_values, lattice_buffers_->new_values_capacity );
+	}
+	reserve();
+	// Stacked in reverse so the potentials are handed out again in the order they were added
+	for( int i=(int)pairwise_.size()-1; i>=0; i-- ){
+		PottsPotential * potts = dynamic_cast<PottsPotential*>( pairwise_[i] );
+		if (potts)
+			spare_potentials_.push_back( potts );
+		else
+			delete pairwise_[i];
+	}
+	pairwise_.clear();
+	initial_marginals_ = NULL;
+	initial_source_ = NULL;
+}
+
+void DenseCRF::setMemoryBudget( size_t bytes ) {
+	memory_budget_ = bytes;
+	reset( N_ );
+}
+
+size_t DenseCRF::estimateMemory( int N, int M, bool lean ) {
+	const size_t NM = (size_t)N*M;
+	const size_t entries = (size_t)N*7;
+	const size_t values = (size_t)N*simdPad( M, latticeKernels( M ).width )*2*sizeof(float);
+	if (!lean) {
+		// Unaries, marginals, messages, two tmp_ slices and an accumulator, and
+		// per lattice the offsets, weights, splat index, neighbours and values
+		const size_t lattice = entries*(3*sizeof(int) + sizeof(LatticeNeighbors) ) + values;
+		return NM*6*sizeof(float) + 2*lattice;
+	}
+	int offset_bits = 1;
+	while( (1 << offset_bits) < N )
+		offset_bits++;
+	// Unaries, marginals, messages and a tmp_ block, per lattice the packed
+	// offsets, weights and neighbours, one set of values and the offsets of the
+	// lattice being built
+	const size_t lattice = entries*offset_bits/8 + entries*(sizeof(float) + sizeof(LatticeNeighbors));
+	return NM*3*sizeof(float) + (size_t)std::min( N, LEAN_SLICE_ROWS )*M*sizeof(float) +
+	       2*lattice + values + entries*sizeof(int);
 }
 
 /////////////////////////////////
 /////  Pairwise Potentials  /////
 /////////////////////////////////
 void DenseCRF::addPairwiseEnergy (const float* features, int D, float w, const SemiMetricFunction * function) {
-	addPairwiseEnergy( new PottsPotential( features, D, N_, w ) );
+	addPairwiseEnergies( 1, &features, &D, &w );
+}
+
+void DenseCRF::addPairwiseEnergies( int n, const float * const * features, const int * D, const float * w ) {
+	// Reuse the lattices of earlier potentials when there are any
+	std::vector<PottsPotential*> potts( n );
+	for( int i=0; i<n; i++ ){
+		if (spare_potentials_.empty())
+			potts[i] = new PottsPotential();
+		else {
+			potts[i] = spare_potentials_.back();
+			spare_potentials_.pop_back();
+		}
+	}
+	// Build the lattices side by side, each of them is parallel on its own too.
+	// Lean lattices share their values, so they are built one after the other.
+	const int options = (lean_ ? LATTICE_COMPACT : 0) | (ordered_lattices_ ? LATTICE_ORDERED : 0);
+	auto build = [&]( int begin, int end ){
+		for( int i=begin; i<end; i++ ){
+			potts[i]->shareBuffers( lean_ ? lattice_buffers_ : NULL );
+			potts[i]->reset( features[i], D[i], N_, w[i], options );
+		}
+	};
+	if (lean_)
+		build( 0, n );
+	else
+		ThreadPool::Instance().ParallelFor( 0, n, 1, build );
+	for( int i=0; i<n; i++ )
+		addPairwiseEnergy( potts[i] );
+	// The lattices are done with the features
+	if (lean_)
+		releaseBuffer( features_, features_capacity_ );
 }
 
 void DenseCRF::addPairwiseEnergy ( PairwisePotential* potential ){
 	pairwise_.push_back( potential );
+	reserve();
 }
 
 DenseCRF2D::DenseCRF2D(int W, int H, int M) : DenseCRF(W*H,M), W_(W), H_(H) {
@@ -123,18 +283,41 @@ DenseCRF2D::~DenseCRF2D() {
 }
 
 void DenseCRF2D::addPairwiseGaussian ( float sx, float sy, float w, const SemiMetricFunction * function ) {
-	float * feature = new float [N_*2];
+	reserveBuffer( features_, features_capacity_, N_*2 );
+	float * feature = features_;
 	for( int j=0; j<H_; j++ )
 		for( int i=0; i<W_; i++ ){
 			feature[(j*W_+i)*2+0] = i / sx;
 			feature[(j*W_+i)*2+1] = j / sy;
 		}
 	addPairwiseEnergy( feature, 2, w, function );
-	delete [] feature;
+}
+
+void DenseCRF2D::addPairwiseGaussianAndBilateral ( float gaussian_sx, float gaussian_sy, float gaussian_w, float sx, float sy, float sr, float sg, float sb, const unsigned char* im, float bilateral_w ) {
+	reserveBuffer( features_, features_capacity_, N_*7 );
+	float * gaussian = features_, * bilateral = features_ + N_*2;
+	ThreadPool::Instance().ParallelFor( 0, H_, 16, [&]( int begin, int end ){
+		for( int j=begin; j<end; j++ )
+			for( int i=0; i<W_; i++ ){
+				const int k = j*W_+i;
+				gaussian[k*2+0] = i / gaussian_sx;
+				gaussian[k*2+1] = j / gaussian_sy;
+				bilateral[k*5+0] = i / sx;
+				bilateral[k*5+1] = j / sy;
+				bilateral[k*5+2] = im[k*3+0] / sr;
+				bilateral[k*5+3] = im[k*3+1] / sg;
+				bilateral[k*5+4] = im[k*3+2] / sb;
+			}
+	});
+	const float * feature[2] = { gaussian, bilateral };
+	const int D[2] = { 2, 5 };
+	const float w[2] = { gaussian_w, bilateral_w };
+	addPairwiseEnergies( 2, feature, D, w );
 }
 
 void DenseCRF2D::addPairwiseBilateral ( float sx, float sy, float sr, float sg, float sb, const unsigned char* im, float w, const SemiMetricFunction * function ) {
-	float * feature = new float [N_*5];
+	reserveBuffer( features_, features_capacity_, N_*5 );
+	float * feature = features_;
 	for( int j=0; j<H_; j++ )
 		for( int i=0; i<W_; i++ ){
 			feature[(j*W_+i)*5+0] = i / sx;
@@ -144,7 +327,6 @@ void DenseCRF2D::addPairwiseBilateral ( float sx, float sy, float sr, float sg,
 			feature[(j*W_+i)*5+4] = im[(i+j*W_)*3+2] / sb;
 		}
 	addPairwiseEnergy( feature, 5, w, function );
-	delete [] feature;
 }
 
 DenseCRF3D::DenseCRF3D(int N, int M, float spatial_stddev, float colour_stddev, float normal_stddev) 
@@ -160,7 +342,8 @@ DenseCRF3D::~DenseCRF3D() {
 void DenseCRF3D::addPairwiseGaussian (const float* surfel_data, float w, const std::vector<int>& valid) {
 	const int features = 6;
 	const int surfel_size = 12;
-	float * feature = new float [N_*features];
+	reserveBuffer( features_, features_capacity_, N_*features );
+	float * feature = features_;
 	for (int i=0; i<N_; i++) {
 	  const int id = valid[i];
 	  int idx = 0;
@@ -179,12 +362,12 @@ void DenseCRF3D::addPairwiseGaussian (const float* surfel_data, float w, const s
 		*/
 	}
 	addPairwiseEnergy(feature, features, w, NULL);
-	delete [] feature;
 }
 
 void DenseCRF3D::addPairwiseBilateral ( const float* surfel_data, float w, const std::vector<int>& valid) {
 	const int features = 6;
-	float * feature = new float [N_*features];
+	reserveBuffer( features_, features_capacity_, N_*features );
+	float * feature = features_;
 	const int surfel_size = 12;
 	for (int i=0; i<N_; i++) {
 	  //Spatial filtering
@@ -209,7 +392,53 @@ void DenseCRF3D::addPairwiseBilateral ( const float* surfel_data, float w, const
 		feature[(i*features)+(idx++)] = static_cast<float>(b) / colour_stddev_;
   }
 	addPairwiseEnergy(feature, features, w, NULL);
-	delete [] feature;
+}
+
+void DenseCRF3D::surfelFeatures ( const float* surfel_data, const std::vector<int>& valid ) {
+	const int features = 6;
+	const int surfel_size = 12;
+	reserveBuffer( features_, features_capacity_, 2*N_*features );
+	float * gaussian = features_;
+	float * bilateral = features_ + N_*features;
+	// One sweep over the surfels fills both feature arrays, exactly as the two
+	// separate calls would
+	ThreadPool::Instance().ParallelFor( 0, N_, 4096, [&]( int begin, int end ){
+		for (int i=begin; i<end; i++) {
+			const float * surfel = surfel_data + valid[i] * surfel_size;
+			float * g = gaussian + i*features;
+			float * b = bilateral + i*features;
+			g[0] = b[0] = surfel[0] / spatial_stddev_;
+			g[1] = b[1] = surfel[1] / spatial_stddev_;
+			g[2] = b[2] = surfel[2] / spatial_stddev_;
+			g[3] = surfel[8] / normal_stddev_;
+			g[4] = surfel[9] / normal_stddev_;
+			g[5] = surfel[10] / normal_stddev_;
+			const int colour = static_cast<int>(surfel[4]);
+			b[3] = static_cast<float>(colour >> 16 & 0xFF) / colour_stddev_;
+			b[4] = static_cast<float>(colour >> 8 & 0xFF) / colour_stddev_;
+			b[5] = static_cast<float>(colour & 0xFF) / colour_stddev_;
+		}
+	});
+}
+
+void DenseCRF3D::addPairwiseGaussianAndBilateral ( const float* surfel_data, float gaussian_w, float bilateral_w, const std::vector<int>& valid) {
+	const int features = 6;
+	surfelFeatures( surfel_data, valid );
+	const float * feature[2] = { features_, features_ + N_*features };
+	const int D[2] = { features, features };
+	const float w[2] = { gaussian_w, bilateral_w };
+	addPairwiseEnergies( 2, feature, D, w );
+}
+
+void DenseCRF3D::addPairwiseKnn ( const float* surfel_data, float gaussian_w, float bilateral_w, const std::vector<int>& valid, int k, float radius ) {
+	const int features = 6;
+	surfelFeatures( surfel_data, valid );
+	const float * feature[2] = { features_, features_ + N_*features };
+	const int D[2] = { features, features };
+	const float w[2] = { gaussian_w, bilateral_w };
+	addPairwiseEnergy( new KnnPotential( N_, 2, feature, D, w, k, radius / spatial_stddev_ ) );
+	if (lean_)
+		releaseBuffer( features_, features_capacity_ );
 }
 
 void DenseCRF3D::addPairwiseNormal ( const float* surfel_data, float w) {
@@ -233,6 +462,10 @@ void DenseCRF3D::addPairwiseNormal ( const float* surfel_data, float w) {
 void DenseCRF::setUnaryEnergy ( const float* unary ) {
 	memcpy( unary_, unary, N_*M_*sizeof(float) );
 }
+void DenseCRF::setInitialMarginals ( const float* marginals, const int* source ) {
+	initial_marginals_ = marginals;
+	initial_source_ = source;
+}
 
 ///////////////////////
 /////  Inference  /////
@@ -264,52 +497,314 @@ void DenseCRF::map ( int n_iterations, short* result, float relax ) {
 	}
 }
 
-float* DenseCRF::runInference( int n_iterations, float relax ) {
+float* DenseCRF::runInference( int n_iterations, float relax, float tolerance, bool mean_change ) {
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point start = Clock::now();
 	startInference();
-	for (int it=0; it<n_iterations; it++)
+	for (iterations_=0; iterations_<n_iterations;) {
+		Clock::time_point step = Clock::now();
+		if (time_budget_ > 0 && std::chrono::duration<double,std::milli>( step - start ).count() + step_time_ > time_budget_)
+			break;
 		stepInference(relax);
+		step_time_ = std::chrono::duration<double,std::milli>( Clock::now() - step ).count();
+		iterations_++;
+		if (tolerance > 0 && (mean_change ? mean_change_ : max_change_) < tolerance)
+			break;
+	}
+	if (sparse_labels_)
+		expandSparseMarginals( unary_ );
 	return current_;
 }
 
-void DenseCRF::expAndNormalize ( float* out, const float* in, float scale, float relax ) {
-	float *V = new float[ N_+10 ];
-	for (int i=0; i<N_; i++) {
-		const float * b = in + i*M_;
-		// Find the max and subtract it so that the exp doesn't explode
-		float mx = scale*b[0];
-		for( int j=1; j<M_; j++ )
-			if( mx < scale*b[j] )
-				mx = scale*b[j];
-		float tt = 0;
-		for( int j=0; j<M_; j++ ){
-			V[j] = fast_exp( scale*b[j]-mx );
-			tt += V[j];
+void DenseCRF::expAndNormalize ( float* out, const float* in, float scale, float relax, bool track_change ) {
+	const MeanFieldKernels & kernels = meanFieldKernels( M_ );
+	const int padded = simdPad( M_, kernels.width );
+	const int chunks = (N_ + NORMALIZE_GRAIN - 1) / NORMALIZE_GRAIN;
+	// The level may have changed since reserve
+	reserveBuffer( label_values_, label_values_capacity_, chunks*padded );
+	ThreadPool::Instance().ParallelFor( 0, N_, NORMALIZE_GRAIN, [&]( int begin, int end ){
+		const int c = begin / NORMALIZE_GRAIN;
+		float max_change = 0;
+		double sum_change = 0;
+		kernels.exp_normalize( out, in, label_values_ + c*padded, begin, end, M_, scale, relax,
+		                       track_change ? &max_change : NULL, &sum_change );
+		chunk_changes_[2*c] = max_change;
+		chunk_changes_[2*c+1] = sum_change;
+	});
+	if (track_change) {
+		// Reduced in chunk order so the result doesn't depend on the thread count
+		float max_change = 0;
+		double sum_change = 0;
+		for( int c=0; c<chunks; c++ ){
+			if (max_change < chunk_changes_[2*c])
+				max_change = chunk_changes_[2*c];
+			sum_change += chunk_changes_[2*c+1];
 		}
-		// Make it a probability
-		for( int j=0; j<M_; j++ )
-			V[j] /= tt;
-		
-		float * a = out + i*M_;
-		for( int j=0; j<M_; j++ )
-			if (relax == 1)
-				a[j] = V[j];
-			else
-				a[j] = (1-relax)*a[j] + relax*V[j];
+		max_change_ = max_change;
+		mean_change_ = N_*M_ > 0 ? sum_change / (N_*M_) : 0;
 	}
-	delete[] V;
 }
 
 void DenseCRF::startInference(){
+	sparse_labels_ = label_budget_ > 0 && label_budget_ < M_;
+	if (sparse_labels_) {
+		startSparseInference( unary_ );
+		return;
+	}
 	// Initialize using the unary energies
 	expAndNormalize( current_, unary_, -1 );
+	// and replace them with the warm start where there is one
+	if (initial_marginals_) {
+		for( int i=0; i<N_; i++ )
+			if (initial_source_[i] >= 0)
+				memcpy( current_+i*M_, initial_marginals_+(size_t)initial_source_[i]*M_, M_*sizeof(float) );
+		initial_marginals_ = NULL;
+		initial_source_ = NULL;
+	}
 }
 
 void DenseCRF::stepInference( float relax ){
+	if (sparse_labels_) {
+		stepSparseInference( relax );
+		return;
+	}
 	for( int i=0; i<N_*M_; i++ )
 		next_[i] = -unary_[i];
 	// Add up all pairwise potentials
-	for( unsigned int i=0; i<pairwise_.size(); i++ )
-		pairwise_[i]->apply( next_, current_, tmp_, M_ );
+	const int n_pairwise = pairwise_.size();
+	ThreadPool & pool = ThreadPool::Instance();
+	if (lean_ || pool.num_threads() == 1 || n_pairwise < 2) {
+		for( int i=0; i<n_pairwise; i++ )
+			pairwise_[i]->applyChunked( next_, current_, tmp_, tmp_rows_, M_ );
+	}
+	else {
+		// Apply the potentials at the same time, each with its own tmp_ slice. The
+		// first adds into next_, the others into cleared accumulators that are
+		// summed in potential order afterwards, which gives the serial result.
+		const size_t NM = (size_t)N_*M_;
+		reserveBuffer( accumulators_, accumulators_capacity_, (n_pairwise-1)*NM );
+		pool.ParallelFor( 0, n_pairwise, 1, [&]( int begin, int end ){
+			for( int p=begin; p<end; p++ ){
+				float * out = p ? accumulators_+(p-1)*NM : next_;
+				if (p)
+					memset( out, 0, NM*sizeof(float) );
+				pairwise_[p]->apply( out, current_, tmp_+p*NM, M_ );
+			}
+		});
+		pool.ParallelFor( 0, N_*M_, 16384, [&]( int begin, int end ){
+			for( int p=1; p<n_pairwise; p++ ){
+				const float * acc = accumulators_+(p-1)*NM;
+				for( int i=begin; i<end; i++ )
+					next_[i] += acc[i];
+			}
+		});
+	}
 	// Exponentiate and normalize
-	expAndNormalize( current_, next_, 1.0, relax );
+	expAndNormalize( current_, next_, 1.0, relax, true );
+}
+
+void DenseCRF::startSparseInference( const float * unary ){
+	const int K = label_budget_, K1 = K+1;
+	reserveBuffer( active_labels_, active_labels_capacity_, (size_t)N_*K );
+	reserveBuffer( active_unary_, active_unary_capacity_, (size_t)N_*K );
+	reserveBuffer( sparse_current_, sparse_current_capacity_, (size_t)N_*K1 );
+	// The marginals of the unaries go in current_, which isn't needed before expandSparseMarginals
+	expAndNormalize( current_, unary, -1 );
+	ThreadPool::Instance().ParallelFor( 0, N_, NORMALIZE_GRAIN, [&]( int begin, int end ){
+		for( int i=begin; i<end; i++ ){
+			const float * u = unary + (size_t)i*M_;
+			float * p = current_ + (size_t)i*M_;
+			int * labels = active_labels_ + (size_t)i*K;
+			float * energies = active_unary_ + (size_t)i*K;
+			// The K lowest energies in increasing order, the lower label first on ties
+			int found = 0;
+			for( int l=0; l<M_; l++ ){
+				if (found == K && u[l] >= energies[K-1])
+					continue;
+				int e = found < K ? found++ : K-1;
+				for( ; e>0 && u[l] < energies[e-1]; e-- ){
+					energies[e] = energies[e-1];
+					labels[e] = labels[e-1];
+				}
+				energies[e] = u[l];
+				labels[e] = l;
+			}
+			// The marginals of the kept labels and the bucket, leaving the marginals
+			// of the other labels in p for the residuals below
+			float * q = sparse_current_ + (size_t)i*K1;
+			for( int s=0; s<K; s++ ){
+				q[s] = p[labels[s]];
+				p[labels[s]] = 0;
+			}
+			float rest = 0;
+			for( int l=0; l<M_; l++ )
+				rest += p[l];
+			q[K] = rest;
+		}
+	});
+	// A compact channel, in label order, for each label whose kept marginals add up
+	// to label_mass_ per variable, the other labels all sharing the last channel
+	std::vector<double> mass( M_, 0.0 );
+	for( int i=0; i<N_; i++ )
+		for( int s=0; s<K; s++ )
+			mass[active_labels_[(size_t)i*K+s]] += sparse_current_[(size_t)i*K1+s];
+	label_channels_.assign( M_, -1 );
+	active_channels_ = 0;
+	for( int l=0; l<M_; l++ )
+		if (mass[l] >= (double)label_mass_*N_)
+			label_channels_[l] = active_channels_++;
+	for( int l=0; l<M_; l++ )
+		if (label_channels_[l] < 0)
+			label_channels_[l] = active_channels_;
+	const size_t C1 = active_channels_+1;
+	reserveBuffer( compact_, compact_capacity_, 2*N_*C1 );
+	// The compact values may be wider than M when nearly every label is in use
+	reserveBuffer( tmp_, tmp_capacity_, (size_t)tmp_rows_*C1 );
+	// No messages before the first step, see expandSparseMarginals
+	memset( compact_ + (size_t)N_*C1, 0, (size_t)N_*C1*sizeof(float) );
+	// The residual of each channel: log( sum exp(-u) ) over the labels in it that
+	// a variable leaves out, from their marginals and the normaliser
+	// log Z = -u - log p of the most likely label, or -inf (-FLT_MAX) for none
+	reserveBuffer( residual_, residual_capacity_, (size_t)N_*C1 );
+	ThreadPool::Instance().ParallelFor( 0, N_, NORMALIZE_GRAIN, [&]( int begin, int end ){
+		for( int i=begin; i<end; i++ ){
+			const float * p = current_ + (size_t)i*M_;
+			const int * labels = active_labels_ + (size_t)i*K;
+			float * q = sparse_current_ + (size_t)i*K1;
+			float * residual = residual_ + (size_t)i*C1;
+			const float log_z = -active_unary_[(size_t)i*K] - log( q[0] );
+			for( size_t c=0; c<C1; c++ )
+				residual[c] = 0;
+			for( int l=0; l<M_; l++ )
+				residual[label_channels_[l]] += p[l];
+			for( size_t c=0; c<C1; c++ )
+				residual[c] = residual[c] > 1e-30f ? log( residual[c] ) + log_z : -FLT_MAX;
+			// Start from the warm start where there is one
+			if (initial_marginals_ && initial_source_[i] >= 0) {
+				const float * m = initial_marginals_ + (size_t)initial_source_[i]*M_;
+				float kept = 0;
+				for( int s=0; s<K; s++ )
+					kept += q[s] = m[labels[s]];
+				q[K] = kept < 1 ? 1-kept : 0;
+			}
+		}
+	});
+	initial_marginals_ = NULL;
+	initial_source_ = NULL;
+}
+
+void DenseCRF::stepSparseInference( float relax ){
+	const int K = label_budget_, K1 = K+1, C = active_channels_, C1 = C+1;
+	float * compact_in = compact_, * compact_out = compact_ + (size_t)N_*C1;
+	ThreadPool & pool = ThreadPool::Instance();
+	// Each variable's marginals in the compact channels. The bucket is split
+	// between the channels of the labels it holds by their residuals and the
+	// messages of the last step (compact_out), as mean-field would weight those
+	// labels. The last channel is the mean over the labels without a channel of
+	// their own.
+	pool.ParallelFor( 0, N_, NORMALIZE_GRAIN, [&]( int begin, int end ){
+		for( int i=begin; i<end; i++ ){
+			const float * q = sparse_current_ + (size_t)i*K1;
+			const int * labels = active_labels_ + (size_t)i*K;
+			const float * residual = residual_ + (size_t)i*C1;
+			const float * out = compact_out + (size_t)i*C1;
+			float * in = compact_in + (size_t)i*C1;
+			float mx = -FLT_MAX;
+			for( int c=0; c<C1; c++ ){
+				in[c] = residual[c] + out[c];
+				mx = in[c] > mx ? in[c] : mx;
+			}
+			float total = 0;
+			for( int c=0; c<C1; c++ )
+				total += in[c] = residual[c] > -FLT_MAX ? exp( in[c] - mx ) : 0;
+			const float scale = total > 0 ? q[K] / total : 0;
+			for( int c=0; c<C1; c++ )
+				in[c] *= scale;
+			for( int s=0; s<K; s++ )
+				in[label_channels_[labels[s]]] += q[s];
+			in[C] = M_ > C ? in[C] / (M_-C) : 0;
+		}
+	});
+	memset( compact_out, 0, (size_t)N_*C1*sizeof(float) );
+	for( unsigned int p=0; p<pairwise_.size(); p++ )
+		pairwise_[p]->applyChunked( compact_out, compact_in, tmp_, tmp_rows_, C1 );
+	// The energies of a variable go in its chunk's label row, which holds M > K floats
+	const int chunks = (N_ + NORMALIZE_GRAIN - 1) / NORMALIZE_GRAIN;
+	const int padded = simdPad( M_, meanFieldKernels( M_ ).width );
+	pool.ParallelFor( 0, N_, NORMALIZE_GRAIN, [&]( int begin, int end ){
+		const int chunk = begin / NORMALIZE_GRAIN;
+		float max_change = 0;
+		double sum_change = 0;
+		float * e = label_values_ + chunk*padded;
+		for( int i=begin; i<end; i++ ){
+			const float * out = compact_out + (size_t)i*C1;
+			const int * labels = active_labels_ + (size_t)i*K;
+			const float * energies = active_unary_ + (size_t)i*K;
+			float * q = sparse_current_ + (size_t)i*K1;
+			const float * residual = residual_ + (size_t)i*C1;
+			// The bucket's energy, log( sum exp(-u + message) ) over the labels it holds
+			float bucket_mx = -FLT_MAX;
+			for( int c=0; c<C1; c++ )
+				bucket_mx = residual[c] + out[c] > bucket_mx ? residual[c] + out[c] : bucket_mx;
+			float bucket = 0;
+			for( int c=0; c<C1; c++ )
+				if (residual[c] > -FLT_MAX)
+					bucket += exp( residual[c] + out[c] - bucket_mx );
+			float mx = e[K] = bucket > 0 ? bucket_mx + log( bucket ) : -FLT_MAX;
+			for( int s=0; s<K; s++ ){
+				e[s] = out[label_channels_[labels[s]]] - energies[s];
+				mx = e[s] > mx ? e[s] : mx;
+			}
+			float total = 0;
+			for( int s=0; s<K1; s++ )
+				total += e[s] = exp( e[s] - mx );
+			for( int s=0; s<K1; s++ ){
+				const float value = (1-relax)*q[s] + relax*e[s]/total;
+				const float c = value > q[s] ? value - q[s] : q[s] - value;
+				sum_change += c;
+				max_change = c > max_change ? c : max_change;
+				q[s] = value;
+			}
+		}
+		chunk_changes_[2*chunk] = max_change;
+		chunk_changes_[2*chunk+1] = sum_change;
+	});
+	float max_change = 0;
+	double sum_change = 0;
+	for( int c=0; c<chunks; c++ ){
+		if (max_change < chunk_changes_[2*c])
+			max_change = chunk_changes_[2*c];
+		sum_change += chunk_changes_[2*c+1];
+	}
+	max_change_ = max_change;
+	mean_change_ = N_ > 0 ? sum_change / ((double)N_*K1) : 0;
+}
+
+void DenseCRF::expandSparseMarginals( const float * unary ){
+	const int K = label_budget_, K1 = K+1, C1 = active_channels_+1;
+	const float * messages = compact_ + (size_t)N_*C1;
+	// The bucket is shared in proportion to the marginals of the unaries, weighted
+	// by the last messages of the labels' channels (none without a step)
+	expAndNormalize( current_, unary, -1 );
+	ThreadPool::Instance().ParallelFor( 0, N_, NORMALIZE_GRAIN, [&]( int begin, int end ){
+		for( int i=begin; i<end; i++ ){
+			const float * q = sparse_current_ + (size_t)i*K1;
+			const int * labels = active_labels_ + (size_t)i*K;
+			const float * message = messages + (size_t)i*C1;
+			float * out = current_ + (size_t)i*M_;
+			for( int s=0; s<K; s++ )
+				out[labels[s]] = 0;
+			float mx = -FLT_MAX;
+			for( int c=0; c<C1; c++ )
+				mx = message[c] > mx ? message[c] : mx;
+			float rest = 0;
+			for( int l=0; l<M_; l++ )
+				rest += out[l] *= exp( message[label_channels_[l]] - mx );
+			const float scale = rest > 0 ? q[K] / rest : 0;
+			for( int l=0; l<M_; l++ )
+				out[l] *= scale;
+			for( int s=0; s<K; s++ )
+				out[labels[s]] = q[s];
+		}
+	});
 }
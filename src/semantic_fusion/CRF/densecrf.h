@@ -30,10 +30,15 @@
 #include <vector>
 #include <cstdlib>
 
+class PottsPotential;
+struct LatticeBuffers;
 class PairwisePotential{
 public:
 	virtual ~PairwisePotential();
 	virtual void apply( float * out_values, const float * in_values, float * tmp, int value_size ) const = 0;
+	// apply with room in tmp for only tmp_rows variables. Potentials that can work in
+	// pieces override this, the default needs tmp_rows to cover every variable.
+	virtual void applyChunked( float * out_values, const float * in_values, float * tmp, int tmp_rows, int value_size ) const;
 };
 class SemiMetricFunction{
 public:
@@ -49,13 +54,65 @@ protected:
 	// Number of variables and labels
 	int N_, M_;
 	float *unary_, *additional_unary_, *current_, *next_, *tmp_;
+	// Per chunk label scratch of expAndNormalize and feature scratch of the derived classes
+	float *label_values_, *features_;
+	// Pairwise messages of all but the first potential when they are applied concurrently
+	float *accumulators_;
+	// Largest and summed change of each chunk of expAndNormalize
+	double *chunk_changes_;
+	// Largest and mean change of a probability in the last step
+	float max_change_, mean_change_;
+	// Steps the last runInference took
+	int iterations_;
+	// Memory budget, whether it calls for the lean layout, the variables tmp_ holds
+	// and the lattice values the lean layout shares between its potentials
+	size_t memory_budget_;
+	bool lean_;
+	int tmp_rows_;
+	LatticeBuffers *lattice_buffers_;
+	// Number lattice vertices along a space filling curve, see setOrderedLattices
+	bool ordered_lattices_;
+	// Labels kept per variable by the sparse mode and the mass a label needs for a
+	// channel of its own, see setLabelBudget, and whether inference runs in it
+	int label_budget_;
+	float label_mass_;
+	bool sparse_labels_;
+	// Sparse mode state: the kept labels of each variable with their unaries, the
+	// log of the summed exp(-unary) of the others in each channel, the marginals of the kept
+	// labels followed by that of the other bucket, and the compact input and
+	// output of the potentials. label_channels_ is the compact channel of each
+	// label and active_channels_ the number of labels with one of their own, the
+	// channel after them being shared by the rest.
+	int *active_labels_;
+	float *active_unary_, *residual_, *sparse_current_, *compact_;
+	std::vector<int> label_channels_;
+	int active_channels_;
+	// Warm start of the next inference, see setInitialMarginals
+	const float *initial_marginals_;
+	const int *initial_source_;
+	// Time budget of runInference and the time its last step took, in milliseconds
+	double time_budget_, step_time_;
+	// Allocated sizes of the buffers, they are kept by reset
+	size_t unary_capacity_, current_capacity_, next_capacity_, tmp_capacity_, label_values_capacity_, features_capacity_, accumulators_capacity_, chunk_changes_capacity_;
+	size_t active_labels_capacity_, active_unary_capacity_, residual_capacity_, sparse_current_capacity_, compact_capacity_;
 	
 	// Store all pairwise potentials
 	std::vector<PairwisePotential*> pairwise_;
+	// Potts potentials dropped by reset, addPairwiseEnergy reuses their lattices
+	std::vector<PottsPotential*> spare_potentials_;
+	
+	// Grow the buffers to hold N_ variables
+	void reserve();
+	// Add n Potts potentials, building their lattices concurrently
+	void addPairwiseEnergies( int n, const float * const * features, const int * D, const float * w );
 	
 	
 	// Auxillary functions
-	void expAndNormalize( float* out, const float* in, float scale = 1.0, float relax = 1.0 );
+	void expAndNormalize( float* out, const float* in, float scale = 1.0, float relax = 1.0, bool track_change = false );
+	// The steps of the sparse mode, and the expansion of its result into current_
+	void startSparseInference( const float * unary );
+	void stepSparseInference( float relax );
+	void expandSparseMarginals( const float * unary );
 	
 	// Don't copy this object, bad stuff will happen
 	DenseCRF( DenseCRF & o ){}
@@ -63,6 +120,45 @@ public:
 	// Create a dense CRF model of size N with M labels
 	DenseCRF( int N, int M );
 	virtual ~DenseCRF();
+	// Start over with N variables and no pairwise potentials. All memory is kept,
+	// so setting up a problem no larger than an earlier one doesn't allocate.
+	void reset( int N );
+	
+	// Keep the CRF within about bytes of memory, 0 (the default) for no limit. When
+	// the usual layout wouldn't fit the CRF switches to a lean one: compact lattices
+	// with bit-packed offsets sharing one set of vertex values, and potentials
+	// applied one after the other, each sliced into a block of variables at a
+	// time. The unaries, marginals and lattice values all stay float, so the result
+	// is that of the usual layout. There is no reduced precision storage and no in
+	// place update: every potential splats the old marginals before any of them is
+	// replaced, so next_ is needed next to current_. Like reset it drops the
+	// pairwise potentials.
+	void setMemoryBudget( size_t bytes );
+	
+	// Number the vertices of the lattices built from now on along a Morton curve
+	// over their lattice keys, instead of in the order the variables first use
+	// them. This keeps the blur close to sequential in memory when the variables
+	// are not in a spatially coherent order themselves, at the cost of a sort.
+	void setOrderedLattices( bool ordered ) { ordered_lattices_ = ordered; }
+	// Approximate inference keeping only the k labels of lowest unary energy for
+	// each variable plus one bucket for all the others, 0 (the default) for exact
+	// inference over all M labels. Within the bucket each label is weighted by its
+	// unary and the message of its channel, as in exact inference. The potentials
+	// filter one channel for each label whose kept marginals add up to at least
+	// min_mass per variable when inference starts, and one shared by the rest, so
+	// the cost of a step falls from M values per lattice vertex to the number of
+	// labels the scene actually shows. The result matches exact inference when
+	// every label gets a channel; a label kept by only a few variables gets the
+	// message of the shared channel, which is where the approximation lies.
+	void setLabelBudget( int k, float min_mass = 1e-2f ) { label_budget_ = k; label_mass_ = min_mass; }
+	int labelBudget() const { return label_budget_; }
+	// Channels the potentials filtered in the last inference, the shared one included
+	int activeChannels() const { return sparse_labels_ ? active_channels_+1 : M_; }
+	size_t memoryBudget() const { return memory_budget_; }
+	bool lean() const { return lean_; }
+	// Rough size of either layout for N variables and M labels with two 6D
+	// potentials, taking the lattices to have about as many vertices as variables
+	static size_t estimateMemory( int N, int M, bool lean );
 	// Add  a pairwise potential defined over some feature space
 	// The potential will have the form:    w*exp(-0.5*|f_i - f_j|^2)
 	// The kernel shape should be captured by transforming the
@@ -75,6 +171,11 @@ public:
 	// Set the unary potential for all variables and labels (memory order is [x0l0 x0l1 x0l2 .. x1l0 x1l1 ...])
 	void setUnaryEnergy( const float * unary );
 	
+	// Warm start the next inference from earlier marginals: variable i starts from
+	// marginals + source[i]*M, or from its unary if source[i] < 0. Both arrays must
+	// stay valid until inference starts.
+	void setInitialMarginals( const float * marginals, const int * source );
+	
 	// Run inference and return the probabilities
 	void inference( int n_iterations, float* result, float relax=1.0 );
 	
@@ -85,8 +186,22 @@ public:
 	void startInference();
 	void stepInference( float relax = 1.0 );
 
-	// Run inference and return the pointer to the result
-	float* runInference( int n_iterations, float relax);
+	// Stop runInference before a step that would end more than ms milliseconds
+	// after it started, taking the step to last as long as the previous one (of
+	// an earlier inference for the first step). 0 (the default) for no limit. It
+	// may run no step at all, leaving the marginals of the unaries.
+	void setTimeBudget( double ms ) { time_budget_ = ms; }
+	double timeBudget() const { return time_budget_; }
+	
+	// Run inference and return the pointer to the result. With a positive tolerance
+	// it stops before n_iterations once a step changes no probability by more than
+	// tolerance (or, with mean_change, changes them by less than that on average).
+	float* runInference( int n_iterations, float relax, float tolerance = 0, bool mean_change = false );
+	// Number of steps the last runInference ran
+	int iterations() const { return iterations_; }
+	// Largest and mean change of a probability in the last step
+	float maxChange() const { return max_change_; }
+	float meanChange() const { return mean_change_; }
 };
 
 class DenseCRF2D:public DenseCRF{
@@ -102,6 +217,9 @@ public:
 	
 	// Add a Bilateral pairwise potential with spacial standard deviations sx, sy and color standard deviations sr,sg,sb
 	void addPairwiseBilateral( float sx, float sy, float sr, float sg, float sb, const unsigned char * im, float w, const SemiMetricFunction * function=NULL );
+	// Both of the above with Potts compatibility, building the two lattices concurrently
+	void addPairwiseGaussianAndBilateral( float gaussian_sx, float gaussian_sy, float gaussian_w,
+	                                      float sx, float sy, float sr, float sg, float sb, const unsigned char * im, float bilateral_w );
 };
 
 class DenseCRF3D:public DenseCRF{
@@ -109,6 +227,8 @@ protected:
   const float spatial_stddev_;
   const float colour_stddev_;
   const float normal_stddev_;
+	// Fill features_ with the Gaussian then the bilateral features of the surfels
+	void surfelFeatures(const float* surfel_data, const std::vector<int>& valid);
 public:
 	// Create a 2d dense CRF model of size W x H with M labels
 	DenseCRF3D(int N, int M, float spatial_stddev, float colour_stddev, float normal_stddev );
@@ -117,6 +237,11 @@ public:
 	void addPairwiseGaussian(const float* surfel_data, float w, const std::vector<int>& valid);
 	// Add a Bilateral pairwise potential with spacial standard deviations sx, sy and color standard deviations sr,sg,sb
 	void addPairwiseBilateral(const float* surfel_data, float w, const std::vector<int>& valid);
+	// Both of the above from a single pass over the surfels, building the two lattices concurrently
+	void addPairwiseGaussianAndBilateral(const float* surfel_data, float gaussian_w, float bilateral_w, const std::vector<int>& valid);
+	// The same two kernels over a sparse graph of each surfel's k nearest neighbours
+	// within radius metres instead of the lattice, see KnnPotential
+	void addPairwiseKnn(const float* surfel_data, float gaussian_w, float bilateral_w, const std::vector<int>& valid, int k, float radius);
 	// Add a Bilateral pairwise potential with spacial standard deviations sx, sy and color standard deviations sr,sg,sb
 	void addPairwiseNormal(const float* surfel_data, float w);
 };
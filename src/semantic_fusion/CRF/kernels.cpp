@@ -0,0 +1,473 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#include "kernels.h"
+#include <immintrin.h>
+
+// The passes below are written once against a small set of vector operations
+// and always inlined into per instruction set entry points, the AVX2 ones
+// carrying a target attribute so the rest of the build stays at SSE.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#define KERNEL_INLINE __attribute__((always_inline)) inline
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+// The mantissa bits of a with the exponent of 0.5
+static inline __m128 sse_mantissa( __m128 a ) {
+	return _mm_or_ps( _mm_and_ps( a, _mm_castsi128_ps( _mm_set1_epi32( 0x807fffff ) ) ), _mm_set1_ps( 0.5f ) );
+}
+
+struct ScalarOps {
+	typedef float V;
+	static const int W = 1;
+	static inline V set1( float a ) { return a; }
+	static inline V load( const float * p ) { return *p; }
+	static inline V loadu( const float * p ) { return *p; }
+	static inline void store( float * p, V v ) { *p = v; }
+	static inline void storeu( float * p, V v ) { *p = v; }
+	static inline V add( V a, V b ) { return a + b; }
+	static inline V mul( V a, V b ) { return a * b; }
+	static inline V sub( V a, V b ) { return a - b; }
+	static inline V max( V a, V b ) { return a > b ? a : b; }
+	static inline V min( V a, V b ) { return a < b ? a : b; }
+	static inline float hmax( V a ) { return a; }
+	static inline float hsum( V a ) { return a; }
+	// Nearest integer, and 2^n for an integral n in [-126, 127]
+	static inline V round( V a ) { return (float)_mm_cvtss_si32( _mm_set_ss( a ) ); }
+	static inline V pow2( V n ) { return _mm_cvtss_f32( _mm_castsi128_ps( _mm_slli_epi32( _mm_cvtsi32_si128( (int)n + 127 ), 23 ) ) ); }
+	static inline V div( V a, V b ) { return a / b; }
+	// Comparison masks are 1 or 0 here, select( mask, a, b ) is mask ? a : b
+	static inline V less( V a, V b ) { return a < b ? 1.f : 0.f; }
+	static inline V select( V mask, V a, V b ) { return mask != 0.f ? a : b; }
+	// A positive normal a as mantissa( a ) * 2^exponent( a ), the mantissa in [0.5, 1)
+	static inline V mantissa( V a ) { return _mm_cvtss_f32( sse_mantissa( _mm_set_ss( a ) ) ); }
+	static inline V exponent( V a ) { return (float)( ( _mm_cvtsi128_si32( _mm_castps_si128( _mm_set_ss( a ) ) ) >> 23 ) - 126 ); }
+};
+
+struct SseOps {
+	typedef __m128 V;
+	static const int W = 4;
+	static inline V set1( float a ) { return _mm_set1_ps( a ); }
+	static inline V load( const float * p ) { return _mm_load_ps( p ); }
+	static inline V loadu( const float * p ) { return _mm_loadu_ps( p ); }
+	static inline void store( float * p, V v ) { _mm_store_ps( p, v ); }
+	static inline void storeu( float * p, V v ) { _mm_storeu_ps( p, v ); }
+	static inline V add( V a, V b ) { return _mm_add_ps( a, b ); }
+	static inline V mul( V a, V b ) { return _mm_mul_ps( a, b ); }
+	static inline V sub( V a, V b ) { return _mm_sub_ps( a, b ); }
+	static inline V max( V a, V b ) { return _mm_max_ps( a, b ); }
+	static inline V min( V a, V b ) { return _mm_min_ps( a, b ); }
+	static inline float hmax( V a ) {
+		a = _mm_max_ps( a, _mm_movehl_ps( a, a ) );
+		return _mm_cvtss_f32( _mm_max_ss( a, _mm_shuffle_ps( a, a, 1 ) ) );
+	}
+	static inline float hsum( V a ) {
+		a = _mm_add_ps( a, _mm_movehl_ps( a, a ) );
+		return _mm_cvtss_f32( _mm_add_ss( a, _mm_shuffle_ps( a, a, 1 ) ) );
+	}
+	static inline V round( V a ) { return _mm_cvtepi32_ps( _mm_cvtps_epi32( a ) ); }
+	static inline V pow2( V n ) { return _mm_castsi128_ps( _mm_slli_epi32( _mm_add_epi32( _mm_cvttps_epi32( n ), _mm_set1_epi32( 127 ) ), 23 ) ); }
+	static inline V div( V a, V b ) { return _mm_div_ps( a, b ); }
+	static inline V less( V a, V b ) { return _mm_cmplt_ps( a, b ); }
+	static inline V select( V mask, V a, V b ) { return _mm_or_ps( _mm_and_ps( mask, a ), _mm_andnot_ps( mask, b ) ); }
+	static inline V mantissa( V a ) { return sse_mantissa( a ); }
+	static inline V exponent( V a ) { return _mm_cvtepi32_ps( _mm_sub_epi32( _mm_srli_epi32( _mm_castps_si128( a ), 23 ), _mm_set1_epi32( 126 ) ) ); }
+};
+
+struct Avx2Ops {
+	typedef __m256 V;
+	static const int W = 8;
+	AVX2_TARGET static inline V set1( float a ) { return _mm256_set1_ps( a ); }
+	AVX2_TARGET static inline V load( const float * p ) { return _mm256_load_ps( p ); }
+	AVX2_TARGET static inline V loadu( const float * p ) { return _mm256_loadu_ps( p ); }
+	AVX2_TARGET static inline void store( float * p, V v ) { _mm256_store_ps( p, v ); }
+	AVX2_TARGET static inline void storeu( float * p, V v ) { _mm256_storeu_ps( p, v ); }
+	AVX2_TARGET static inline V add( V a, V b ) { return _mm256_add_ps( a, b ); }
+	AVX2_TARGET static inline V mul( V a, V b ) { return _mm256_mul_ps( a, b ); }
+	AVX2_TARGET static inline V sub( V a, V b ) { return _mm256_sub_ps( a, b ); }
+	AVX2_TARGET static inline V max( V a, V b ) { return _mm256_max_ps( a, b ); }
+	AVX2_TARGET static inline V min( V a, V b ) { return _mm256_min_ps( a, b ); }
+	AVX2_TARGET static inline float hmax( V a ) {
+		return SseOps::hmax( _mm_max_ps( _mm256_castps256_ps128( a ), _mm256_extractf128_ps( a, 1 ) ) );
+	}
+	AVX2_TARGET static inline float hsum( V a ) {
+		return SseOps::hsum( _mm_add_ps( _mm256_castps256_ps128( a ), _mm256_extractf128_ps( a, 1 ) ) );
+	}
+	AVX2_TARGET static inline V round( V a ) { return _mm256_cvtepi32_ps( _mm256_cvtps_epi32( a ) ); }
+	AVX2_TARGET static inline V pow2( V n ) { return _mm256_castsi256_ps( _mm256_slli_epi32( _mm256_add_epi32( _mm256_cvttps_epi32( n ), _mm256_set1_epi32( 127 ) ), 23 ) ); }
+	AVX2_TARGET static inline V div( V a, V b ) { return _mm256_div_ps( a, b ); }
+	AVX2_TARGET static inline V less( V a, V b ) { return _mm256_cmp_ps( a, b, _CMP_LT_OQ ); }
+	AVX2_TARGET static inline V select( V mask, V a, V b ) { return _mm256_blendv_ps( b, a, mask ); }
+	AVX2_TARGET static inline V mantissa( V a ) {
+		return _mm256_or_ps( _mm256_and_ps( a, _mm256_castsi256_ps( _mm256_set1_epi32( 0x807fffff ) ) ), _mm256_set1_ps( 0.5f ) );
+	}
+	AVX2_TARGET static inline V exponent( V a ) {
+		return _mm256_cvtepi32_ps( _mm256_sub_epi32( _mm256_srli_epi32( _mm256_castps_si256( a ), 23 ), _mm256_set1_epi32( 126 ) ) );
+	}
+};
+
+template<class Ops>
+KERNEL_INLINE void splat_impl( float * values, const float * in, const int * offset, const float * weight,
+                               int n, int d1, int value_size, int padded_size ) {
+	const int full = value_size / Ops::W * Ops::W;
+	for( int i=0; i<n; i++ ){
+		const float * x = in + i*value_size;
+		for( int j=0; j<d1; j++ ){
+			float * y = values + (offset[i*d1+j]+1)*padded_size;
+			const float w = weight[i*d1+j];
+			const typename Ops::V vw = Ops::set1( w );
+			int k = 0;
+			for( ; k<full; k+=Ops::W )
+				Ops::store( y+k, Ops::add( Ops::load( y+k ), Ops::mul( vw, Ops::loadu( x+k ) ) ) );
+			for( ; k<value_size; k++ )
+				y[k] += w * x[k];
+		}
+	}
+}
+
+template<class Ops>
+KERNEL_INLINE void gather_impl( float * values, const float * in, const int * index, const int * start, const float * weight,
+                                int begin, int end, int d1, int value_size, int padded_size ) {
+	const int full = value_size / Ops::W * Ops::W;
+	for( int v=begin; v<end; v++ ){
+		float * y = values + (v+1)*padded_size;
+		for( int e=start[v]; e<start[v+1]; e++ ){
+			const float * x = in + (index[e]/d1)*value_size;
+			const float w = weight[index[e]];
+			const typename Ops::V vw = Ops::set1( w );
+			int k = 0;
+			for( ; k<full; k+=Ops::W )
+				Ops::store( y+k, Ops::add( Ops::load( y+k ), Ops::mul( vw, Ops::loadu( x+k ) ) ) );
+			for( ; k<value_size; k++ )
+				y[k] += w * x[k];
+		}
+	}
+}
+
+template<class Ops>
+KERNEL_INLINE void blur_impl( float * new_values, const float * values, const LatticeNeighbors * neighbors,
+                              int begin, int end, int padded_size ) {
+	const typename Ops::V half = Ops::set1( 0.5f );
+	for( int i=begin; i<end; i++ ){
+		const float * old_val = values + (i+1)*padded_size;
+		const float * n1_val = values + (neighbors[i].n1+1)*padded_size;
+		const float * n2_val = values + (neighbors[i].n2+1)*padded_size;
+		float * new_val = new_values + (i+1)*padded_size;
+		for( int k=0; k<padded_size; k+=Ops::W )
+			Ops::store( new_val+k, Ops::add( Ops::load( old_val+k ),
+			            Ops::mul( half, Ops::add( Ops::load( n1_val+k ), Ops::load( n2_val+k ) ) ) ) );
+	}
+}
+
+template<class Ops>
+KERNEL_INLINE void slice_impl( float * out, const float * values, const int * offset, const float * weight,
+                               int n, int d1, float alpha, int value_size, int padded_size ) {
+	const int full = value_size / Ops::W * Ops::W;
+	for( int i=0; i<n; i++ ){
+		float * y = out + i*value_size;
+		for( int j=0; j<d1; j++ ){
+			const float * x = values + (offset[i*d1+j]+1)*padded_size;
+			const float w = weight[i*d1+j]*alpha;
+			const typename Ops::V vw = Ops::set1( w );
+			int k = 0;
+			if (j == 0) {
+				for( ; k<full; k+=Ops::W )
+					Ops::storeu( y+k, Ops::mul( vw, Ops::load( x+k ) ) );
+				for( ; k<value_size; k++ )
+					y[k] = w * x[k];
+			}
+			else {
+				for( ; k<full; k+=Ops::W )
+					Ops::storeu( y+k, Ops::add( Ops::loadu( y+k ), Ops::mul( vw, Ops::load( x+k ) ) ) );
+				for( ; k<value_size; k++ )
+					y[k] += w * x[k];
+			}
+		}
+	}
+}
+
+// exp(x) as in Cephes: x = n*ln(2) + r with |r| <= ln(2)/2 (ln(2) split in two
+// constants so r stays exact), a degree 6 polynomial for exp(r) and 2^n built in
+// the exponent bits. x is clamped to [-87.3, 88.3] so that no branch is needed.
+template<class Ops>
+KERNEL_INLINE typename Ops::V exp_impl( const typename Ops::V & in ) {
+	typedef typename Ops::V V;
+	const V x = Ops::min( Ops::max( in, Ops::set1( -87.3f ) ), Ops::set1( 88.3f ) );
+	const V n = Ops::round( Ops::mul( x, Ops::set1( 1.44269504088896341f ) ) );
+	const V r = Ops::sub( Ops::sub( x, Ops::mul( n, Ops::set1( 0.693359375f ) ) ), Ops::mul( n, Ops::set1( -2.12194440e-4f ) ) );
+	V p = Ops::set1( 1.9875691500e-4f );
+	p = Ops::add( Ops::mul( p, r ), Ops::set1( 1.3981999507e-3f ) );
+	p = Ops::add( Ops::mul( p, r ), Ops::set1( 8.3334519073e-3f ) );
+	p = Ops::add( Ops::mul( p, r ), Ops::set1( 4.1665795894e-2f ) );
+	p = Ops::add( Ops::mul( p, r ), Ops::set1( 1.6666665459e-1f ) );
+	p = Ops::add( Ops::mul( p, r ), Ops::set1( 5.0000001201e-1f ) );
+	p = Ops::add( Ops::mul( Ops::mul( p, r ), r ), Ops::add( r, Ops::set1( 1.f ) ) );
+	return Ops::mul( p, Ops::pow2( n ) );
+}
+
+template<class Ops>
+KERNEL_INLINE void exp_normalize_impl( float * out, const float * in, float * scratch, int begin, int end, int M,
+                                       float scale, float relax, float * max_change, double * sum_change ) {
+	typedef typename Ops::V V;
+	const int full = M / Ops::W * Ops::W;
+	const int padded = (M + Ops::W - 1) / Ops::W * Ops::W;
+	const V vscale = Ops::set1( scale );
+	const bool blend = relax != 1;
+	const bool track = max_change != 0;
+	float change_max = 0;
+	double change_sum = 0;
+	for( int i=begin; i<end; i++ ){
+		const float * b = in + i*M;
+		float * a = out + i*M;
+		// Scale and find the max, which is subtracted so the exp doesn't explode
+		V vmax = Ops::set1( -1e30f );
+		int k = 0;
+		for( ; k<full; k+=Ops::W ){
+			const V v = Ops::mul( vscale, Ops::loadu( b+k ) );
+			Ops::store( scratch+k, v );
+			vmax = Ops::max( vmax, v );
+		}
+		for( ; k<M; k++ )
+			scratch[k] = scale*b[k];
+		// Padding labels are far below everything else, so their exp adds nothing visible
+		for( ; k<padded; k++ )
+			scratch[k] = -1e30f;
+		if (padded > full)
+			vmax = Ops::max( vmax, Ops::load( scratch+full ) );
+		const V mx = Ops::set1( Ops::hmax( vmax ) );
+		// Exponentiate and sum
+		V vsum = Ops::set1( 0.f );
+		for( k=0; k<padded; k+=Ops::W ){
+			const V e = exp_impl<Ops>( Ops::sub( Ops::load( scratch+k ), mx ) );
+			Ops::store( scratch+k, e );
+			vsum = Ops::add( vsum, e );
+		}
+		// Make it a probability
+		const float inv = 1.f / Ops::hsum( vsum );
+		if (!blend && !track){
+			const V vinv = Ops::set1( inv );
+			for( k=0; k<full; k+=Ops::W )
+				Ops::storeu( a+k, Ops::mul( Ops::load( scratch+k ), vinv ) );
+			for( ; k<M; k++ )
+				a[k] = scratch[k]*inv;
+			continue;
+		}
+		for( k=0; k<M; k++ ){
+			const float v = scratch[k]*inv;
+			const float value = blend ? (1-relax)*a[k] + relax*v : v;
+			if (track){
+				const float c = value > a[k] ? value - a[k] : a[k] - value;
+				change_sum += c;
+				if (change_max < c)
+					change_max = c;
+			}
+			a[k] = value;
+		}
+	}
+	if (track){
+		*max_change = change_max;
+		*sum_change = change_sum;
+	}
+}
+
+// Natural log of a positive normal float (the Cephes logf): a = m*2^e with m in
+// [sqrt(0.5), sqrt(2)), a degree 8 polynomial for log(m) and e*log(2) added in
+// two parts so the sum stays exact.
+template<class Ops>
+KERNEL_INLINE typename Ops::V log_impl( const typename Ops::V & a ) {
+	typedef typename Ops::V V;
+	const V one = Ops::set1( 1.f );
+	V e = Ops::exponent( a );
+	V m = Ops::mantissa( a );
+	const V small = Ops::less( m, Ops::set1( 0.707106781186547524f ) );
+	e = Ops::select( small, Ops::sub( e, one ), e );
+	m = Ops::sub( Ops::select( small, Ops::add( m, m ), m ), one );
+	const V z = Ops::mul( m, m );
+	V y = Ops::set1( 7.0376836292e-2f );
+	y = Ops::add( Ops::mul( y, m ), Ops::set1( -1.1514610310e-1f ) );
+	y = Ops::add( Ops::mul( y, m ), Ops::set1( 1.1676998740e-1f ) );
+	y = Ops::add( Ops::mul( y, m ), Ops::set1( -1.2420140846e-1f ) );
+	y = Ops::add( Ops::mul( y, m ), Ops::set1( 1.4249322787e-1f ) );
+	y = Ops::add( Ops::mul( y, m ), Ops::set1( -1.6668057665e-1f ) );
+	y = Ops::add( Ops::mul( y, m ), Ops::set1( 2.0000714765e-1f ) );
+	y = Ops::add( Ops::mul( y, m ), Ops::set1( -2.4999993993e-1f ) );
+	y = Ops::add( Ops::mul( y, m ), Ops::set1( 3.3333331174e-1f ) );
+	y = Ops::mul( Ops::mul( y, m ), z );
+	y = Ops::add( y, Ops::mul( e, Ops::set1( -2.12194440e-4f ) ) );
+	y = Ops::sub( y, Ops::mul( z, Ops::set1( 0.5f ) ) );
+	return Ops::add( Ops::add( m, y ), Ops::mul( e, Ops::set1( 0.693359375f ) ) );
+}
+
+// Columns of the table are taken TABLE_TILE at a time, class by class, so each
+// class row is read in runs of TABLE_TILE floats while the tile's variable rows
+// stay in L1.
+static const int TABLE_TILE = 64;
+static const float TABLE_EPSILON = 1e-12f;
+
+template<class Ops>
+KERNEL_INLINE typename Ops::V neg_log_impl( const typename Ops::V & p ) {
+	return Ops::sub( Ops::set1( 0.f ), log_impl<Ops>( Ops::add( p, Ops::set1( TABLE_EPSILON ) ) ) );
+}
+
+template<class Ops>
+KERNEL_INLINE void to_unary_impl( float * unary, const float * table, int stride, const int * rows, int begin, int end, int M ) {
+	for( int first=begin; first<end; first+=TABLE_TILE ){
+		const int last = first+TABLE_TILE < end ? first+TABLE_TILE : end;
+		const int full = first + (last-first) / Ops::W * Ops::W;
+		for( int j=0; j<M; j++ ){
+			const float * column = table + (size_t)j*stride;
+			int i = first;
+			for( ; i<full; i+=Ops::W ){
+				float v[Ops::W];
+				Ops::storeu( v, neg_log_impl<Ops>( Ops::loadu( column+i ) ) );
+				for( int l=0; l<Ops::W; l++ )
+					unary[(size_t)(rows ? rows[i+l] : i+l)*M+j] = v[l];
+			}
+			for( ; i<last; i++ )
+				unary[(size_t)(rows ? rows[i] : i)*M+j] = neg_log_impl<ScalarOps>( column[i] );
+		}
+	}
+}
+
+template<class Ops>
+KERNEL_INLINE typename Ops::V factor_impl( const typename Ops::V & r, const typename Ops::V & p ) {
+	typedef typename Ops::V V;
+	const V zero = Ops::set1( 0.f ), one = Ops::set1( 1.f );
+	// NaN fails both comparisons and keeps its probability too
+	const V valid = Ops::less( zero, r );
+	const V factor = Ops::select( Ops::less( r, one ), Ops::div( r, Ops::add( p, Ops::set1( TABLE_EPSILON ) ) ), one );
+	return Ops::select( valid, factor, one );
+}
+
+template<class Ops>
+KERNEL_INLINE void to_factors_impl( float * factors, const float * result, const float * table, int stride,
+                                    const int * rows, int begin, int end, int M ) {
+	for( int first=begin; first<end; first+=TABLE_TILE ){
+		const int last = first+TABLE_TILE < end ? first+TABLE_TILE : end;
+		const int full = first + (last-first) / Ops::W * Ops::W;
+		for( int j=0; j<M; j++ ){
+			const float * column = table + (size_t)j*stride;
+			int i = first;
+			for( ; i<full; i+=Ops::W ){
+				float r[Ops::W], v[Ops::W];
+				for( int l=0; l<Ops::W; l++ )
+					r[l] = result[(size_t)(rows ? rows[i+l] : i+l)*M+j];
+				Ops::storeu( v, factor_impl<Ops>( Ops::loadu( r ), Ops::loadu( column+i ) ) );
+				for( int l=0; l<Ops::W; l++ )
+					factors[(size_t)(i+l)*M+j] = v[l];
+			}
+			for( ; i<last; i++ )
+				factors[(size_t)i*M+j] = factor_impl<ScalarOps>( result[(size_t)(rows ? rows[i] : i)*M+j], column[i] );
+		}
+	}
+}
+
+#define LATTICE_KERNELS( name, Ops, target ) \
+	target static void splat_##name( float * values, const float * in, const int * offset, const float * weight, \
+	                                 int n, int d1, int value_size, int padded_size ) { \
+		splat_impl<Ops>( values, in, offset, weight, n, d1, value_size, padded_size ); \
+	} \
+	target static void gather_##name( float * values, const float * in, const int * index, const int * start, \
+	                                  const float * weight, int begin, int end, int d1, int value_size, int padded_size ) { \
+		gather_impl<Ops>( values, in, index, start, weight, begin, end, d1, value_size, padded_size ); \
+	} \
+	target static void blur_##name( float * new_values, const float * values, const LatticeNeighbors * neighbors, \
+	                                int begin, int end, int padded_size ) { \
+		blur_impl<Ops>( new_values, values, neighbors, begin, end, padded_size ); \
+	} \
+	target static void slice_##name( float * out, const float * values, const int * offset, const float * weight, \
+	                                 int n, int d1, float alpha, int value_size, int padded_size ) { \
+		slice_impl<Ops>( out, values, offset, weight, n, d1, alpha, value_size, padded_size ); \
+	}
+
+#define MEAN_FIELD_KERNELS( name, Ops, target ) \
+	target static void exp_normalize_##name( float * out, const float * in, float * scratch, int begin, int end, int M, \
+	                                         float scale, float relax, float * max_change, double * sum_change ) { \
+		exp_normalize_impl<Ops>( out, in, scratch, begin, end, M, scale, relax, max_change, sum_change ); \
+	}
+
+#define TABLE_KERNELS( name, Ops, target ) \
+	target static void to_unary_##name( float * unary, const float * table, int stride, const int * rows, \
+	                                    int begin, int end, int M ) { \
+		to_unary_impl<Ops>( unary, table, stride, rows, begin, end, M ); \
+	} \
+	target static void to_factors_##name( float * factors, const float * result, const float * table, int stride, \
+	                                      const int * rows, int begin, int end, int M ) { \
+		to_factors_impl<Ops>( factors, result, table, stride, rows, begin, end, M ); \
+	}
+
+LATTICE_KERNELS( scalar, ScalarOps, )
+LATTICE_KERNELS( sse, SseOps, )
+LATTICE_KERNELS( avx2, Avx2Ops, AVX2_TARGET )
+MEAN_FIELD_KERNELS( scalar, ScalarOps, )
+MEAN_FIELD_KERNELS( sse, SseOps, )
+MEAN_FIELD_KERNELS( avx2, Avx2Ops, AVX2_TARGET )
+TABLE_KERNELS( scalar, ScalarOps, )
+TABLE_KERNELS( sse, SseOps, )
+TABLE_KERNELS( avx2, Avx2Ops, AVX2_TARGET )
+
+static const LatticeKernels kernel_table[] = {
+	{ SIMD_SCALAR, ScalarOps::W, splat_scalar, gather_scalar, blur_scalar, slice_scalar },
+	{ SIMD_SSE,    SseOps::W,    splat_sse,    gather_sse,    blur_sse,    slice_sse },
+	{ SIMD_AVX2,   Avx2Ops::W,   splat_avx2,   gather_avx2,   blur_avx2,   slice_avx2 },
+};
+
+static const MeanFieldKernels mean_field_table[] = {
+	{ SIMD_SCALAR, ScalarOps::W, exp_normalize_scalar },
+	{ SIMD_SSE,    SseOps::W,    exp_normalize_sse },
+	{ SIMD_AVX2,   Avx2Ops::W,   exp_normalize_avx2 },
+};
+
+static const TableKernels table_table[] = {
+	{ SIMD_SCALAR, ScalarOps::W, to_unary_scalar, to_factors_scalar },
+	{ SIMD_SSE,    SseOps::W,    to_unary_sse,    to_factors_sse },
+	{ SIMD_AVX2,   Avx2Ops::W,   to_unary_avx2,   to_factors_avx2 },
+};
+
+SimdLevel detectSimdLevel() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports( "avx2" ))
+		return SIMD_AVX2;
+	if (__builtin_cpu_supports( "sse2" ))
+		return SIMD_SSE;
+	return SIMD_SCALAR;
+}
+
+static SimdLevel active_level = detectSimdLevel();
+
+void setSimdLevel( SimdLevel level ) {
+	SimdLevel supported = detectSimdLevel();
+	active_level = level < supported ? level : supported;
+}
+
+const LatticeKernels & latticeKernels( int value_size ) {
+	if (value_size > 0 && value_size < kernel_table[ active_level ].width)
+		return kernel_table[ SIMD_SCALAR ];
+	return kernel_table[ active_level ];
+}
+
+const MeanFieldKernels & meanFieldKernels( int labels ) {
+	// Drop to a narrower register when most of a wide one would be padding
+	int level = active_level;
+	while( level > SIMD_SCALAR && labels > 0 && labels < mean_field_table[ level ].width )
+		level--;
+	return mean_field_table[ level ];
+}
+
+const TableKernels & tableKernels() {
+	return table_table[ active_level ];
+}
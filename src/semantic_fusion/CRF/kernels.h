@@ -0,0 +1,104 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#pragma once
+
+// Instruction sets the vector kernels can be built for
+enum SimdLevel {
+	SIMD_SCALAR = 0,
+	SIMD_SSE = 1,
+	SIMD_AVX2 = 2
+};
+
+// Blur neighbours of a lattice vertex along one axis (-1 if there is none)
+struct LatticeNeighbors {
+	int n1, n2;
+	LatticeNeighbors( int n1=0, int n2=0 ):n1(n1),n2(n2){
+	}
+};
+
+// Whole-lattice splat/blur/slice passes. Vertex rows are padded_size floats,
+// padded_size is a multiple of width and rows are CRF_ALIGNMENT aligned;
+// the input and output rows are value_size floats with no alignment.
+struct LatticeKernels {
+	SimdLevel level;
+	// Number of floats processed per instruction
+	int width;
+	// values[offset+1] += weight*in for the (d+1) vertices of each of the n points
+	void (*splat)( float * values, const float * in, const int * offset, const float * weight,
+	               int n, int d1, int value_size, int padded_size );
+	// Gather form of splat for the vertices [begin, end): vertex v sums weight[e]*in[e/d1] over
+	// the entries e = index[start[v]..start[v+1]), which are listed in increasing point order
+	// so the sums come out exactly as the scatter form produces them
+	void (*gather)( float * values, const float * in, const int * index, const int * start, const float * weight,
+	                int begin, int end, int d1, int value_size, int padded_size );
+	// new_values[i+1] = values[i+1] + 0.5*(values[n1+1] + values[n2+1]) for the vertices [begin, end)
+	void (*blur)( float * new_values, const float * values, const LatticeNeighbors * neighbors,
+	              int begin, int end, int padded_size );
+	// out = alpha * sum weight*values[offset+1] over the (d+1) vertices of each of the n points
+	void (*slice)( float * out, const float * values, const int * offset, const float * weight,
+	               int n, int d1, float alpha, int value_size, int padded_size );
+};
+
+// Fused mean-field normalisation of the variables [begin, end), M labels each:
+//   out = (1-relax)*out + relax*softmax( scale*in )
+// with out simply overwritten when relax is 1. scratch holds simdPad(M, width)
+// floats aligned like allocate's. When max_change is not NULL the largest and the
+// summed absolute change of out are returned through max_change and sum_change.
+// exp is a range reduced polynomial within 1 ulp (relative error below 1.2e-7)
+// of std::exp on [-87.3, 88.3]; smaller arguments are clamped and give about
+// 1e-38 instead of 0.
+struct MeanFieldKernels {
+	SimdLevel level;
+	int width;
+	void (*exp_normalize)( float * out, const float * in, float * scratch, int begin, int end, int M,
+	                       float scale, float relax, float * max_change, double * sum_change );
+};
+
+// Conversions between SemanticFusion's class-major probability table (M rows of
+// stride floats, a column per surfel) and the variable-major rows of the CRF (M
+// floats per variable), for the table columns [begin, end). Column i belongs to
+// variable rows[i], or to variable i when rows is NULL. The table is read a tile
+// of columns at a time; -log is a polynomial within 2 ulp of std::log.
+struct TableKernels {
+	SimdLevel level;
+	int width;
+	// unary[row*M+j] = -log( table[j*stride+i] + 1e-12 )
+	void (*to_unary)( float * unary, const float * table, int stride, const int * rows, int begin, int end, int M );
+	// factors[i*M+j] = result[row*M+j] / (table[j*stride+i] + 1e-12), or 1 where the
+	// result is not a probability strictly between 0 and 1 (the CRF gives NaNs)
+	void (*to_factors)( float * factors, const float * result, const float * table, int stride,
+	                    const int * rows, int begin, int end, int M );
+};
+
+// Best level supported by the CPU we are running on
+SimdLevel detectSimdLevel();
+// Force a level (clamped to what the CPU supports), mostly to compare against the scalar path
+void setSimdLevel( SimdLevel level );
+// The kernels currently in use, falling back to scalar for vectors narrower than a register
+const LatticeKernels & latticeKernels( int value_size = 0 );
+// The mean-field kernels currently in use for the given number of labels
+const MeanFieldKernels & meanFieldKernels( int labels = 0 );
+
+// The table conversions currently in use
+const TableKernels & tableKernels();
+
+// Round a value vector length up to a whole number of SIMD registers
+inline int simdPad( int n, int width ) {
+	return (n + width - 1) / width * width;
+}
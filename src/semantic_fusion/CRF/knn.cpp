@@ -0,0 +1,192 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#include "knn.h"
+#include "util.h"
+#include <utilities/ThreadPool.h>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+KnnPotential::KnnPotential( int N, int n, const float * const * features, const int * D, const float * w, int k, float radius )
+	:N_(N), K_(k), neighbors_(NULL), weights_(NULL), self_(NULL), neighbors_capacity_(0), weights_capacity_(0), self_capacity_(0) {
+	reserveBuffer( neighbors_, neighbors_capacity_, (size_t)N_*K_ );
+	reserveBuffer( weights_, weights_capacity_, (size_t)N_*K_ );
+	reserveBuffer( self_, self_capacity_, N_ );
+	const float * position = features[0];
+	const int stride = D[0];
+	auto key = []( long long x, long long y, long long z ){
+		return (unsigned long long)( (x << 42) | (y << 21) | z );
+	};
+	// Sort the variables by voxel, so each voxel is a range of cell_order
+	std::vector< std::pair<unsigned long long,int> > cell_order( N_ );
+	float inv_cell = 1.f / radius;
+	auto voxel = [&]( int i, int axis ){
+		return (long long)std::floor( position[i*stride+axis]*inv_cell ) + (1 << 20);
+	};
+	auto sortCells = [&](){
+		for( int i=0; i<N_; i++ )
+			cell_order[i] = std::make_pair( key( voxel(i,0), voxel(i,1), voxel(i,2) ), i );
+		std::sort( cell_order.begin(), cell_order.end() );
+		int cells = 0;
+		for( int s=0; s<N_; s++ )
+			cells += s == 0 || cell_order[s].first != cell_order[s-1].first;
+		return cells;
+	};
+	// Voxels of radius hold far more than k variables on dense maps, so pick
+	// smaller ones holding about k/2, taking the variables to lie on surfaces,
+	// and search outwards one shell of voxels at a time
+	const int radius_cells = sortCells();
+	const float per_cell = (float)N_ / std::max( radius_cells, 1 );
+	const int shells = std::max( 1, std::min( 16, (int)std::ceil( std::sqrt( 2*per_cell/K_ ) ) ) );
+	if (shells > 1) {
+		inv_cell = shells / radius;
+		sortCells();
+	}
+	const float cell = 1.f / inv_cell;
+	// Start of each voxel in cell_order, and of the voxel after the last
+	std::vector<int> cell_first;
+	std::unordered_map<unsigned long long,int> cell_index;
+	cell_index.reserve( N_ );
+	for( int s=0; s<N_; s++ )
+		if (s == 0 || cell_order[s].first != cell_order[s-1].first) {
+			cell_index[cell_order[s].first] = cell_first.size();
+			cell_first.push_back( s );
+		}
+	const int cells = cell_first.size();
+	cell_first.push_back( N_ );
+	const float radius2 = radius*radius;
+	// The variables of a voxel search together, so the hash lookups of a shell
+	// are shared between them
+	ThreadPool::Instance().ParallelFor( 0, cells, 64, [&]( int begin, int end ){
+		// The k nearest so far of each variable of the voxel, sorted by distance
+		// then index so ties don't depend on the voxel order
+		std::vector< std::pair<float,int> > nearest;
+		std::vector<int> found;
+		std::vector<float> kernel( K_ );
+		for( int c=begin; c<end; c++ ){
+			const int first = cell_first[c], m = cell_first[c+1]-first;
+			nearest.resize( (size_t)m*K_ );
+			found.assign( m, 0 );
+			const int home = cell_order[first].second;
+			const long long x = voxel(home,0), y = voxel(home,1), z = voxel(home,2);
+			auto visit = [&]( long long cx, long long cy, long long cz ){
+				std::unordered_map<unsigned long long,int>::const_iterator it = cell_index.find( key( cx, cy, cz ) );
+				if (it == cell_index.end())
+					return;
+				for( int s=cell_first[it->second]; s<cell_first[it->second+1]; s++ ){
+					const int j = cell_order[s].second;
+					const float * q = position + j*stride;
+					for( int a=0; a<m; a++ ){
+						const int i = cell_order[first+a].second;
+						const float * pi = position + i*stride;
+						const float d2 = (pi[0]-q[0])*(pi[0]-q[0]) + (pi[1]-q[1])*(pi[1]-q[1]) + (pi[2]-q[2])*(pi[2]-q[2]);
+						if (d2 >= radius2 || j == i)
+							continue;
+						const std::pair<float,int> candidate( d2, j );
+						std::pair<float,int> * list = &nearest[(size_t)a*K_];
+						if (found[a] == K_ && !(candidate < list[K_-1]))
+							continue;
+						// Insertion into the sorted list, dropping the farthest when it is full
+						int e = found[a] < K_ ? found[a]++ : K_-1;
+						for( ; e>0 && candidate < list[e-1]; e-- )
+							list[e] = list[e-1];
+						list[e] = candidate;
+					}
+				}
+			};
+			for( int r=0; r<=shells; r++ ){
+				// Everything past shell r-1 is at least (r-1) voxels away
+				const float reach = (r-1)*cell;
+				bool done = r > 1;
+				for( int a=0; a<m && done; a++ )
+					done = found[a] == K_ && nearest[(size_t)a*K_+K_-1].first <= reach*reach;
+				if (done)
+					break;
+				for( int dx=-r; dx<=r; dx++ )
+					for( int dy=-r; dy<=r; dy++ ){
+						const bool face = dx == -r || dx == r || dy == -r || dy == r;
+						// Only the surface of the (2r+1)^3 cube is new
+						for( int dz=-r; dz<=r; dz += face ? 1 : 2*std::max( r, 1 ) )
+							visit( x+dx, y+dy, z+dz );
+					}
+			}
+			for( int a=0; a<m; a++ ){
+				const int i = cell_order[first+a].second;
+				const std::pair<float,int> * list = &nearest[(size_t)a*K_];
+				int * nb = neighbors_ + (size_t)i*K_;
+				float * wt = weights_ + (size_t)i*K_;
+				for( int e=0; e<K_; e++ ){
+					nb[e] = e < found[a] ? list[e].second : i;
+					wt[e] = 0;
+				}
+				// Each kernel is normalised on its own, like one PottsPotential per kernel
+				self_[i] = 0;
+				for( int p=0; p<n; p++ ){
+					const float * fi = features[p] + i*D[p];
+					float norm = 1;
+					for( int e=0; e<found[a]; e++ ){
+						const float * fj = features[p] + nb[e]*D[p];
+						float d2 = 0;
+						for( int d=0; d<D[p]; d++ )
+							d2 += (fi[d]-fj[d])*(fi[d]-fj[d]);
+						kernel[e] = std::exp( -0.5f*d2 );
+						norm += kernel[e];
+					}
+					const float scale = w[p] / norm;
+					for( int e=0; e<found[a]; e++ )
+						wt[e] += scale*kernel[e];
+					self_[i] += scale;
+				}
+			}
+		}
+	});
+}
+
+KnnPotential::~KnnPotential() {
+	releaseBuffer( neighbors_, neighbors_capacity_ );
+	releaseBuffer( weights_, weights_capacity_ );
+	releaseBuffer( self_, self_capacity_ );
+}
+
+void KnnPotential::apply( float * out_values, const float * in_values, float * tmp, int value_size ) const {
+	// Each variable gathers from its neighbours, so the rows are independent
+	ThreadPool::Instance().ParallelFor( 0, N_, 1024, [&]( int begin, int end ){
+		for( int i=begin; i<end; i++ ){
+			float * out = out_values + (size_t)i*value_size;
+			const float * in = in_values + (size_t)i*value_size;
+			const int * nb = neighbors_ + (size_t)i*K_;
+			const float * wt = weights_ + (size_t)i*K_;
+			const float s = self_[i];
+			for( int j=0; j<value_size; j++ )
+				out[j] += s*in[j];
+			for( int e=0; e<K_; e++ ){
+				const float * in_e = in_values + (size_t)nb[e]*value_size;
+				const float w = wt[e];
+				for( int j=0; j<value_size; j++ )
+					out[j] += w*in_e[j];
+			}
+		}
+	});
+}
+
+void KnnPotential::applyChunked( float * out_values, const float * in_values, float * tmp, int tmp_rows, int value_size ) const {
+	apply( out_values, in_values, tmp, value_size );
+}
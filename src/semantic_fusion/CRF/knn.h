@@ -0,0 +1,50 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#pragma once
+
+#include "densecrf.h"
+#include <cstddef>
+
+// Potts potential over a sparse k-nearest-neighbour graph instead of the
+// permutohedral lattice. Each variable is connected to its k nearest neighbours
+// within radius in the first three dimensions of the first kernel's features
+// (its position, found through a uniform voxel hash), weighted by
+//   sum_p w_p * exp(-0.5*|f_p,i - f_p,j|^2) / Z_p,i
+// over the kernels p, where Z_p,i sums the kernel over the neighbours and the
+// variable itself. That is the normalised message of PottsPotential truncated
+// to the neighbours, applied as a sparse matrix vector product.
+class KnnPotential: public PairwisePotential {
+protected:
+	int N_, K_;
+	// K_ neighbours and weights for each variable, padded with the variable
+	// itself at weight 0, and the weight of the variable's own value
+	int *neighbors_;
+	float *weights_, *self_;
+	size_t neighbors_capacity_, weights_capacity_, self_capacity_;
+	KnnPotential( const KnnPotential & o ){}
+public:
+	// n kernels over the features of N variables, D[p] floats per variable for
+	// kernel p, with D[0] >= 3 and k >= 1. radius is in the units of those features.
+	KnnPotential( int N, int n, const float * const * features, const int * D, const float * w, int k, float radius );
+	~KnnPotential();
+	void apply( float * out_values, const float * in_values, float * tmp, int value_size ) const;
+	// Needs no tmp, so it works with any tmp_rows
+	void applyChunked( float * out_values, const float * in_values, float * tmp, int tmp_rows, int value_size ) const;
+	int neighbors() const { return K_; }
+};
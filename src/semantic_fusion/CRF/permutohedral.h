@@ -26,68 +26,111 @@
 */
 
 #pragma once
+#include "kernels.h"
+#include "util.h"
+#include <utilities/ThreadPool.h>
 #include <cstdlib>
 
 #include <cstring>
 #include <cassert>
 #include <cstdio>
+#include <algorithm>
 #include <cmath>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <emmintrin.h>
 
 /************************************************/
 /***                Hash Table                ***/
 /************************************************/
 
+// Open addressing with linear probing over a power of two number of slots. Each
+// slot caches the full hash of its key, so probes only touch a key when the hashes
+// agree, and the keys themselves are zero padded to whole 128 bit rows so they
+// compare with one SSE instruction per 8 components. The table is sized up front
+// from the largest number of keys expected and only grows if that was too small.
 class HashTable{
 	// Don't copy!
-	HashTable( const HashTable & o ): key_size_ ( o.key_size_ ), filled_(0), capacity_(o.capacity_) {
-		table_ = new int[ capacity_ ];
-		keys_ = new short[ (capacity_/2+10)*key_size_ ];
-		memset( table_, -1, capacity_*sizeof(int) );
-	}
+	HashTable( const HashTable & o ){}
 protected:
-	size_t key_size_, filled_, capacity_;
+	struct Slot{
+		uint32_t hash;
+		int id;
+	};
+	static const int KEY_LANES = 8;
+	static const int MAX_KEY_SIZE = 64;
+	size_t key_size_, key_stride_, filled_, capacity_, key_capacity_;
 	short * keys_;
-	int * table_;
+	Slot * table_;
 	void grow(){
-		// Swap out the old memory
-		short * old_keys = keys_;
-		int * old_table = table_;
-		int old_capacity = capacity_;
+		// Reinsert each element using its cached hash
+		Slot * old_table = table_;
+		size_t old_capacity = capacity_;
 		capacity_ *= 2;
-		// Allocate the new memory
-		keys_ = new short[ (old_capacity+10)*key_size_ ];
-		table_ = new int[ capacity_ ];
-		memset( table_, -1, capacity_*sizeof(int) );
-		memcpy( keys_, old_keys, filled_*key_size_*sizeof(short) );
-		
-		// Reinsert each element
-		for( int i=0; i<old_capacity; i++ )
-			if (old_table[i] >= 0){
-				int e = old_table[i];
-				size_t h = hash( old_keys+(getKey(e)-keys_) ) % capacity_;
-				for(; table_[h] >= 0; h = h<capacity_-1 ? h+1 : 0);
-				table_[h] = e;
+		table_ = new Slot[ capacity_ ];
+		memset( table_, -1, capacity_*sizeof(Slot) );
+		for( size_t i=0; i<old_capacity; i++ )
+			if (old_table[i].id >= 0){
+				size_t h = old_table[i].hash & (capacity_-1);
+				for(; table_[h].id >= 0; h = (h+1) & (capacity_-1));
+				table_[h] = old_table[i];
 			}
-		
-		delete [] old_keys;
 		delete [] old_table;
 	}
-	size_t hash( const short * k ) {
-		size_t r = 0;
-		for( size_t i=0; i<key_size_; i++ ){
-			r += k[i];
-			r *= 1664525;
+	void growKeys(){
+		short * old_keys = keys_;
+		key_capacity_ *= 2;
+		keys_ = (short*)_mm_malloc( key_capacity_*key_stride_*sizeof(short), 16 );
+		memcpy( keys_, old_keys, filled_*key_stride_*sizeof(short) );
+		_mm_free( old_keys );
+	}
+	uint32_t hash( const short * k ) const {
+		uint64_t r = 0;
+		for( size_t i=0; i<key_size_; i++ )
+			r = (r + (uint16_t)k[i]) * 0x9E3779B97F4A7C15ull;
+		return (uint32_t)(r >> 32);
+	}
+	// Copy a key into a zero padded row so it can be compared with the stored ones
+	void pad( short * row, const short * k ) const {
+		size_t i = 0;
+		for( ; i<key_size_; i++ )
+			row[i] = k[i];
+		for( ; i<key_stride_; i++ )
+			row[i] = 0;
+	}
+	bool equal( const short * a, const short * b ) const {
+		for( size_t i=0; i<key_stride_; i+=KEY_LANES ){
+			__m128i eq = _mm_cmpeq_epi16( _mm_load_si128( (const __m128i*)(a+i) ), _mm_load_si128( (const __m128i*)(b+i) ) );
+			if (_mm_movemask_epi8( eq ) != 0xFFFF)
+				return false;
+		}
+		return true;
+	}
+	// Slot holding k, or the empty slot where it belongs
+	size_t probe( const short * row, uint32_t h ) const {
+		size_t i = h & (capacity_-1);
+		while(1){
+			const Slot & slot = table_[i];
+			if (slot.id < 0 || (slot.hash == h && equal( keys_+slot.id*key_stride_, row )))
+				return i;
+			i = (i+1) & (capacity_-1);
 		}
-		return r;
 	}
 public:
-	explicit HashTable( int key_size, int n_elements ) : key_size_ ( key_size ), filled_(0), capacity_(2*n_elements) {
-		table_ = new int[ capacity_ ];
-		keys_ = new short[ (capacity_/2+10)*key_size_ ];
-		memset( table_, -1, capacity_*sizeof(int) );
+	// n_elements is the number of insertions expected. Most of them hit an existing
+	// key, so the table starts small enough to stay in cache and grows on demand.
+	explicit HashTable( int key_size, int n_elements ) : key_size_ ( key_size ), key_stride_( (key_size+KEY_LANES-1)/KEY_LANES*KEY_LANES ), filled_(0), capacity_(16) {
+		assert( key_size <= MAX_KEY_SIZE );
+		while( capacity_ < (size_t)n_elements/8 )
+			capacity_ *= 2;
+		table_ = new Slot[ capacity_ ];
+		memset( table_, -1, capacity_*sizeof(Slot) );
+		key_capacity_ = capacity_/2 < 4096 ? capacity_/2 : 4096;
+		keys_ = (short*)_mm_malloc( key_capacity_*key_stride_*sizeof(short), 16 );
 	}
 	~HashTable() {
-		delete [] keys_;
+		_mm_free( keys_ );
 		delete [] table_;
 	}
 	int size() const {
@@ -95,114 +138,238 @@ public:
 	}
 	void reset() {
 		filled_ = 0;
-		memset( table_, -1, capacity_*sizeof(int) );
+		memset( table_, -1, capacity_*sizeof(Slot) );
 	}
 	int find( const short * k, bool create = false ){
 		if (2*filled_ >= capacity_) grow();
-		// Get the hash value
-		size_t h = hash( k ) % capacity_;
-		// Find the element with he right key, using linear probing
-		while(1){
-			int e = table_[h];
-			if (e==-1){
-				if (create){
-					// Insert a new key and return the new id
-					for( size_t i=0; i<key_size_; i++ )
-						keys_[ filled_*key_size_+i ] = k[i];
-					return table_[h] = (int)filled_++;
-				}
-				else
-					return -1;
-			}
-			// Check if the current key is The One
-			bool good = true;
-			for( size_t i=0; i<key_size_ && good; i++ )
-				if (keys_[ e*key_size_+i ] != k[i])
-					good = false;
-			if (good)
-				return e;
-			// Continue searching
-			h++;
-			if (h==capacity_) h = 0;
-		}
+		__attribute__((aligned(16))) short row[ MAX_KEY_SIZE ];
+		pad( row, k );
+		const uint32_t h = hash( k );
+		Slot & slot = table_[ probe( row, h ) ];
+		if (slot.id >= 0 || !create)
+			return slot.id;
+		// Insert a new key and return the new id
+		if (filled_ == key_capacity_) growKeys();
+		memcpy( keys_+filled_*key_stride_, row, key_stride_*sizeof(short) );
+		slot.hash = h;
+		return slot.id = (int)filled_++;
+	}
+	// Read-only find, safe to call from several threads once no more keys are inserted
+	int lookup( const short * k ) const{
+		__attribute__((aligned(16))) short row[ MAX_KEY_SIZE ];
+		pad( row, k );
+		return table_[ probe( row, hash( k ) ) ].id;
 	}
 	const short * getKey( int i ) const{
-		return keys_+i*key_size_;
+		return keys_+i*key_stride_;
 	}
 
 };
 
+/************************************************/
+/***           Sharded Hash Table             ***/
+/************************************************/
+
+// Lattice keys spread over independently locked hash tables, so several threads
+// can insert at once. Every key remembers the smallest entry index that inserted
+// it, which lets the caller number the keys in first-occurrence order no matter
+// how the insertions were interleaved. Keys are identified by a code of
+// (local_id << shard_bits) | shard.
+class ShardedHashTable{
+	// Don't copy!
+	ShardedHashTable( const ShardedHashTable & o ){}
+protected:
+	int key_size_, n_shards_, shard_bits_;
+	bool locked_;
+	std::vector<HashTable*> tables_;
+	std::vector< std::vector<int> > first_;
+	std::vector<std::mutex> mutexes_;
+	int shard( const short * k ) const {
+		if (n_shards_ == 1)
+			return 0;
+		uint32_t r = 2166136261u;
+		for( int i=0; i<key_size_; i++ )
+			r = (r ^ (uint16_t)k[i]) * 16777619u;
+		return (r >> 16) & (n_shards_-1);
+	}
+public:
+	// n_shards must be a power of two, locking can be skipped when only one thread inserts
+	ShardedHashTable( int key_size, int n_elements, int n_shards, bool locked ) : key_size_( key_size ), n_shards_( n_shards ), shard_bits_( 0 ), locked_( locked ), tables_( n_shards ), first_( n_shards ), mutexes_( n_shards ) {
+		while( (1 << shard_bits_) < n_shards_ )
+			shard_bits_++;
+		for( int i=0; i<n_shards_; i++ )
+			tables_[i] = new HashTable( key_size_, n_elements/n_shards_+1 );
+	}
+	~ShardedHashTable() {
+		for( int i=0; i<n_shards_; i++ )
+			delete tables_[i];
+	}
+	int shards() const {
+		return n_shards_;
+	}
+	int shardBits() const {
+		return shard_bits_;
+	}
+	int size() const {
+		int n = 0;
+		for( int i=0; i<n_shards_; i++ )
+			n += tables_[i]->size();
+		return n;
+	}
+	int size( int s ) const {
+		return tables_[s]->size();
+	}
+	// Insert k if it is new and return its code
+	int insert( const short * k, int entry ){
+		const int s = shard( k );
+		std::unique_lock<std::mutex> lock( mutexes_[s], std::defer_lock );
+		if (locked_) lock.lock();
+		const int e = tables_[s]->find( k, true );
+		if (e == (int)first_[s].size())
+			first_[s].push_back( entry );
+		else if (entry < first_[s][e])
+			first_[s][e] = entry;
+		return (e << shard_bits_) | s;
+	}
+	// Code of k or -1, only valid once all insertions are done
+	int lookup( const short * k ) const {
+		const int s = shard( k );
+		const int e = tables_[s]->lookup( k );
+		return e < 0 ? -1 : (e << shard_bits_) | s;
+	}
+	const short * getKey( int s, int i ) const {
+		return tables_[s]->getKey( i );
+	}
+	int first( int s, int i ) const {
+		return first_[s][i];
+	}
+};
+
 /************************************************/
 /***          Permutohedral Lattice           ***/
 /************************************************/
 
+// Options of Permutohedral::init
+enum LatticeOptions {
+	// Bit-pack the offsets and do without the parallel splat index, which
+	// takes about half the memory per point at the cost of a serial splat
+	LATTICE_COMPACT = 1,
+	// Number the vertices along a Morton curve over their keys rather than in
+	// the order the points first use them
+	LATTICE_ORDERED = 2
+};
+
+// Vertex values of Permutohedral::compute. Lattices that are never filtered at
+// the same time can share one set, see Permutohedral::shareBuffers.
+struct LatticeBuffers {
+	float * values;
+	float * new_values;
+	size_t values_capacity, new_values_capacity;
+	LatticeBuffers():values( NULL ),new_values( NULL ),values_capacity( 0 ),new_values_capacity( 0 ){
+	}
+	~LatticeBuffers(){
+		releaseBuffer( values, values_capacity );
+		releaseBuffer( new_values, new_values_capacity );
+	}
+};
+
 class Permutohedral
 {
 protected:
 	int * offset_;
 	float * barycentric_;
 	
-	struct Neighbors{
-		int n1, n2;
-		Neighbors( int n1=0, int n2=0 ):n1(n1),n2(n2){
-		}
-	};
+	typedef LatticeNeighbors Neighbors;
 	Neighbors * blur_neighbors_;
+	// offset_ inverted per vertex (CSR), only used when running multithreaded
+	int * splat_start_;
+	int * splat_index_;
+	bool has_splat_index_;
+	// With compact offsets offset_ is released once the lattice is built and the
+	// vertex of entry e is kept in the offset_bits_ bits from e*offset_bits_ on
+	bool compact_;
+	uint32_t * packed_offset_;
+	int offset_bits_;
+	// Vertex values of compute, kept so that filtering doesn't allocate. This makes
+	// compute unsafe to call on the same lattice from several threads at once.
+	mutable LatticeBuffers own_buffers_;
+	LatticeBuffers * buffers_;
+	// Where filter left its result, for slice
+	mutable const float * filtered_;
+	mutable int filtered_size_;
+	// Allocated sizes of the buffers above, they are reused by the next init
+	size_t offset_capacity_, barycentric_capacity_, neighbors_capacity_, splat_start_capacity_, splat_index_capacity_, packed_offset_capacity_;
 	// Number of elements, size of sparse discretized space, dimension of features
 	int N_, M_, d_;
-public:
-	Permutohedral() :offset_( NULL ),barycentric_( NULL ),blur_neighbors_( NULL ),N_ ( 0 ),M_ ( 0 ),d_ ( 0 ) {
-	}
-	~Permutohedral(){
-		if (barycentric_)    delete[] barycentric_;
-		if (offset_)         delete[] offset_;
-		if (blur_neighbors_) delete[] blur_neighbors_;
+	// Vertices or points handed to a thread at a time
+	static const int PARALLEL_GRAIN = 2048;
+	// Hash table shards used while building the lattice on several threads
+	static const int LATTICE_SHARDS = 64;
+	// Offset entries unpacked at a time from compact offsets
+	static const int OFFSET_BLOCK = 4096;
+	
+	// Pack offset_ into offset_bits_ bits per entry. A group of 32 entries fills
+	// exactly offset_bits_ words, so the groups can be packed independently.
+	void packOffsets(){
+		offset_bits_ = 1;
+		while( (1 << offset_bits_) < M_ )
+			offset_bits_++;
+		const int n_entries = (d_+1)*N_;
+		const int n_groups = (n_entries + 31) / 32;
+		// One more word so the unpacking can always read two
+		reserveBuffer( packed_offset_, packed_offset_capacity_, (size_t)n_groups*offset_bits_ + 1, true );
+		packed_offset_[ (size_t)n_groups*offset_bits_ ] = 0;
+		ThreadPool::Instance().ParallelFor( 0, n_groups, PARALLEL_GRAIN, [&]( int begin, int end ){
+			for( int g=begin; g<end; g++ ){
+				uint32_t * word = packed_offset_ + (size_t)g*offset_bits_;
+				uint64_t bits = 0;
+				int n_bits = 0;
+				for( int e=32*g; e<32*g+32; e++ ){
+					bits |= (uint64_t)( e < n_entries ? offset_[e] : 0 ) << n_bits;
+					n_bits += offset_bits_;
+					if (n_bits >= 32){
+						*word++ = (uint32_t)bits;
+						bits >>= 32;
+						n_bits -= 32;
+					}
+				}
+			}
+		});
 	}
-
-	void init ( const float* feature, int feature_size, int N )
-	{
-		// Compute the lattice coordinates for each feature [there is going to be a lot of magic here
-		N_ = N;
-		d_ = feature_size;
-		HashTable hash_table( d_, N_*(d_+1) );
-
-		// Allocate the class memory
-		if (offset_) delete [] offset_;
-		offset_ = new int[ (d_+1)*N_ ];
-		if (barycentric_) delete [] barycentric_;
-		barycentric_ = new float[ (d_+1)*N_ ];
-		
-		// Allocate the local memory
-		float * scale_factor = new float[d_];
-		float * elevated = new float[d_+1];
-		float * rem0 = new float[d_+1];
-		float * barycentric = new float[d_+2];
-		short * rank = new short[d_+1];
-		short * canonical = new short[(d_+1)*(d_+1)];
-		short * key = new short[d_+1];
-		
-		// Compute the canonical simplex
-		for( int i=0; i<=d_; i++ ){
-			for( int j=0; j<=d_-i; j++ )
-				canonical[i*(d_+1)+j] = i;
-			for( int j=d_-i+1; j<=d_; j++ )
-				canonical[i*(d_+1)+j] = i - (d_+1);
-		}
-		
-		// Expected standard deviation of our filter (p.6 in [Adams etal 2010])
-		float inv_std_dev = sqrtf(2.f / 3.f)*(d_+1);
-		// Compute the diagonal part of E (p.5 in [Adams etal 2010])
-		for( int i=0; i<d_; i++ )
-			scale_factor[i] = 1.f / sqrtf( (i+2.f)*(i+1.f) ) * inv_std_dev;
-		
-		// Compute the simplex each feature lies in
-		for( int k=0; k<N_; k++ ){
+	// Point scratch of embedPoints, on the stack when the dimension is known at
+	// compile time (N > 0)
+	template<typename T, int N>
+	struct Scratch {
+		T data[N];
+		explicit Scratch( int ){}
+		T & operator[]( int i ){ return data[i]; }
+	};
+	template<typename T>
+	struct Scratch<T,0> {
+		std::vector<T> data;
+		explicit Scratch( int n ):data( n ){}
+		T & operator[]( int i ){ return data[i]; }
+	};
+	
+	// Elevate the points [begin, end) onto the lattice, storing the hash codes of their
+	// simplex vertices in offset_ and the barycentric weights. D is the feature dimension
+	// when it is known at compile time, which unrolls every loop over stack arrays, or 0
+	// to take it from d_.
+	template<int D>
+	void embedPoints( const float * feature, int feature_size, int begin, int end,
+	                  const float * scale_factor, const short * canonical, ShardedHashTable & hash_table ){
+		const int d = D > 0 ? D : d_;
+		const int d1 = d+1;
+		Scratch<float, D ? D+1 : 0> elevated( d1 ), rem0( d1 );
+		Scratch<float, D ? D+2 : 0> barycentric( d+2 );
+		Scratch<short, D ? D+1 : 0> rank( d1 ), key( d1 );
+		for( int k=begin; k<end; k++ ){
 			// Elevate the feature ( y = Ep, see p.5 in [Adams etal 2010])
 			const float * f = feature + k*feature_size;
 			
 			// sm contains the sum of 1..n of our faeture vector
 			float sm = 0;
-			for( int j=d_; j>0; j-- ){
+			for( int j=d; j>0; j-- ){
 				float cf = f[j-1]*scale_factor[j-1];
 				elevated[j] = sm - j*cf;
 				sm += cf;
@@ -210,21 +377,21 @@ public:
 			elevated[0] = sm;
 			
 			// Find the closest 0-colored simplex through rounding
-			float down_factor = 1.0f / (d_+1);
-			float up_factor = (d_+1);
+			float down_factor = 1.0f / d1;
+			float up_factor = d1;
 			int sum = 0;
-			for( int i=0; i<=d_; i++ ){
+			for( int i=0; i<=d; i++ ){
 				int rd = (int)round( down_factor * elevated[i]);
 				rem0[i] = rd*up_factor;
 				sum += rd;
 			}
 			
 			// Find the simplex we are in and store it in rank (where rank describes what position coorinate i has in the sorted order of the features values)
-			for( int i=0; i<=d_; i++ )
+			for( int i=0; i<=d; i++ )
 				rank[i] = 0;
-			for( int i=0; i<d_; i++ ){
+			for( int i=0; i<d; i++ ){
 				double di = elevated[i] - rem0[i];
-				for( int j=i+1; j<=d_; j++ )
+				for( int j=i+1; j<=d; j++ )
 					if ( di < elevated[j] - rem0[j])
 						rank[i]++;
 					else
@@ -232,132 +399,359 @@ public:
 			}
 			
 			// If the point doesn't lie on the plane (sum != 0) bring it back
-			for( int i=0; i<=d_; i++ ){
+			for( int i=0; i<=d; i++ ){
 				rank[i] += sum;
 				if ( rank[i] < 0 ){
-					rank[i] += d_+1;
-					rem0[i] += d_+1;
+					rank[i] += d1;
+					rem0[i] += d1;
 				}
-				else if ( rank[i] > d_ ){
-					rank[i] -= d_+1;
-					rem0[i] -= d_+1;
+				else if ( rank[i] > d ){
+					rank[i] -= d1;
+					rem0[i] -= d1;
 				}
 			}
 			
 			// Compute the barycentric coordinates (p.10 in [Adams etal 2010])
-			for( int i=0; i<=d_+1; i++ )
+			for( int i=0; i<=d+1; i++ )
 				barycentric[i] = 0;
-			for( int i=0; i<=d_; i++ ){
+			for( int i=0; i<=d; i++ ){
 				float v = (elevated[i] - rem0[i])*down_factor;
-				barycentric[d_-rank[i]  ] += v;
-				barycentric[d_-rank[i]+1] -= v;
+				barycentric[d-rank[i]  ] += v;
+				barycentric[d-rank[i]+1] -= v;
 			}
 			// Wrap around
-			barycentric[0] += 1.0f + barycentric[d_+1];
+			barycentric[0] += 1.0f + barycentric[d1];
 			
 			// Compute all vertices and their offset
-			for( int remainder=0; remainder<=d_; remainder++ ){
-				for( int i=0; i<d_; i++ )
-					key[i] = rem0[i] + canonical[ remainder*(d_+1) + rank[i] ];
-				offset_[ k*(d_+1)+remainder ] = hash_table.find( key, true );
-				barycentric_[ k*(d_+1)+remainder ] = barycentric[ remainder ];
+			for( int remainder=0; remainder<=d; remainder++ ){
+				for( int i=0; i<d; i++ )
+					key[i] = rem0[i] + canonical[ remainder*d1 + rank[i] ];
+				offset_[ k*d1+remainder ] = hash_table.insert( &key[0], k*d1+remainder );
+				barycentric_[ k*d1+remainder ] = barycentric[ remainder ];
+			}
+		}
+	}
+	
+	// Look up the blur neighbours of the vertices [begin, end) along each of the d+1
+	// axes, with D as in embedPoints
+	template<int D, typename CodeToVertex>
+	void findNeighbors( const short * vertex_key, int begin, int end, const ShardedHashTable & hash_table,
+	                    const CodeToVertex & code_to_vertex ){
+		const int d = D > 0 ? D : d_;
+		Scratch<short, D ? D+1 : 0> n1( d+1 ), n2( d+1 );
+		for( int i=begin; i<end; i++ ){
+			const short * key = vertex_key + (size_t)i*d;
+			// For each of d+1 axes,
+			for( int j = 0; j <= d; j++ ){
+				for( int k=0; k<d; k++ ){
+					n1[k] = key[k] - 1;
+					n2[k] = key[k] + 1;
+				}
+				// Only the first d coordinates are stored and hashed, the
+				// last one follows from them
+				if( j < d ){
+					n1[j] = key[j] + d;
+					n2[j] = key[j] - d;
+				}
+				
+				blur_neighbors_[j*M_+i].n1 = code_to_vertex( hash_table.lookup( &n1[0] ) );
+				blur_neighbors_[j*M_+i].n2 = code_to_vertex( hash_table.lookup( &n2[0] ) );
 			}
 		}
+	}
+	
+	// Renumber the vertices along a Morton curve over their keys, vertex_id maps
+	// the hash table entries to vertices and vertex_key holds the keys by vertex.
+	// A vertex's blur neighbours, one step away on every axis, then mostly sit
+	// close by in memory, whatever order the points came in.
+	void orderVertices( std::vector<int> & vertex_id, std::vector<short> & vertex_key ) const {
+		const int bits = std::min( 64 / std::max( d_, 1 ), 16 );
+		std::vector<int> lo( d_, 0 ), shift( d_, 0 );
+		for( int k=0; k<d_ && M_>0; k++ ){
+			int mn = vertex_key[k], mx = vertex_key[k];
+			for( int i=1; i<M_; i++ ){
+				mn = std::min<int>( mn, vertex_key[ (size_t)i*d_+k ] );
+				mx = std::max<int>( mx, vertex_key[ (size_t)i*d_+k ] );
+			}
+			lo[k] = mn;
+			// Keep the top bits of the spread when it is wider than a code allows
+			while( ((mx-mn) >> shift[k]) >= (1 << bits) )
+				shift[k]++;
+		}
+		std::vector< std::pair<unsigned long long,int> > codes( M_ );
+		ThreadPool::Instance().ParallelFor( 0, M_, PARALLEL_GRAIN, [&]( int begin, int end ){
+			std::vector<unsigned int> coords( d_ );
+			for( int i=begin; i<end; i++ ){
+				for( int k=0; k<d_; k++ )
+					coords[k] = (unsigned int)( (vertex_key[ (size_t)i*d_+k ] - lo[k]) >> shift[k] );
+				codes[i] = std::make_pair( mortonCode( coords.data(), d_, bits ), i );
+			}
+		});
+		std::sort( codes.begin(), codes.end() );
+		std::vector<int> rank( M_ );
+		std::vector<short> sorted_key( (size_t)M_*d_ );
+		for( int i=0; i<M_; i++ ){
+			rank[ codes[i].second ] = i;
+			memcpy( &sorted_key[ (size_t)i*d_ ], &vertex_key[ (size_t)codes[i].second*d_ ], d_*sizeof(short) );
+		}
+		vertex_key.swap( sorted_key );
+		for( size_t j=0; j<vertex_id.size(); j++ )
+			vertex_id[j] = rank[ vertex_id[j] ];
+	}
+	// The offsets of count points from first, unpacked into block if they are compact
+	const int * offsets( int * block, int first, int count ) const {
+		const int d1 = d_+1;
+		if (!compact_)
+			return offset_ + (size_t)first*d1;
+		const uint64_t mask = (uint64_t(1) << offset_bits_) - 1;
+		for( int k=0; k<count*d1; k++ ){
+			const uint64_t bit = ((uint64_t)first*d1 + k) * offset_bits_;
+			const uint32_t * word = packed_offset_ + (bit >> 5);
+			block[k] = (int)( ((word[0] | (uint64_t)word[1] << 32) >> (bit & 31)) & mask );
+		}
+		return block;
+	}
+	
+	// List the (point, vertex) entries of offset_ per vertex in increasing point order,
+	// so the splat can be computed as a parallel gather with the serial summation order
+	void buildSplatIndex(){
+		reserveBuffer( splat_start_, splat_start_capacity_, M_+1 );
+		reserveBuffer( splat_index_, splat_index_capacity_, (d_+1)*N_ );
+		memset( splat_start_, 0, (M_+1)*sizeof(int) );
+		for( int e=0; e<(d_+1)*N_; e++ )
+			splat_start_[ offset_[e]+1 ]++;
+		for( int i=0; i<M_; i++ )
+			splat_start_[i+1] += splat_start_[i];
+		int * fill = new int[ M_ ];
+		memcpy( fill, splat_start_, M_*sizeof(int) );
+		for( int e=0; e<(d_+1)*N_; e++ )
+			splat_index_[ fill[ offset_[e] ]++ ] = e;
+		delete[] fill;
+	}
+public:
+	Permutohedral() :offset_( NULL ),barycentric_( NULL ),blur_neighbors_( NULL ),splat_start_( NULL ),splat_index_( NULL ),has_splat_index_( false ),
+	                 compact_( false ),packed_offset_( NULL ),offset_bits_( 0 ),buffers_( &own_buffers_ ),filtered_( NULL ),filtered_size_( 0 ),
+	                 offset_capacity_( 0 ),barycentric_capacity_( 0 ),neighbors_capacity_( 0 ),splat_start_capacity_( 0 ),splat_index_capacity_( 0 ),packed_offset_capacity_( 0 ),N_ ( 0 ),M_ ( 0 ),d_ ( 0 ) {
+	}
+	~Permutohedral(){
+		releaseBuffer( barycentric_, barycentric_capacity_ );
+		releaseBuffer( offset_, offset_capacity_ );
+		releaseBuffer( blur_neighbors_, neighbors_capacity_ );
+		releaseBuffer( splat_start_, splat_start_capacity_ );
+		releaseBuffer( splat_index_, splat_index_capacity_ );
+		releaseBuffer( packed_offset_, packed_offset_capacity_ );
+	}
+
+	// Filter with buffers (NULL for the lattice's own) from now on
+	void shareBuffers( LatticeBuffers * buffers ){
+		buffers_ = buffers ? buffers : &own_buffers_;
+		if (buffers_ != &own_buffers_){
+			releaseBuffer( own_buffers_.values, own_buffers_.values_capacity );
+			releaseBuffer( own_buffers_.new_values, own_buffers_.new_values_capacity );
+		}
+	}
+
+	// Build the lattice of N points with feature_size features each, options is a
+	// combination of LatticeOptions
+	void init ( const float* feature, int feature_size, int N, int options = 0 )
+	{
+		const bool compact = (options & LATTICE_COMPACT) != 0;
+		// Compute the lattice coordinates for each feature [there is going to be a lot of magic here
+		N_ = N;
+		d_ = feature_size;
+		const int d1 = d_+1;
+		ThreadPool & pool = ThreadPool::Instance();
+		const bool parallel = pool.num_threads() > 1;
+		ShardedHashTable hash_table( d_, N_*d1, parallel ? LATTICE_SHARDS : 1, parallel );
+
+		// Allocate the class memory, reusing the buffers of the previous lattice
+		reserveBuffer( offset_, offset_capacity_, d1*N_, compact );
+		reserveBuffer( barycentric_, barycentric_capacity_, d1*N_, compact );
+		
+		// Allocate the shared memory
+		float * scale_factor = new float[d_];
+		short * canonical = new short[d1*d1];
+		
+		// Compute the canonical simplex
+		for( int i=0; i<=d_; i++ ){
+			for( int j=0; j<=d_-i; j++ )
+				canonical[i*d1+j] = i;
+			for( int j=d_-i+1; j<=d_; j++ )
+				canonical[i*d1+j] = i - d1;
+		}
+		
+		// Expected standard deviation of our filter (p.6 in [Adams etal 2010])
+		float inv_std_dev = sqrtf(2.f / 3.f)*d1;
+		// Compute the diagonal part of E (p.5 in [Adams etal 2010])
+		for( int i=0; i<d_; i++ )
+			scale_factor[i] = 1.f / sqrtf( (i+2.f)*(i+1.f) ) * inv_std_dev;
+		
+		// Compute the simplex each feature lies in, offset_ temporarily holds the hash table codes
+		pool.ParallelFor( 0, N_, PARALLEL_GRAIN, [&]( int begin, int end ){
+			// The dimensions DenseCRF2D and DenseCRF3D use get their own unrolled code
+			switch( d_ ){
+			case 2: embedPoints<2>( feature, feature_size, begin, end, scale_factor, canonical, hash_table ); break;
+			case 5: embedPoints<5>( feature, feature_size, begin, end, scale_factor, canonical, hash_table ); break;
+			case 6: embedPoints<6>( feature, feature_size, begin, end, scale_factor, canonical, hash_table ); break;
+			default: embedPoints<0>( feature, feature_size, begin, end, scale_factor, canonical, hash_table );
+			}
+		});
 		delete [] scale_factor;
-		delete [] elevated;
-		delete [] rem0;
-		delete [] barycentric;
-		delete [] rank;
 		delete [] canonical;
-		delete [] key;
 		
-		
-		// Find the Neighbors of each lattice point
+		// Number the vertices in the order they are first used, exactly as a single
+		// hash table filled point by point would. The entries that first used a vertex
+		// are flagged in a bitset, and a vertex id is the rank of its flag.
 		
 		// Get the number of vertices in the lattice
 		M_ = hash_table.size();
 		
-		// Create the neighborhood structure
-		if(blur_neighbors_) delete[] blur_neighbors_;
-		blur_neighbors_ = new Neighbors[ (d_+1)*M_ ];
+		const int n_entries = d1*N_;
+		const int n_words = n_entries/64 + 1;
+		std::vector<uint64_t> first_flags( n_words, 0 );
+		for( int s=0; s<hash_table.shards(); s++ )
+			for( int i=0; i<hash_table.size( s ); i++ ){
+				const int e = hash_table.first( s, i );
+				first_flags[ e/64 ] |= uint64_t(1) << (e%64);
+			}
+		std::vector<int> word_rank( n_words+1, 0 );
+		for( int w=0; w<n_words; w++ )
+			word_rank[w+1] = word_rank[w] + __builtin_popcountll( first_flags[w] );
 		
-		short * n1 = new short[d_+1];
-		short * n2 = new short[d_+1];
+		// Vertex id and key of every hash table code, the ids of shard s start at shard_start[s]
+		const int n_shards = hash_table.shards();
+		const int shard_bits = hash_table.shardBits();
+		std::vector<int> shard_start( n_shards+1, 0 );
+		for( int s=0; s<n_shards; s++ )
+			shard_start[s+1] = shard_start[s] + hash_table.size( s );
+		std::vector<int> vertex_id( M_ );
+		std::vector<short> vertex_key( (size_t)M_*d_ );
+		for( int s=0; s<n_shards; s++ )
+			for( int i=0; i<hash_table.size( s ); i++ ){
+				const int e = hash_table.first( s, i );
+				const int id = word_rank[ e/64 ] + __builtin_popcountll( first_flags[ e/64 ] & ((uint64_t(1) << (e%64)) - 1) );
+				vertex_id[ shard_start[s]+i ] = id;
+				memcpy( &vertex_key[ (size_t)id*d_ ], hash_table.getKey( s, i ), d_*sizeof(short) );
+			}
+		if (options & LATTICE_ORDERED)
+			orderVertices( vertex_id, vertex_key );
+		const int shard_mask = n_shards-1;
+		auto code_to_vertex = [&]( int code ){
+			return code < 0 ? -1 : vertex_id[ shard_start[ code & shard_mask ] + (code >> shard_bits) ];
+		};
+		pool.ParallelFor( 0, n_entries, PARALLEL_GRAIN, [&]( int begin, int end ){
+			for( int e=begin; e<end; e++ )
+				offset_[e] = code_to_vertex( offset_[e] );
+		});
 		
-		// For each of d+1 axes,
-		for( int j = 0; j <= d_; j++ ){
-			for( int i=0; i<M_; i++ ){
-				const short * key = hash_table.getKey( i );
-				for( int k=0; k<d_; k++ ){
-					n1[k] = key[k] - 1;
-					n2[k] = key[k] + 1;
-				}
-				n1[j] = key[j] + d_;
-				n2[j] = key[j] - d_;
-				
-				blur_neighbors_[j*M_+i].n1 = hash_table.find( n1 );
-				blur_neighbors_[j*M_+i].n2 = hash_table.find( n2 );
+		// Find the Neighbors of each lattice point
+		
+		// Create the neighborhood structure
+		reserveBuffer( blur_neighbors_, neighbors_capacity_, d1*M_ );
+		
+		pool.ParallelFor( 0, M_, PARALLEL_GRAIN, [&]( int begin, int end ){
+			switch( d_ ){
+			case 2: findNeighbors<2>( &vertex_key[0], begin, end, hash_table, code_to_vertex ); break;
+			case 5: findNeighbors<5>( &vertex_key[0], begin, end, hash_table, code_to_vertex ); break;
+			case 6: findNeighbors<6>( &vertex_key[0], begin, end, hash_table, code_to_vertex ); break;
+			default: findNeighbors<0>( &vertex_key[0], begin, end, hash_table, code_to_vertex );
 			}
+		});
+		
+		compact_ = compact;
+		has_splat_index_ = parallel && !compact;
+		if (has_splat_index_)
+			buildSplatIndex();
+		else
+			releaseBuffer( splat_index_, splat_index_capacity_ );
+		if (compact){
+			packOffsets();
+			releaseBuffer( offset_, offset_capacity_ );
 		}
-		delete[] n1;
-		delete[] n2;
+		else
+			releaseBuffer( packed_offset_, packed_offset_capacity_ );
 	}
 
-	void compute ( float* out, const float* in, int value_size, int in_offset=0, int out_offset=0, int in_size = -1, int out_size = -1 ) const
+	// Splat and blur the in_size value vectors from in_offset, the first half of compute.
+	// The result stays in the lattice buffers until the next filter, slice reads it.
+	void filter ( const float* in, int value_size, int in_offset=0, int in_size = -1 ) const
 	{
 		if ( in_size == -1)  in_size = N_ -  in_offset;
-		if (out_size == -1) out_size = N_ - out_offset;
+		
+		// Pad each vertex value vector to whole SIMD registers, the padding stays zero.
+		// Vectors shorter than a register (the normalisation pass) stay scalar rather
+		// than multiplying the lattice memory traffic.
+		const LatticeKernels & kernels = latticeKernels( value_size );
+		const int padded_size = simdPad( value_size, kernels.width );
 		
 		// Shift all values by 1 such that -1 -> 0 (used for blurring)
-		float * values = new float[ (M_+2)*value_size ];
-		float * new_values = new float[ (M_+2)*value_size ];
+		const size_t n_values = (M_+2)*padded_size;
+		reserveBuffer( buffers_->values, buffers_->values_capacity, n_values );
+		reserveBuffer( buffers_->new_values, buffers_->new_values_capacity, n_values );
+		float * values = buffers_->values;
+		float * new_values = buffers_->new_values;
+		memset( values, 0, n_values*sizeof(float) );
+		// The blur writes every vertex row, only the two sentinel rows need clearing
+		memset( new_values, 0, padded_size*sizeof(float) );
+		memset( new_values+(M_+1)*padded_size, 0, padded_size*sizeof(float) );
 		
-		for( int i=0; i<(M_+2)*value_size; i++ )
-			values[i] = new_values[i] = 0;
+		ThreadPool & pool = ThreadPool::Instance();
+		const int d1 = d_+1;
 		
 		// Splatting
-		for( int i=0;  i<in_size; i++ ){
-			for( int j=0; j<=d_; j++ ){
-				int o = offset_[(in_offset+i)*(d_+1)+j]+1;
-				float w = barycentric_[(in_offset+i)*(d_+1)+j];
-				for( int k=0; k<value_size; k++ )
-					values[ o*value_size+k ] += w * in[ i*value_size+k ];
+		if (has_splat_index_ && in_offset == 0 && in_size == N_)
+			pool.ParallelFor( 0, M_, PARALLEL_GRAIN, [&]( int begin, int end ){
+				kernels.gather( values, in, splat_index_, splat_start_, barycentric_, begin, end, d1, value_size, padded_size );
+			});
+		else {
+			int block[ OFFSET_BLOCK ];
+			const int block_points = compact_ ? OFFSET_BLOCK/d1 : in_size;
+			for( int first=0; first<in_size; first+=block_points ){
+				const int n = std::min( block_points, in_size-first );
+				kernels.splat( values, in+(size_t)first*value_size, offsets( block, in_offset+first, n ),
+				               barycentric_+(size_t)(in_offset+first)*d1, n, d1, value_size, padded_size );
 			}
 		}
 		
+		// Blurring
 		for( int j=0; j<=d_; j++ ){
-			for( int i=0; i<M_; i++ ){
-				float * old_val = values + (i+1)*value_size;
-				float * new_val = new_values + (i+1)*value_size;
-				
-				int n1 = blur_neighbors_[j*M_+i].n1+1;
-				int n2 = blur_neighbors_[j*M_+i].n2+1;
-				float * n1_val = values + n1*value_size;
-				float * n2_val = values + n2*value_size;
-				for( int k=0; k<value_size; k++ )
-					new_val[k] = old_val[k]+0.5f*(n1_val[k] + n2_val[k]);
-			}
+			pool.ParallelFor( 0, M_, PARALLEL_GRAIN, [&]( int begin, int end ){
+				kernels.blur( new_values, values, blur_neighbors_+j*M_, begin, end, padded_size );
+			});
 			float * tmp = values;
 			values = new_values;
 			new_values = tmp;
 		}
+		filtered_ = values;
+		filtered_size_ = value_size;
+	}
+	
+	// Slice the filtered values at the count points from first into out
+	void slice ( float* out, int first, int count ) const
+	{
+		const int value_size = filtered_size_;
+		const LatticeKernels & kernels = latticeKernels( value_size );
+		const int padded_size = simdPad( value_size, kernels.width );
+		const int d1 = d_+1;
 		// Alpha is a magic scaling constant (write Andrew if you really wanna understand this)
 		float alpha = 1.0f / (1.f+powf(2.f, -(float)d_));
 		
-		// Slicing
-		for( int i=0; i<out_size; i++ ){
-			for( int k=0; k<value_size; k++ )
-				out[i*value_size+k] = 0;
-			for( int j=0; j<=d_; j++ ){
-				int o = offset_[(out_offset+i)*(d_+1)+j]+1;
-				float w = barycentric_[(out_offset+i)*(d_+1)+j];
-				for( int k=0; k<value_size; k++ )
-					out[ i*value_size+k ] += w * values[ o*value_size+k ] * alpha;
+		ThreadPool::Instance().ParallelFor( 0, count, PARALLEL_GRAIN, [&]( int begin, int end ){
+			int block[ OFFSET_BLOCK ];
+			const int block_points = compact_ ? OFFSET_BLOCK/d1 : end-begin;
+			for( int i=begin; i<end; i+=block_points ){
+				const int n = std::min( block_points, end-i );
+				const int point = first+i;
+				kernels.slice( out+(size_t)i*value_size, filtered_, offsets( block, point, n ), barycentric_+(size_t)point*d1,
+				               n, d1, alpha, value_size, padded_size );
 			}
-		}
-		
-		
-		delete[] values;
-		delete[] new_values;
+		});
+	}
+	
+	void compute ( float* out, const float* in, int value_size, int in_offset=0, int out_offset=0, int in_size = -1, int out_size = -1 ) const
+	{
+		if (out_size == -1) out_size = N_ - out_offset;
+		filter( in, value_size, in_offset, in_size );
+		slice( out, out_offset, out_size );
 	}
 };
@@ -26,25 +26,58 @@
 */
 
 #include "util.h"
+#include <atomic>
+#include <cstdint>
 #include <cstring>
+#include <new>
+#include <xmmintrin.h>
+
+static std::atomic<size_t> allocation_count( 0 );
+static std::atomic<size_t> allocated_bytes( 0 );
+static std::atomic<size_t> peak_allocated_bytes( 0 );
+
+void* allocateBytes(size_t bytes) {
+	// Always align so the SIMD kernels can use aligned loads on padded rows. The
+	// size is kept in front of the buffer, and a register of slack after it.
+	char * block = bytes <= SIZE_MAX-2*CRF_ALIGNMENT ? (char*)_mm_malloc( bytes+2*CRF_ALIGNMENT, CRF_ALIGNMENT ) : NULL;
+	if (!block)
+		throw std::bad_alloc();
+	*(size_t*)block = bytes;
+	allocation_count++;
+	const size_t allocated = allocated_bytes += bytes;
+	size_t peak = peak_allocated_bytes;
+	while( peak < allocated && !peak_allocated_bytes.compare_exchange_weak( peak, allocated ) );
+	return block + CRF_ALIGNMENT;
+}
+void deallocateBytes(void* ptr) {
+	if (ptr) {
+		char * block = (char*)ptr - CRF_ALIGNMENT;
+		allocated_bytes -= *(size_t*)block;
+		_mm_free( block );
+	}
+}
+size_t allocationCount() {
+	return allocation_count;
+}
+size_t allocatedBytes() {
+	return allocated_bytes;
+}
+size_t peakAllocatedBytes() {
+	return peak_allocated_bytes;
+}
+void resetPeakAllocatedBytes() {
+	peak_allocated_bytes = (size_t)allocated_bytes;
+}
 
 float* allocate(size_t N) {
 	float * r = NULL;
-	if (N>0)
-#ifdef SSE_DENSE_CRF
-		r = (float*)_mm_malloc( N*sizeof(float)+16, 16 );
-#else
-		r = new float[N];
-#endif
-	memset( r, 0, sizeof(float)*N);
+	if (N>0) {
+		r = (float*)allocateBytes( N*sizeof(float) );
+		memset( r, 0, sizeof(float)*N);
+	}
 	return r;
 }
 void deallocate(float*& ptr) {
-	if (ptr)
-#ifdef SSE_DENSE_CRF
-		_mm_free( ptr );
-#else
-		delete[] ptr;
-#endif
+	deallocateBytes( ptr );
 	ptr = NULL;
 }
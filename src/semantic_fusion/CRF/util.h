@@ -27,9 +27,61 @@
 
 #pragma once
 
-#include "densecrf.h"
-#include "permutohedral.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
 
-// Memory handling switches between SSE and new
+// Alignment (in bytes) of every buffer returned by allocate, enough for AVX
+const size_t CRF_ALIGNMENT = 32;
+
+// Memory handling, all buffers are zeroed and CRF_ALIGNMENT aligned
 float* allocate ( size_t N ) ;
 void deallocate ( float *& ptr ) ;
+
+// Uninitialised CRF_ALIGNMENT aligned memory, used by the buffers below. Throws
+// std::bad_alloc when there is none left.
+void* allocateBytes ( size_t bytes ) ;
+void deallocateBytes ( void * ptr ) ;
+// Number of buffers allocated so far, to check that the steady state allocates nothing
+size_t allocationCount () ;
+// Bytes held in those buffers right now and at most since the last reset of the peak
+size_t allocatedBytes () ;
+size_t peakAllocatedBytes () ;
+void resetPeakAllocatedBytes () ;
+
+// Interleave the low bits bits of the d coordinates into a Morton (Z-order)
+// code, most significant bits first. d*bits must not exceed 64.
+inline unsigned long long mortonCode ( const unsigned int * coords, int d, int bits ) {
+	unsigned long long code = 0;
+	for( int b=bits-1; b>=0; b-- )
+		for( int i=0; i<d; i++ )
+			code = (code << 1) | ((coords[i] >> b) & 1);
+	return code;
+}
+
+// Make sure buffer holds at least N elements. It grows geometrically (to exactly
+// N when memory is tighter than allocations) and only ever grows, the contents
+// are not kept when it does.
+template<typename T>
+void reserveBuffer ( T *& buffer, size_t & capacity, size_t N, bool exact = false ) {
+	if (N <= capacity && buffer)
+		return;
+	size_t grown = capacity < 16 ? 16 : capacity;
+	while( grown < N )
+		grown = exact ? N : 2*grown;
+	// Left empty if the allocation throws
+	deallocateBytes( buffer );
+	buffer = NULL;
+	capacity = 0;
+	if (grown > SIZE_MAX/sizeof(T))
+		throw std::bad_alloc();
+	buffer = (T*)allocateBytes( grown*sizeof(T) );
+	capacity = grown;
+}
+template<typename T>
+void releaseBuffer ( T *& buffer, size_t & capacity ) {
+	deallocateBytes( buffer );
+	buffer = NULL;
+	capacity = 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+#ifndef CRF_SNAPSHOT_H_
+#define CRF_SNAPSHOT_H_
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// A surfel map and its probability table, as written by
+// SemanticFusionInterface::SaveCRFSnapshot for tuning the CRF offline. The
+// file holds a magic string, the number of surfels and of classes (32 bit
+// ints), the surfels (12 floats each) and then the probabilities, class-major
+// with num_surfels entries per class.
+struct CrfSnapshot {
+  int num_surfels;
+  int num_classes;
+  std::vector<float> surfels;
+  std::vector<float> probabilities;
+};
+
+static const char kCrfSnapshotMagic[8] = {'S','F','C','R','F','0','0','1'};
+
+inline bool SaveCrfSnapshot(const std::string& filename, const float* surfels,
+                            const float* probabilities, const int num_surfels,
+                            const int num_classes) {
+  std::ofstream file(filename.c_str(), std::ios::binary);
+  const int32_t sizes[2] = {num_surfels, num_classes};
+  file.write(kCrfSnapshotMagic, sizeof(kCrfSnapshotMagic));
+  file.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+  file.write(reinterpret_cast<const char*>(surfels), sizeof(float) * num_surfels * 12);
+  file.write(reinterpret_cast<const char*>(probabilities),
+             sizeof(float) * num_surfels * num_classes);
+  return static_cast<bool>(file);
+}
+
+inline bool LoadCrfSnapshot(const std::string& filename, CrfSnapshot& snapshot) {
+  std::ifstream file(filename.c_str(), std::ios::binary);
+  char magic[sizeof(kCrfSnapshotMagic)];
+  int32_t sizes[2];
+  file.read(magic, sizeof(magic));
+  file.read(reinterpret_cast<char*>(sizes), sizeof(sizes));
+  if (!file || !std::equal(magic, magic + sizeof(magic), kCrfSnapshotMagic) ||
+      sizes[0] < 0 || sizes[1] <= 0) {
+    return false;
+  }
+  snapshot.num_surfels = sizes[0];
+  snapshot.num_classes = sizes[1];
+  snapshot.surfels.resize(static_cast<size_t>(sizes[0]) * 12);
+  snapshot.probabilities.resize(static_cast<size_t>(sizes[0]) * sizes[1]);
+  file.read(reinterpret_cast<char*>(snapshot.surfels.data()), sizeof(float) * snapshot.surfels.size());
+  file.read(reinterpret_cast<char*>(snapshot.probabilities.data()),
+            sizeof(float) * snapshot.probabilities.size());
+  return static_cast<bool>(file);
+}
+
+#endif /* CRF_SNAPSHOT_H_ */
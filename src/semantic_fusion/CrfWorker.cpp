@@ -0,0 +1,111 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#include "CrfWorker.h"
+
+#include <cassert>
+
+#include <utilities/ThreadPool.h>
+#include "CRF/kernels.h"
+
+// Snapshot surfels per chunk of the table conversions
+static const int kTableGrain = 4096;
+
+CrfWorker::CrfWorker(const int num_classes)
+  : num_classes_(num_classes)
+  , workspace_(num_classes)
+  , num_surfels_(0)
+  , iterations_(0)
+  , spatial_ordering_(false)
+  , busy_(false)
+  , finished_(false)
+{}
+
+CrfWorker::~CrfWorker() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+float* CrfWorker::Surfels(const int num_surfels) {
+  assert(!busy_);
+  return workspace_.Surfels(num_surfels);
+}
+
+float* CrfWorker::Probabilities(const int num_surfels) {
+  assert(!busy_);
+  if (probabilities_.size() < static_cast<size_t>(num_surfels) * num_classes_) {
+    probabilities_.resize(static_cast<size_t>(num_surfels) * num_classes_);
+  }
+  return probabilities_.data();
+}
+
+void CrfWorker::Start(const int num_surfels, const int iterations, const float tolerance) {
+  assert(!busy_);
+  num_surfels_ = num_surfels;
+  busy_ = true;
+  finished_ = false;
+  thread_ = std::thread(&CrfWorker::Run, this, iterations, tolerance);
+}
+
+const float* CrfWorker::Collect() {
+  assert(busy_);
+  thread_.join();
+  busy_ = false;
+  return factors_.data();
+}
+
+void CrfWorker::Run(const int iterations, const float tolerance) {
+  const int n = num_surfels_;
+  std::vector<int>& valid_ids = workspace_.valid_ids();
+  valid_ids.clear();
+  for (int i = 0; i < n; ++i) {
+    valid_ids.push_back(i);
+  }
+  if (spatial_ordering_) {
+    workspace_.SortAlongCurve(workspace_.Surfels(n));
+  }
+  // Variable k is snapshot surfel valid_ids[k]
+  const int* variables = NULL;
+  if (spatial_ordering_) {
+    variables_.resize(n);
+    for (int k = 0; k < n; ++k) {
+      variables_[valid_ids[k]] = k;
+    }
+    variables = variables_.data();
+  }
+  const TableKernels& table = tableKernels();
+  ThreadPool& pool = ThreadPool::Instance();
+  float* unary_potentials = workspace_.UnaryPotentials(n);
+  pool.ParallelFor(0,n,kTableGrain,[&](int begin, int end) {
+    table.to_unary(unary_potentials,probabilities_.data(),n,variables,begin,end,num_classes_);
+  });
+  DenseCRF3D& crf = workspace_.Crf(n);
+  crf.setUnaryEnergy(unary_potentials);
+  crf.addPairwiseGaussianAndBilateral(workspace_.Surfels(n),3,10,valid_ids);
+  const float* resulting_probs = crf.runInference(iterations, 1.0, tolerance);
+  iterations_ = crf.iterations();
+  workspace_.FinishUpdate();
+  // The factor that turns the snapshot into the CRF result. Classes the CRF
+  // returned nonsense for keep their probability, like CRFUpdate does.
+  factors_.resize(static_cast<size_t>(n) * num_classes_);
+  pool.ParallelFor(0,n,kTableGrain,[&](int begin, int end) {
+    table.to_factors(factors_.data(),resulting_probs,probabilities_.data(),n,variables,begin,end,num_classes_);
+  });
+  finished_ = true;
+}
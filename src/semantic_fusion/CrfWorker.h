@@ -0,0 +1,79 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+#ifndef CRF_WORKER_H_
+#define CRF_WORKER_H_
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "CrfWorkspace.h"
+
+// Runs DenseCRF3D inference over a snapshot of the map on its own thread, so
+// the main loop only pays for taking the snapshot and merging the result. The
+// result is expressed as a per class factor relative to the snapshot, which
+// lets it be applied on top of whatever was fused into the table meanwhile.
+class CrfWorker {
+public:
+  explicit CrfWorker(const int num_classes);
+  ~CrfWorker();
+
+  // Snapshot buffers, to be filled before Start while the worker is not busy.
+  // The surfels are 12 floats each, the probabilities are class-major with
+  // num_surfels entries per class.
+  float* Surfels(const int num_surfels);
+  float* Probabilities(const int num_surfels);
+
+  // Begins inference over the first num_surfels surfels of the snapshot, see
+  // DenseCRF::runInference for the tolerance
+  void Start(const int num_surfels, const int iterations, const float tolerance = 0.0);
+  // Started and not collected yet
+  bool busy() const { return busy_; }
+  // The result is ready to collect
+  bool finished() const { return finished_; }
+  int num_surfels() const { return num_surfels_; }
+  // Mean-field steps the last collected update took
+  int iterations() const { return iterations_; }
+  // See CrfWorkspace, only while the worker is not busy
+  void set_memory_budget(const size_t bytes) { workspace_.set_memory_budget(bytes); }
+  void set_label_budget(const int labels) { workspace_.set_label_budget(labels); }
+  // Run the variables in the order of CrfWorkspace::SortAlongCurve, only while
+  // the worker is not busy
+  void set_spatial_ordering(const bool ordered) { spatial_ordering_ = ordered; }
+  size_t peak_bytes() const { return workspace_.peak_bytes(); }
+  // Waits for the worker and returns num_classes factors per snapshot surfel.
+  // They stay valid until the next Start.
+  const float* Collect();
+
+private:
+  void Run(const int iterations, const float tolerance);
+
+  const int num_classes_;
+  CrfWorkspace workspace_;
+  std::vector<float> probabilities_;
+  std::vector<float> factors_;
+  // CRF variable of each snapshot surfel when they are reordered
+  std::vector<int> variables_;
+  int num_surfels_;
+  int iterations_;
+  bool spatial_ordering_;
+  bool busy_;
+  std::atomic<bool> finished_;
+  std::thread thread_;
+};
+
+#endif /* CRF_WORKER_H_ */
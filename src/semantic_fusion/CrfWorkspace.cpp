@@ -0,0 +1,110 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#include "CrfWorkspace.h"
+
+#include <cmath>
+
+int CrfWorkspace::BuildCells(const float* surfels, const float* unaries, const float voxel_size) {
+  const int n = static_cast<int>(valid_ids_.size());
+  const int surfel_size = 12;
+  // Sort the surfels by the Morton code of their voxel, which puts the cells in
+  // a spatially coherent order too
+  Grow(curve_order_, n);
+  for (int k = 0; k < n; ++k) {
+    const float* position = surfels + valid_ids_[k] * surfel_size;
+    unsigned int voxel[3];
+    for (int d = 0; d < 3; ++d) {
+      voxel[d] = static_cast<unsigned int>(static_cast<int>(std::floor(position[d] / voxel_size)) + (1 << 20));
+    }
+    curve_order_[k] = std::make_pair(mortonCode(voxel, 3, 21), k);
+  }
+  std::sort(curve_order_.begin(), curve_order_.end());
+  Grow(surfel_cells_, n);
+  int num_cells = 0;
+  for (int k = 0; k < n; ++k) {
+    if (k == 0 || curve_order_[k].first != curve_order_[k - 1].first) {
+      ++num_cells;
+    }
+    surfel_cells_[curve_order_[k].second] = num_cells - 1;
+  }
+  Grow(cell_surfels_, static_cast<size_t>(num_cells) * surfel_size);
+  Grow(cell_unaries_, static_cast<size_t>(num_cells) * num_classes_);
+  Grow(cell_colours_, static_cast<size_t>(num_cells) * 3);
+  Grow(cell_sizes_, num_cells);
+  Grow(cell_ids_, num_cells);
+  std::fill(cell_surfels_.begin(), cell_surfels_.end(), 0.0f);
+  std::fill(cell_unaries_.begin(), cell_unaries_.end(), 0.0f);
+  std::fill(cell_colours_.begin(), cell_colours_.end(), 0.0f);
+  std::fill(cell_sizes_.begin(), cell_sizes_.end(), 0);
+  // Sum up in sorted order so the result doesn't depend on the table order
+  for (int s = 0; s < n; ++s) {
+    const int k = curve_order_[s].second;
+    const int c = surfel_cells_[k];
+    const float* surfel = surfels + valid_ids_[k] * surfel_size;
+    float* cell = &cell_surfels_[c * surfel_size];
+    for (int d = 0; d < 3; ++d) {
+      cell[d] += surfel[d];
+      cell[8 + d] += surfel[8 + d];
+    }
+    const int colour = static_cast<int>(surfel[4]);
+    cell_colours_[c * 3 + 0] += colour >> 16 & 0xFF;
+    cell_colours_[c * 3 + 1] += colour >> 8 & 0xFF;
+    cell_colours_[c * 3 + 2] += colour & 0xFF;
+    for (int j = 0; j < num_classes_; ++j) {
+      cell_unaries_[c * num_classes_ + j] += unaries[k * num_classes_ + j];
+    }
+    cell_sizes_[c]++;
+  }
+  for (int c = 0; c < num_cells; ++c) {
+    const float inv_size = 1.0f / cell_sizes_[c];
+    float* cell = &cell_surfels_[c * surfel_size];
+    float normal_length = 0.0f;
+    for (int d = 0; d < 3; ++d) {
+      cell[d] *= inv_size;
+      normal_length += cell[8 + d] * cell[8 + d];
+    }
+    // The mean normal is shorter than a unit one where the surface bends
+    normal_length = std::sqrt(normal_length);
+    for (int d = 0; d < 3; ++d) {
+      cell[8 + d] = normal_length > 0.0f ? cell[8 + d] / normal_length : 0.0f;
+    }
+    int rgb[3];
+    for (int d = 0; d < 3; ++d) {
+      rgb[d] = static_cast<int>(cell_colours_[c * 3 + d] * inv_size + 0.5f);
+    }
+    cell[4] = static_cast<float>((rgb[0] << 16) | (rgb[1] << 8) | rgb[2]);
+    for (int j = 0; j < num_classes_; ++j) {
+      cell_unaries_[c * num_classes_ + j] *= inv_size;
+    }
+    cell_ids_[c] = c;
+  }
+  return num_cells;
+}
+
+void CrfWorkspace::BroadcastCells(const float* cell_marginals, const float cell_weight, float* unaries) const {
+  const int n = static_cast<int>(valid_ids_.size());
+  for (int k = 0; k < n; ++k) {
+    const float* marginal = cell_marginals + surfel_cells_[k] * num_classes_;
+    float* probs = unaries + k * num_classes_;
+    for (int j = 0; j < num_classes_; ++j) {
+      const float own = cell_weight < 1.0f ? std::exp(-probs[j]) : 0.0f;
+      probs[j] = cell_weight * marginal[j] + (1.0f - cell_weight) * own;
+    }
+  }
+}
@@ -0,0 +1,202 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+#ifndef CRF_WORKSPACE_H_
+#define CRF_WORKSPACE_H_
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "CRF/densecrf.h"
+#include "CRF/util.h"
+
+// Everything SemanticFusionInterface::CRFUpdate needs between the GPU tables and
+// the CRF. It lives as long as the interface and only ever grows, so once the
+// map stops growing an update (and every mean-field iteration) runs without
+// allocating.
+class CrfWorkspace {
+public:
+  explicit CrfWorkspace(const int num_classes)
+    : num_classes_(num_classes)
+    , memory_budget_(0)
+    , label_budget_(0)
+    , allocations_start_(0)
+    , allocations_(0)
+    , peak_bytes_(0)
+  {}
+
+  // Host copy of the surfel map, 12 floats per surfel
+  float* Surfels(const int num_surfels) {
+    Grow(surfels_, static_cast<size_t>(num_surfels) * 12);
+    return surfels_.data();
+  }
+  // -log probabilities, num_classes per CRF variable
+  float* UnaryPotentials(const int num_variables) {
+    Grow(unary_potentials_, static_cast<size_t>(num_variables) * num_classes_);
+    return unary_potentials_.data();
+  }
+  // Surfel id of each CRF variable
+  std::vector<int>& valid_ids() { return valid_ids_; }
+  // Reorders valid_ids along a Morton curve over the positions of the surfels
+  // (12 floats each), so that variables close in space are close in every CRF
+  // buffer and lattice too
+  void SortAlongCurve(const float* surfels) {
+    const int n = static_cast<int>(valid_ids_.size());
+    if (n == 0) {
+      return;
+    }
+    const int surfel_size = 12;
+    const int bits = 21;
+    float lo[3], hi[3];
+    for (int k = 0; k < 3; ++k) {
+      lo[k] = hi[k] = surfels[valid_ids_[0] * surfel_size + k];
+    }
+    for (int i = 1; i < n; ++i) {
+      for (int k = 0; k < 3; ++k) {
+        lo[k] = std::min(lo[k], surfels[valid_ids_[i] * surfel_size + k]);
+        hi[k] = std::max(hi[k], surfels[valid_ids_[i] * surfel_size + k]);
+      }
+    }
+    float scale[3];
+    for (int k = 0; k < 3; ++k) {
+      scale[k] = hi[k] > lo[k] ? ((1 << bits) - 1) / (hi[k] - lo[k]) : 0.0f;
+    }
+    Grow(curve_order_, n);
+    for (int i = 0; i < n; ++i) {
+      const float* position = surfels + valid_ids_[i] * surfel_size;
+      unsigned int coords[3];
+      for (int k = 0; k < 3; ++k) {
+        coords[k] = static_cast<unsigned int>((position[k] - lo[k]) * scale[k]);
+      }
+      curve_order_[i] = std::make_pair(mortonCode(coords, 3, bits), valid_ids_[i]);
+    }
+    std::sort(curve_order_.begin(), curve_order_.end());
+    for (int i = 0; i < n; ++i) {
+      valid_ids_[i] = curve_order_[i].second;
+    }
+  }
+  // Host copy of the fusion stamp of each surfel
+  float* FusionStamps(const int num_surfels) {
+    Grow(fusion_stamps_, num_surfels);
+    return fusion_stamps_.data();
+  }
+
+  // Marginals of the last update, num_classes per variable, kept to warm start
+  // the next one
+  void StoreMarginals(const float* marginals, const int num_variables) {
+    Grow(marginals_, static_cast<size_t>(num_variables) * num_classes_);
+    std::copy(marginals, marginals + marginals_.size(), marginals_.begin());
+  }
+  const float* marginals() const { return marginals_.data(); }
+  int num_marginals() const { return static_cast<int>(marginals_.size()) / num_classes_; }
+  // Which stored marginal each variable of the next update starts from (-1 for
+  // its unary), see DenseCRF::setInitialMarginals
+  int* MarginalSources(const int num_variables) {
+    Grow(marginal_sources_, num_variables);
+    std::fill(marginal_sources_.begin(), marginal_sources_.end(), -1);
+    return marginal_sources_.data();
+  }
+  // Groups the surfels listed in valid_ids into cubic cells of voxel_size and
+  // merges each cell into one CRF variable: a surfel (12 floats) with the mean
+  // position, normal and colour, and a unary that is the mean of the cell's
+  // unaries (num_classes per valid surfel, -log probabilities). Returns the
+  // number of cells, which come in Morton order.
+  int BuildCells(const float* surfels, const float* unaries, const float voxel_size);
+  const float* cell_surfels() const { return cell_surfels_.data(); }
+  const float* cell_unaries() const { return cell_unaries_.data(); }
+  // 0 to the number of cells, the valid ids of the cell surfels
+  const std::vector<int>& cell_ids() const { return cell_ids_; }
+  // Replaces the unaries BuildCells was given with probabilities: the marginal
+  // of the surfel's cell, num_classes per cell, weighted by cell_weight plus
+  // the surfel's own unary probability weighted by 1 - cell_weight
+  void BroadcastCells(const float* cell_marginals, const float cell_weight, float* unaries) const;
+
+  // Stored marginal of each surfel of the table (-1 for none)
+  int* SurfelMarginals(const int num_surfels) {
+    Grow(surfel_marginals_, num_surfels);
+    std::fill(surfel_marginals_.begin(), surfel_marginals_.end(), -1);
+    return surfel_marginals_.data();
+  }
+
+  // Keep the CRF within about bytes from the next update on, 0 for no limit.
+  // See DenseCRF::setMemoryBudget.
+  void set_memory_budget(const size_t bytes) { memory_budget_ = bytes; }
+  // Labels kept per variable from the next update on, 0 for all of them. See
+  // DenseCRF::setLabelBudget.
+  void set_label_budget(const int labels) { label_budget_ = labels; }
+
+  // The CRF, emptied and sized for num_variables. Its buffers and lattices are
+  // those of the previous update.
+  DenseCRF3D& Crf(const int num_variables) {
+    allocations_start_ = allocationCount();
+    resetPeakAllocatedBytes();
+    if (!crf_) {
+      // Created empty so a memory budget is in place before anything is allocated
+      crf_.reset(new DenseCRF3D(0, num_classes_, 0.05, 20, 0.1));
+    }
+    if (crf_->memoryBudget() != memory_budget_) {
+      crf_->setMemoryBudget(memory_budget_);
+    }
+    crf_->reset(num_variables);
+    crf_->setLabelBudget(label_budget_);
+    return *crf_;
+  }
+  // Called once the update is done, to record its CRF allocations
+  void FinishUpdate() {
+    allocations_ = allocationCount() - allocations_start_;
+    peak_bytes_ = peakAllocatedBytes();
+  }
+  // Number of CRF buffers the last update allocated, zero in the steady state
+  size_t allocations() const { return allocations_; }
+  // Most memory held in CRF buffers during the last update. The count is process
+  // wide, so it includes a background update running at the same time.
+  size_t peak_bytes() const { return peak_bytes_; }
+
+private:
+  template <typename T>
+  static void Grow(std::vector<T>& buffer, const size_t size) {
+    if (buffer.capacity() < size) {
+      buffer.reserve(std::max(size, 2 * buffer.capacity()));
+    }
+    buffer.resize(size);
+  }
+
+  const int num_classes_;
+  std::vector<float> surfels_;
+  std::vector<float> unary_potentials_;
+  std::vector<int> valid_ids_;
+  std::vector<std::pair<unsigned long long, int> > curve_order_;
+  std::vector<int> surfel_cells_;
+  std::vector<float> cell_surfels_;
+  std::vector<float> cell_unaries_;
+  std::vector<float> cell_colours_;
+  std::vector<int> cell_sizes_;
+  std::vector<int> cell_ids_;
+  std::vector<float> fusion_stamps_;
+  std::vector<float> marginals_;
+  std::vector<int> marginal_sources_;
+  std::vector<int> surfel_marginals_;
+  std::unique_ptr<DenseCRF3D> crf_;
+  size_t memory_budget_;
+  int label_budget_;
+  size_t allocations_start_;
+  size_t allocations_;
+  size_t peak_bytes_;
+};
+
+#endif /* CRF_WORKSPACE_H_ */
@@ -0,0 +1,100 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#include "ImageCrfRefiner.h"
+
+#include <chrono>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <utilities/ThreadPool.h>
+#include "CRF/kernels.h"
+
+// Pixels per chunk of the table conversions
+static const int kTableGrain = 4096;
+
+ImageCrfRefiner::ImageCrfRefiner(const int num_classes)
+  : num_classes_(num_classes)
+  , iterations_(5)
+  , time_budget_(0.0)
+  , gaussian_stddev_(3.0)
+  , gaussian_weight_(3.0)
+  , bilateral_stddev_(50.0)
+  , colour_stddev_(13.0)
+  , bilateral_weight_(5.0)
+  , steps_(0)
+  , elapsed_ms_(0.0)
+  , crf_width_(0)
+  , crf_height_(0)
+{}
+
+bool ImageCrfRefiner::Refine(const ImagePtr rgb, const int height, const int width,
+                             float* probabilities, const int prob_height, const int prob_width) {
+  typedef std::chrono::steady_clock Clock;
+  const Clock::time_point start = Clock::now();
+  const int num_pixels = prob_width * prob_height;
+  steps_ = 0;
+  if (!crf_ || crf_width_ != prob_width || crf_height_ != prob_height) {
+    crf_.reset(new DenseCRF2D(prob_width,prob_height,num_classes_));
+    crf_width_ = prob_width;
+    crf_height_ = prob_height;
+  }
+  crf_->reset(num_pixels);
+  // The frame as the network saw it
+  resized_rgb_.resize(static_cast<size_t>(num_pixels) * 3);
+  cv::Mat input_image(height,width,CV_8UC3,rgb);
+  cv::Mat resized_image(prob_height,prob_width,CV_8UC3,resized_rgb_.data());
+  cv::resize(input_image,resized_image,resized_image.size(),0,0);
+  // The probabilities are already a class-major table with a column per pixel
+  unary_.resize(static_cast<size_t>(num_pixels) * num_classes_);
+  const TableKernels& table = tableKernels();
+  ThreadPool& pool = ThreadPool::Instance();
+  pool.ParallelFor(0, num_pixels, kTableGrain, [&](int begin, int end) {
+    table.to_unary(unary_.data(),probabilities,num_pixels,NULL,begin,end,num_classes_);
+  });
+  crf_->setUnaryEnergy(unary_.data());
+  crf_->addPairwiseGaussianAndBilateral(gaussian_stddev_,gaussian_stddev_,gaussian_weight_,
+                                        bilateral_stddev_,bilateral_stddev_,colour_stddev_,
+                                        colour_stddev_,colour_stddev_,resized_rgb_.data(),
+                                        bilateral_weight_);
+  // Whatever the setup left of the budget goes to the mean-field steps
+  double remaining = 0.0;
+  if (time_budget_ > 0.0) {
+    remaining = time_budget_ - std::chrono::duration<double,std::milli>(Clock::now() - start).count();
+    if (remaining <= 0.0) {
+      elapsed_ms_ = std::chrono::duration<double,std::milli>(Clock::now() - start).count();
+      return false;
+    }
+  }
+  crf_->setTimeBudget(remaining);
+  const float* marginals = crf_->runInference(iterations_, 1.0);
+  steps_ = crf_->iterations();
+  if (steps_ > 0) {
+    const int num_classes = num_classes_;
+    pool.ParallelFor(0, num_pixels, kTableGrain, [&](int begin, int end) {
+      for (int j = 0; j < num_classes; ++j) {
+        float* out = probabilities + static_cast<size_t>(j) * num_pixels;
+        for (int i = begin; i < end; ++i) {
+          out[i] = marginals[static_cast<size_t>(i) * num_classes + j];
+        }
+      }
+    });
+  }
+  elapsed_ms_ = std::chrono::duration<double,std::milli>(Clock::now() - start).count();
+  return steps_ > 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+#ifndef IMAGE_CRF_REFINER_H_
+#define IMAGE_CRF_REFINER_H_
+#include <memory>
+#include <vector>
+
+#include <utilities/Types.h>
+#include "CRF/densecrf.h"
+
+// Sharpens the CNN output of a frame with a DenseCRF2D at network resolution
+// before it is fused, pairing a smoothness kernel with a bilateral one on the
+// RGB resized to match. The work fits a per frame time budget: the CRF runs
+// only the mean-field steps that fit in what the setup left, and the output is
+// left alone when none of them do. Steps are timed as they run, so only the
+// first frame, with none timed yet, can overrun, by up to one step.
+class ImageCrfRefiner {
+public:
+  explicit ImageCrfRefiner(const int num_classes);
+
+  // Most mean-field steps per frame
+  void set_iterations(const int iterations) { iterations_ = iterations; }
+  // Milliseconds a frame may spend in Refine, 0 for no limit
+  void set_time_budget(const double ms) { time_budget_ = ms; }
+  // Smoothness kernel, with its standard deviation in network pixels
+  void set_gaussian(const float stddev, const float weight) {
+    gaussian_stddev_ = stddev;
+    gaussian_weight_ = weight;
+  }
+  // Appearance kernel, standard deviations in network pixels and RGB levels
+  void set_bilateral(const float stddev, const float colour_stddev, const float weight) {
+    bilateral_stddev_ = stddev;
+    colour_stddev_ = colour_stddev;
+    bilateral_weight_ = weight;
+  }
+
+  // Refines probabilities in place, class-major with prob_width x
+  // prob_height entries per class as the network produces them. rgb is the
+  // width x height frame the network saw. Returns whether any step ran.
+  bool Refine(const ImagePtr rgb, const int height, const int width,
+              float* probabilities, const int prob_height, const int prob_width);
+  // Mean-field steps and milliseconds of the last Refine
+  int steps() const { return steps_; }
+  double elapsed_ms() const { return elapsed_ms_; }
+
+private:
+  const int num_classes_;
+  int iterations_;
+  double time_budget_;
+  float gaussian_stddev_;
+  float gaussian_weight_;
+  float bilateral_stddev_;
+  float colour_stddev_;
+  float bilateral_weight_;
+  int steps_;
+  double elapsed_ms_;
+  // Kept between frames along with their buffers and lattices
+  std::unique_ptr<DenseCRF2D> crf_;
+  int crf_width_;
+  int crf_height_;
+  std::vector<unsigned char> resized_rgb_;
+  std::vector<float> unary_;
+};
+
+#endif /* IMAGE_CRF_REFINER_H_ */
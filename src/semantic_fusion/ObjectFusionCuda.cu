@@ -3,6 +3,9 @@
 
 #include <cuda_runtime.h>
 
+#include "SemanticFusionCuda.h"
+#include "SemanticFusionKernels.h"
+
 #define gpuErrChk(ans) { gpuAssert((ans), __FILE__, __LINE__); }
 
 inline void gpuAssert(cudaError_t code, const char *file, int line, bool
@@ -70,39 +73,17 @@ void objectTableUpdate(cudaTextureObject_t ids, const int ids_width, const int i
                           const float* mask_probabilities,
                     const int x1, const int y1, const int box_width, const int box_height, 
                     const int obj_id, const int class_id, const float class_prob,
-                    float* object_id_table, const int map_size)
+                    float* object_id_table, const int map_size,
+                    const unsigned long long* claims, const unsigned int pass)
 {
 	// masks coordinate indices 
     const int x = blockIdx.x * blockDim.x + threadIdx.x;
     const int y = blockIdx.y * blockDim.y + threadIdx.y;
-    // New uniqueness code
-    if (x<box_width||y<box_height){
-    // if (1){
-		const int check_patch = 16;
-		const int x_min = (x - check_patch) < 0 ? 0 : (x - check_patch);
-		const int x_max = (x + check_patch) > box_width ? box_width : (x + check_patch);
-		const int y_min = (y - check_patch) < 0 ? 0 : (y - check_patch);
-		const int y_max = (y + check_patch) < box_height ? box_height : (y + check_patch);
+    if (x<box_width&&y<box_height){
     	int surfel_id = tex2D<int>(ids,x+x1,y+y1);
-    	// int surfel_id = 0;
-    	int first_h, first_w;
-
-	    for (int h = y_min; h < y_max; ++h) {
-        int other_surfel_id;
-        for (int w = x_min; w < x_max; ++w) {
-            other_surfel_id = tex2D<int>(ids,w+x1,h+y1);
-            if (other_surfel_id == surfel_id) {
-                first_h = h;
-                first_w = w;
-                break;
-            }
-        }
-        if (other_surfel_id == surfel_id) {
-                break;
-            }
-    	}
 
-	    if (first_h != y || first_w != x) {
+	    // Only the first pixel of the box showing a surfel fuses into it
+	    if (surfel_id > 0 && claims[surfel_id] != claimKey(pass,y*box_width+x)) {
 	        surfel_id = 0;
 	    }
 
@@ -131,13 +112,16 @@ void objectTableUpdate(cudaTextureObject_t ids, const int ids_width, const int i
 __host__
 void fuseObjects(cudaTextureObject_t ids, const int ids_width, const int ids_height, const float* mask_probabilities,
                     const int x1, const int y1, const int box_width, const int box_height, const int obj_id, const int class_id, const float class_prob,
-                    float* object_id_table, const int map_size){
+                    float* object_id_table, const int map_size, SurfelClaims& claims){
+    const unsigned int pass = claims.NextPass(map_size);
+    claimSurfels(ids,x1,y1,box_width,box_height,claims.keys(),pass);
 	// NOTE Res must be pow 2 and > 32
     const int blocks = 32; // TODO : global function need check
     dim3 dimGrid(blocks,blocks);
     dim3 dimBlock((box_width+blocks-1)/blocks,(box_height+blocks-1)/blocks);
     objectTableUpdate<<<dimGrid,dimBlock>>>(ids,ids_width,ids_height,mask_probabilities,
-    	x1,y1,box_width,box_height, obj_id, class_id, class_prob, object_id_table, map_size);
+    	x1,y1,box_width,box_height, obj_id, class_id, class_prob, object_id_table, map_size,
+    	claims.keys(), pass);
     gpuErrChk(cudaGetLastError());
     gpuErrChk(cudaDeviceSynchronize());
 }
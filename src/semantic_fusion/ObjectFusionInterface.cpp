@@ -19,6 +19,7 @@
 #include "ObjectFusionInterface.h"
 #include "SemanticFusionCuda.h"
 #include "ObjectFusionCuda.h"
+#include "SemanticFusionKernels.h"
 #include <utilities/Stopwatch.h>
 #include <set>
 #include <cmath>
@@ -72,14 +73,28 @@ void remove_index(std::vector<T>& vector, const std::vector<int>& to_remove) {
   vector.resize(vector.size() - to_remove.size());
 }
 
+void ObjectFusionInterface::SetSparseTable(const int top_k) {
+  CHECK(top_k >= 0 && top_k <= kMaxTopK) << "At most " << kMaxTopK << " classes per surfel";
+  CHECK_LT(num_classes_,static_cast<int>(kNoClass)) << "Sparse class ids are 16 bits";
+  const TableLayout layout = top_k ? TableLayout::Sparse(top_k) : TableLayout::ClassMajor(max_components_);
+  if (layout.top_k == table_layout_.top_k) {
+    return;
+  }
+  std::shared_ptr<caffe::Blob<float> > table(top_k ? new caffe::Blob<float>(1,1,max_components_,layout.surfel_stride)
+                                                   : new caffe::Blob<float>(1,1,num_classes_,max_components_));
+  copyProbabilityTable(current_table_size_,num_classes_,class_probabilities_gpu_->gpu_data(),table_layout_,
+                       table->mutable_gpu_data(),layout);
+  class_probabilities_gpu_ = table;
+  class_probabilities_gpu_buffer_.reset(new caffe::Blob<float>(table->shape()));
+  table_layout_ = layout;
+}
+
 void ObjectFusionInterface::CalculateProjectedProbabilityMap(const std::unique_ptr<ElasticFusionInterface>& map) {
   const int id_width = map->width(); 
   const int id_height = map->height();
-  const int table_height = class_probabilities_gpu_->height(); // num_classes_
-  const int table_width = class_probabilities_gpu_->width();  // max_components_
   renderProbabilityMap(map->GetSurfelIdsGpu(),id_width,id_height,
                        class_probabilities_gpu_->mutable_gpu_data(),
-                       table_width,table_height,
+                       table_layout_,num_classes_,
                        rendered_class_probabilities_gpu_->mutable_gpu_data());
 }
 void ObjectFusionInterface::CalculateProjectedObjectMap(const std::unique_ptr<ElasticFusionInterface>& map){
@@ -119,10 +134,11 @@ void ObjectFusionInterface::UpdateProbabilityTable(const std::unique_ptr<Elastic
   const int new_table_width = map->GetMapSurfelCount();
   const int num_deleted = map->GetMapSurfelDeletedCount();
   // printf("%i\n", num_deleted);
-  const int table_width = class_probabilities_gpu_->width();  // max_components_
-  const int table_height = class_probabilities_gpu_->height();  // num_classes_
+  const int table_width = max_components_;
+  const int table_height = num_classes_;
   updateProbabilityTable(map->GetDeletedSurfelIdsGpu(),num_deleted,current_table_size_,
-                    class_probabilities_gpu_->gpu_data(), table_width, table_height,
+                    class_probabilities_gpu_->gpu_data(), table_layout_,
+                    table_width, table_height,
                     new_table_width, class_probabilities_gpu_buffer_->mutable_gpu_data(),
                     class_max_gpu_->gpu_data(),class_max_gpu_buffer_->mutable_gpu_data());
   // We then swap the pointers from the buffer to the other one
@@ -213,13 +229,13 @@ void ObjectFusionInterface::UpdateProbabilities(std::shared_ptr<caffe::Blob<floa
   // printf("prob_height: %i\n", prob_height);  
   const int prob_channels = probs->channels();  //14
   // printf("prob_channels: %i\n", prob_channels);
-  const int map_size = class_probabilities_gpu_->width();  //3000000
+  const int map_size = max_components_;  //3000000
   // printf("map_size: %i\n", map_size);
   
   fuseSemanticProbabilities(map->GetSurfelIdsGpu(),id_width,id_height,probs->gpu_data(),
                     prob_width,prob_height,prob_channels,
-                    class_probabilities_gpu_->mutable_gpu_data(),
-                    class_max_gpu_->mutable_gpu_data(),map_size);
+                    class_probabilities_gpu_->mutable_gpu_data(),table_layout_,
+                    class_max_gpu_->mutable_gpu_data(),map_size,claims_);
   map->UpdateSurfelClassGpu(map_size,class_max_gpu_->gpu_data(),class_max_gpu_->gpu_data() + map_size,colour_threshold_);
   
   // For Debug: get the max probability and class label
@@ -390,7 +406,7 @@ void ObjectFusionInterface::UpdateObjectIds(std::vector<MaskInfo>* masks, int nu
 
     fuseObjects(map->GetSurfelIdsGpu(), id_width,id_height,mask_blob.gpu_data(),
                     x1, y1, box_width,box_height, obj_id, class_id, class_prob,
-                    obj_ID_table_->mutable_gpu_data(),map_size);
+                    obj_ID_table_->mutable_gpu_data(),map_size,claims_);
     printf("%s\n", "test4");
 
     obj_ID_table_->Update();
@@ -33,6 +33,8 @@
 #include <utilities/MaskLogReader.h>
 #include <cuda_runtime.h>
 
+#include "SemanticFusionCuda.h"
+
 struct sceneObject{
   int class_id;
   float class_prob;
@@ -50,6 +52,7 @@ public:
     , colour_threshold_(colour_threshold)
     , num_objects_(0)
     , mask_prob_threshold_(0.4)
+    , table_layout_(TableLayout::ClassMajor(max_components))
   { 
     // This table contains for each component (surfel) the probability of
     // it being associated with each class
@@ -68,6 +71,10 @@ public:
   }
   virtual ~ObjectFusionInterface() {}
 
+  // Keeps only the top_k most likely classes of each surfel, or all of them
+  // for 0 (see SemanticFusionInterface::SetSparseTable)
+  void SetSparseTable(const int top_k);
+
   int UpdateSurfelProbabilities(const int surfel_id, const std::vector<float>& class_probs);
   void UpdateProbabilities(std::shared_ptr<caffe::Blob<float> > probs,const std::unique_ptr<ElasticFusionInterface>& map);
   void UpdateProbabilityTable(const std::unique_ptr<ElasticFusionInterface>& map);
@@ -120,6 +127,9 @@ private:
   const float colour_threshold_;
   int num_objects_;
   const float mask_prob_threshold_;
+  // First pixel claims of the surfels for fusing probabilities and masks
+  SurfelClaims claims_;
+  TableLayout table_layout_;
 };
 
 #endif /* OBJECT_FUSION_INTERFACE_H_ */
@@ -0,0 +1,120 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#ifndef SEMANTIC_FUSION_BACKEND_H_
+#define SEMANTIC_FUSION_BACKEND_H_
+#include <cstddef>
+
+#ifdef __CUDACC__
+#define SEMANTIC_FUSION_HOST_DEVICE __host__ __device__
+#else
+#define SEMANTIC_FUSION_HOST_DEVICE
+#endif
+
+// The surfel id image of the current view, as a CUDA texture object for the
+// GPU backend or as a row-major host array for the CPU one
+struct SurfelIdImage {
+  // cudaTextureObject_t, kept as its underlying type so this header doesn't
+  // need CUDA
+  unsigned long long texture;
+  const int* data;
+  int width;
+  int height;
+};
+
+// Where the class probability table keeps the probability of each class of
+// each surfel. Class-major, the original layout, has a row of map_size
+// surfels per class. Surfel-major keeps the classes of a surfel together,
+// padded to a multiple of 16 floats (64 bytes), so fusing or normalising a
+// surfel touches one or two cache lines rather than one per class.
+//
+// Quantized tables hold a record of surfel_stride floats per surfel instead:
+// a float scale s followed by a code_bits (8 or 16) code per class, class c
+// having the log probability -code_c * s relative to the most likely class
+// (see encodeSurfel in SemanticFusionKernels.h). index() then addresses the
+// words of the records rather than classes.
+//
+// Sparse tables keep only the top_k most likely classes of each surfel, in a
+// record of a float residual mass, top_k float probabilities in decreasing
+// order and their top_k 16 bit class ids. The classes left out share the
+// residual mass evenly (see encodeTopK). Records also take surfel_stride
+// words, independent of the class count.
+struct TableLayout {
+  int surfel_stride;
+  int class_stride;
+  int code_bits;
+  int top_k;
+
+  SEMANTIC_FUSION_HOST_DEVICE int index(const int surfel_id, const int class_id) const {
+    return surfel_id * surfel_stride + class_id * class_stride;
+  }
+  SEMANTIC_FUSION_HOST_DEVICE bool surfel_major() const { return surfel_stride != 1; }
+  SEMANTIC_FUSION_HOST_DEVICE bool quantized() const { return code_bits != 0; }
+  SEMANTIC_FUSION_HOST_DEVICE bool sparse() const { return top_k != 0; }
+  // Whether surfels are records of words rather than a float per class
+  SEMANTIC_FUSION_HOST_DEVICE bool packed() const { return quantized() || sparse(); }
+  // Floats the table of map_size surfels takes
+  size_t size(const int classes, const int map_size) const {
+    return surfel_major() ? static_cast<size_t>(map_size) * surfel_stride
+                          : static_cast<size_t>(classes) * class_stride;
+  }
+
+  static TableLayout ClassMajor(const int map_size) {
+    TableLayout layout = {1, map_size, 0, 0};
+    return layout;
+  }
+  static TableLayout SurfelMajor(const int classes) {
+    TableLayout layout = {(classes + 15) / 16 * 16, 1, 0, 0};
+    return layout;
+  }
+  static TableLayout Quantized(const int classes, const int code_bits) {
+    TableLayout layout = {1 + (classes * code_bits / 8 + 3) / 4, 1, code_bits, 0};
+    return layout;
+  }
+  static TableLayout Sparse(const int top_k) {
+    TableLayout layout = {1 + top_k + (top_k + 1) / 2, 1, 0, top_k};
+    return layout;
+  }
+};
+
+// The operations SemanticFusionInterface runs on the probability table every
+// frame. The table and image pointers are device pointers for a backend that
+// isn't host(), host pointers otherwise. See SemanticFusionCuda.h for what each
+// of them does.
+class SemanticFusionBackend {
+public:
+  virtual ~SemanticFusionBackend() {}
+  virtual bool host() const = 0;
+  virtual void FuseProbabilities(const SurfelIdImage& ids, const float* probabilities,
+                                 const int prob_width, const int prob_height, const int prob_channels,
+                                 float* map_table, const TableLayout table, float* map_max, const int map_size,
+                                 float* fusion_stamps = NULL, const float stamp = 0.0) = 0;
+  virtual void UpdateProbabilityTable(const int* kept_ids, const int num_kept, const int current_table_size,
+                                      const float* probability_table, const TableLayout table,
+                                      const int prob_width, const int prob_height,
+                                      const int new_prob_width, float* new_probability_table,
+                                      const float* map_table, float* new_map_table,
+                                      const float* stamps = NULL, float* new_stamps = NULL) = 0;
+  virtual void RenderProbabilityMap(const SurfelIdImage& ids, const float* probability_table,
+                                    const TableLayout table, const int prob_height,
+                                    float* rendered_probabilities) = 0;
+  virtual void UpdateMaxClass(const int n, const float* probabilities, const TableLayout table,
+                              const int classes, float* map_max, const int map_size) = 0;
+};
+
+#endif /* SEMANTIC_FUSION_BACKEND_H_ */
@@ -0,0 +1,106 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#include "SemanticFusionCpu.h"
+
+#include <algorithm>
+
+#include <utilities/ThreadPool.h>
+#include "SemanticFusionKernels.h"
+
+// Image rows, table entries and surfels per chunk of work
+static const int kRowGrain = 8;
+static const int kEntryGrain = 16384;
+static const int kSurfelGrain = 4096;
+
+void CpuSemanticFusionBackend::FuseProbabilities(const SurfelIdImage& ids, const float* probabilities,
+                                                 const int prob_width, const int prob_height, const int prob_channels,
+                                                 float* map_table, const TableLayout table, float* map_max, const int map_size,
+                                                 float* fusion_stamps, const float stamp) {
+  // The same claims as the CUDA backend, taken in pixel order so the first
+  // claim of a surfel in this pass is the one that stands
+  if (claims_.size() < static_cast<size_t>(map_size)) {
+    claims_.resize(map_size, ~0ull);
+  }
+  if (pass_ == 0) {
+    std::fill(claims_.begin(), claims_.end(), ~0ull);
+  }
+  const unsigned int pass = pass_++;
+  const int num_pixels = ids.width * ids.height;
+  fused_pixels_.clear();
+  for (int i = 0; i < num_pixels; ++i) {
+    const int surfel_id = ids.data[i];
+    if (surfel_id > 0) {
+      const unsigned long long key = claimKey(pass,i);
+      if (key < claims_[surfel_id]) {
+        claims_[surfel_id] = key;
+        fused_pixels_.push_back(i);
+      }
+    }
+  }
+  // Every surfel now has a single pixel, so none is touched by two threads
+  ThreadPool::Instance().ParallelFor(0, fused_pixels_.size(), kSurfelGrain, [&](int begin, int end) {
+    for (int k = begin; k < end; ++k) {
+      const int i = fused_pixels_[k];
+      const int x = i % ids.width;
+      const int y = i / ids.width;
+      // x,y coordinates in probability image
+      const int prob_x = static_cast<int>((float(x) / ids.width) * prob_width);
+      const int prob_y = static_cast<int>((float(y) / ids.height) * prob_height);
+      fuseSurfel(ids.data[i],prob_x,prob_y,probabilities,prob_width,prob_height,prob_channels,
+                 map_table,table,map_max,map_size,fusion_stamps,stamp);
+    }
+  });
+}
+
+void CpuSemanticFusionBackend::UpdateProbabilityTable(const int* kept_ids, const int num_kept, const int current_table_size,
+                                                      const float* probability_table, const TableLayout table,
+                                                      const int prob_width, const int prob_height,
+                                                      const int new_prob_width, float* new_probability_table,
+                                                      const float* map_table, float* new_map_table,
+                                                      const float* stamps, float* new_stamps) {
+  const int num_to_update = new_prob_width * tableEntries(table,prob_height);
+  ThreadPool::Instance().ParallelFor(0, num_to_update, kEntryGrain, [&](int begin, int end) {
+    for (int index = begin; index < end; ++index) {
+      updateTableEntry(index,kept_ids,num_kept,probability_table,table,prob_width,prob_height,
+                       new_prob_width,new_probability_table,map_table,new_map_table,stamps,new_stamps);
+    }
+  });
+}
+
+void CpuSemanticFusionBackend::RenderProbabilityMap(const SurfelIdImage& ids, const float* probability_table,
+                                                    const TableLayout table, const int prob_height,
+                                                    float* rendered_probabilities) {
+  ThreadPool::Instance().ParallelFor(0, ids.height, kRowGrain, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      for (int x = 0; x < ids.width; ++x) {
+        renderPixel(ids.data[y * ids.width + x],x,y,ids.width,ids.height,probability_table,
+                    table,prob_height,rendered_probabilities);
+      }
+    }
+  });
+}
+
+void CpuSemanticFusionBackend::UpdateMaxClass(const int n, const float* probabilities, const TableLayout table,
+                                              const int classes, float* map_max, const int map_size) {
+  ThreadPool::Instance().ParallelFor(0, n, kSurfelGrain, [&](int begin, int end) {
+    for (int index = begin; index < end; ++index) {
+      maxClassEntry(index,probabilities,table,classes,map_max,map_size);
+    }
+  });
+}
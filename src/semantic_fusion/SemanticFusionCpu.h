@@ -0,0 +1,62 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#ifndef SEMANTIC_FUSION_CPU_H_
+#define SEMANTIC_FUSION_CPU_H_
+#include <vector>
+
+#include "SemanticFusionBackend.h"
+
+// SemanticFusionBackend on the CPU, for builds and machines without CUDA. The
+// work is split over the ThreadPool and runs the per pixel and per entry code
+// of SemanticFusionKernels.h, so it makes the same decisions as the CUDA
+// kernels in the same order, but not with the same rounding: the CUDA build
+// flushes denormals, divides approximately and fuses multiply-adds (see
+// CUDA_NVCC_FLAGS), and the device expf and logf differ from glibc's. The
+// probabilities agree to a few ulp per update, a probability below FLT_MIN
+// can be 0 on the GPU, and a quantized code can be one step apart, which also
+// decides ties between equally likely classes of a sparse record.
+class CpuSemanticFusionBackend : public SemanticFusionBackend {
+public:
+  CpuSemanticFusionBackend() : pass_(0) {}
+  bool host() const { return true; }
+  void FuseProbabilities(const SurfelIdImage& ids, const float* probabilities,
+                         const int prob_width, const int prob_height, const int prob_channels,
+                         float* map_table, const TableLayout table, float* map_max, const int map_size,
+                         float* fusion_stamps, const float stamp);
+  void UpdateProbabilityTable(const int* kept_ids, const int num_kept, const int current_table_size,
+                              const float* probability_table, const TableLayout table,
+                              const int prob_width, const int prob_height,
+                              const int new_prob_width, float* new_probability_table,
+                              const float* map_table, float* new_map_table,
+                              const float* stamps, float* new_stamps);
+  void RenderProbabilityMap(const SurfelIdImage& ids, const float* probability_table,
+                            const TableLayout table, const int prob_height,
+                            float* rendered_probabilities);
+  void UpdateMaxClass(const int n, const float* probabilities, const TableLayout table,
+                      const int classes, float* map_max, const int map_size);
+
+private:
+  // Claim key of each surfel (see claimKey) and the pass count
+  std::vector<unsigned long long> claims_;
+  unsigned int pass_;
+  // The pixels fusing into their surfel, in pixel order
+  std::vector<int> fused_pixels_;
+};
+
+#endif /* SEMANTIC_FUSION_CPU_H_ */
@@ -21,6 +21,9 @@
 
 #include <cuda_runtime.h>
 
+#include "SemanticFusionCuda.h"
+#include "SemanticFusionKernels.h"
+
 #define gpuErrChk(ans) { gpuAssert((ans), __FILE__, __LINE__); }
 
 inline void gpuAssert(cudaError_t code, const char *file, int line, bool
@@ -32,186 +35,149 @@ inline void gpuAssert(cudaError_t code, const char *file, int line, bool
     } 
 }
 
-__global__ 
-void semanticTableUpdate(cudaTextureObject_t ids, const int ids_width, const int ids_height, 
-                          const float* probabilities, const int prob_width, const int prob_height, 
-                          const int prob_channels,float* map_table,float* map_max,
-                          const int map_size)
+SurfelClaims::~SurfelClaims()
+{
+    if (keys_) {
+        cudaFree(keys_);
+    }
+}
+
+__host__
+unsigned int SurfelClaims::NextPass(const int map_size)
+{
+    if (map_size > size_) {
+        if (keys_) {
+            gpuErrChk(cudaFree(keys_));
+        }
+        gpuErrChk(cudaMalloc(&keys_, map_size * sizeof(unsigned long long)));
+        size_ = map_size;
+        pass_ = 0;
+    }
+    // All ones is larger than any key, also after the pass count wraps
+    if (pass_ == 0) {
+        gpuErrChk(cudaMemset(keys_, 0xff, size_ * sizeof(unsigned long long)));
+    }
+    const unsigned int pass = pass_;
+    ++pass_;
+    return pass;
+}
+
+// 64 bit atomicMin needs sm_35, and sm_30 is still among the targets
+__device__
+void atomicMinKey(unsigned long long* address, const unsigned long long key)
+{
+    unsigned long long old = *address;
+    while (key < old) {
+        const unsigned long long assumed = old;
+        old = atomicCAS(address,assumed,key);
+        if (old == assumed) {
+            break;
+        }
+    }
+}
+
+__global__
+void claimSurfelsKernel(cudaTextureObject_t ids, const int x1, const int y1, const int width, const int height,
+                        unsigned long long* claims, const unsigned int pass)
 {
     const int x = blockIdx.x * blockDim.x + threadIdx.x;
     const int y = blockIdx.y * blockDim.y + threadIdx.y;
-    // New uniqueness code
-    const int check_patch = 16;
-    const int x_min = (x - check_patch) < 0 ? 0 : (x - check_patch);
-    const int x_max = (x + check_patch) > 640 ? 640 : (x + check_patch);
-    const int y_min = (y - check_patch) < 0 ? 0 : (y - check_patch);
-    const int y_max = (y + check_patch) < 480 ? 480 : (y + check_patch);
-
-    int surfel_id = tex2D<int>(ids,x,y);
-    int first_h, first_w;
-    // for (int h = y_min; h < 480; ++h) {
-    //     for (int w = x_min; w < x_max; ++w) {
-    //         int other_surfel_id = tex2D<int>(ids,w,h);
-    //         if (other_surfel_id == surfel_id) {
-    //             first_h = h;
-    //             first_w = w;
-    //             break;
-    //         }
-    //     }
-    // }
-
-    //patch rule 1
-    // for (int h = y_min; h < 480; ++h) {
-    //     int other_surfel_id;
-    //     for (int w = x_min; w < x_max; ++w) {
-    //         other_surfel_id = tex2D<int>(ids,w,h);
-    //         if (other_surfel_id == surfel_id) {
-    //             first_h = h;
-    //             first_w = w;
-    //             break;
-    //         }
-    //     }
-    //     if (other_surfel_id == surfel_id) {
-    //             break;
-    //         }
-    // }
-    //patch rule 2
-    for (int h = y_min; h < y_max; ++h) {
-        int other_surfel_id;
-        for (int w = x_min; w < x_max; ++w) {
-            other_surfel_id = tex2D<int>(ids,w,h);
-            if (other_surfel_id == surfel_id) {
-                first_h = h;
-                first_w = w;
-                break;
-            }
+    if (x < width && y < height) {
+        const int surfel_id = tex2D<int>(ids,x + x1,y + y1);
+        if (surfel_id > 0) {
+            atomicMinKey(claims + surfel_id,claimKey(pass,y * width + x));
         }
-        if (other_surfel_id == surfel_id) {
-                break;
-            }
     }
+}
 
-    if (first_h != y || first_w != x) {
-        surfel_id = 0;
-    }
-    if (surfel_id > 0) {
+__host__
+void claimSurfels(cudaTextureObject_t ids, const int x1, const int y1, const int width, const int height,
+                  unsigned long long* claims, const unsigned int pass)
+{
+    dim3 dimBlock(32,8);
+    dim3 dimGrid((width + dimBlock.x - 1) / dimBlock.x,(height + dimBlock.y - 1) / dimBlock.y);
+    claimSurfelsKernel<<<dimGrid,dimBlock>>>(ids,x1,y1,width,height,claims,pass);
+    gpuErrChk(cudaGetLastError());
+}
+
+__global__ 
+void semanticTableUpdate(cudaTextureObject_t ids, const int ids_width, const int ids_height, 
+                          const float* probabilities, const int prob_width, const int prob_height, 
+                          const int prob_channels,float* map_table,const TableLayout table,float* map_max,
+                          const int map_size, const unsigned long long* claims, const unsigned int pass,
+                          float* fusion_stamps, const float stamp)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    const int surfel_id = tex2D<int>(ids,x,y);
+    if (surfel_id > 0 && claims[surfel_id] == claimKey(pass,y * ids_width + x)) {
         // x,y coordinates in probability image
         const int prob_x = static_cast<int>((float(x) / ids_width) * prob_width);
         const int prob_y = static_cast<int>((float(y) / ids_height) * prob_height);
-        
-        // memory offset of the probability of the neighborhood class at the same pixel of probability image
-        const int channel_offset = prob_width * prob_height; 
-        
-        // pointer at (prob_x,prob_y)
-        const float* probability = probabilities + (prob_y * prob_width + prob_x);
-
-        // pointer at the surfel in prob_table
-        float* prior_probability = map_table + surfel_id;
-
-        // go though all class channels to update prob of the correspond surfel
-        float total = 0.0;
-        for (int class_id = 0; class_id < prob_channels; ++class_id) {
-            prior_probability[0] *= probability[0]; // use prob of a class of a pixel to update its correponsded surfel
-            total += prior_probability[0];  // sum prob of all classes
-            probability += channel_offset;  // go to the next class prob on prob image
-            prior_probability += map_size;  // go to the next class prob on surfel map
-        }
-
-        // Reset the pointers to the beginning again
-        probability = probabilities + (prob_y * prob_width + prob_x);
-        prior_probability = map_table + surfel_id;
-        float max_probability = 0.0;
-        int max_class = -1;
-        float new_total = 0.0;
-        // normalize probs and search the class with max prob
-        for (int class_id = 0; class_id < prob_channels; ++class_id) {
-            // Something has gone unexpectedly wrong - reinitialse
-            if (total <= 1e-5) {
-                prior_probability[0] = 1.0f / prob_channels;
-            } else {
-                prior_probability[0] /= total; // normalize prob 
-                if (class_id > 0 && prior_probability[0] > max_probability) {
-                    max_probability = prior_probability[0];
-                    max_class = class_id;
-                }
-            }
-            new_total += prior_probability[0];
-            probability += channel_offset;
-            prior_probability += map_size;
-        }
-        map_max[surfel_id] = static_cast<float>(max_class);
-        map_max[surfel_id + map_size] = max_probability;
-        map_max[surfel_id + map_size + map_size] += 1.0;
+        fuseSurfel(surfel_id,prob_x,prob_y,probabilities,prob_width,prob_height,prob_channels,
+                   map_table,table,map_max,map_size,fusion_stamps,stamp);
     }
 }
 
 __host__ 
 void fuseSemanticProbabilities(cudaTextureObject_t ids, const int ids_width, const int ids_height, 
                           const float* probabilities, const int prob_width, const int prob_height, 
-                          const int prob_channels,float* map_table, float* map_max,
-                          const int map_size)
+                          const int prob_channels,float* map_table, const TableLayout table, float* map_max,
+                          const int map_size, SurfelClaims& claims,
+                          float* fusion_stamps, const float stamp)
 {
+    const unsigned int pass = claims.NextPass(map_size);
+    claimSurfels(ids,0,0,ids_width,ids_height,claims.keys(),pass);
     // NOTE Res must be pow 2 and > 32
     const int blocks = 32;
     dim3 dimGrid(blocks,blocks);
     dim3 dimBlock(640/blocks,480/blocks);
-    semanticTableUpdate<<<dimGrid,dimBlock>>>(ids,ids_width,ids_height,probabilities,prob_width,prob_height,prob_channels,map_table,map_max,map_size);
+    semanticTableUpdate<<<dimGrid,dimBlock>>>(ids,ids_width,ids_height,probabilities,prob_width,prob_height,prob_channels,map_table,table,map_max,map_size,claims.keys(),pass,fusion_stamps,stamp);
     gpuErrChk(cudaGetLastError());
     gpuErrChk(cudaDeviceSynchronize());
 }
 
 __global__ 
 void updateTable(int n, const int* deleted_ids, const int num_deleted, const int current_table_size,
-                 float const* probability_table, const int prob_width, const int prob_height, 
-                 const int new_prob_width, float* new_probability_table, float const * map_table, float* new_map_table)
+                 float const* probability_table, const TableLayout table, const int prob_width, const int prob_height, 
+                 const int new_prob_width, float* new_probability_table, float const * map_table, float* new_map_table,
+                 float const* stamps, float* new_stamps)
 {
     const int index = blockIdx.x * blockDim.x + threadIdx.x;  // kernal index
     if (index < n) {
-        const int class_id = index / new_prob_width;  // get class id of current kernal in new table
-        const int component_id = index - (class_id * new_prob_width);  // get surfel id of current kernal in new table
-        const int new_id = (class_id * prob_width) + component_id; // get table index with max_componets as width
-        if (component_id >= num_deleted) {
-            // Initialise to prior (prob height is the number of classes)
-            new_probability_table[new_id] = 1.0f / prob_height;
-            // Reset the max class surfel colouring lookup
-            new_map_table[component_id] = -1.0;
-            new_map_table[component_id + prob_width] = -1.0;
-            new_map_table[component_id + prob_width + prob_width] = 0.0;
-        } else {
-            int offset = deleted_ids[component_id]; // get corresponded surf_id in previous table
-            new_probability_table[new_id] = probability_table[(class_id * prob_width) + offset];
-            // Also must update our max class mapping
-            new_map_table[component_id] = map_table[offset];
-            new_map_table[component_id + prob_width] = map_table[prob_width + offset];
-            new_map_table[component_id + prob_width + prob_width] = map_table[prob_width + prob_width + offset];
-        }
+        updateTableEntry(index,deleted_ids,num_deleted,probability_table,table,prob_width,prob_height,
+                         new_prob_width,new_probability_table,map_table,new_map_table,stamps,new_stamps);
     }
 }
 
 __host__ 
-void updateProbabilityTable(int* filtered_ids, const int num_filtered, const int current_table_size,
-                            float const* probability_table, const int prob_width, const int prob_height, 
+void updateProbabilityTable(const int* filtered_ids, const int num_filtered, const int current_table_size,
+                            float const* probability_table, const TableLayout table,
+                            const int prob_width, const int prob_height, 
                             const int new_prob_width, float* new_probability_table, 
-                            float const* map_table, float* new_map_table)
+                            float const* map_table, float* new_map_table,
+                            float const* stamps, float* new_stamps)
 /*
 filtered_ids: map->GetDeletedSurfelIdsGpu(),
 num_filtered: num_deleted,
 current_table_size: current_table_size_,
 probability_table: class_probabilities_gpu_->gpu_data(),
+table: its layout,
 prob_width: table_width, prob_height: table_height,
 new_prob_width: new_table_width, 
 new_probability_table: class_probabilities_gpu_buffer_->mutable_gpu_data(),
 map_table: class_max_gpu_->gpu_data(),
 new_map_table: class_max_gpu_buffer_->mutable_gpu_data()
+stamps, new_stamps: optional fusion stamps, moved like the max class rows
 */
 {   
 
     const int threads = 512;
-    const int num_to_update = new_prob_width * prob_height; // new_table_width*num_classes_
+    const int num_to_update = new_prob_width * tableEntries(table,prob_height); // new_table_width*num_classes_
     const int blocks = (num_to_update + threads - 1) / threads;  
     dim3 dimGrid(blocks);
     dim3 dimBlock(threads);
-    updateTable<<<dimGrid,dimBlock>>>(num_to_update,filtered_ids,num_filtered,current_table_size,probability_table,prob_width,prob_height,new_prob_width,new_probability_table, map_table, new_map_table);
+    updateTable<<<dimGrid,dimBlock>>>(num_to_update,filtered_ids,num_filtered,current_table_size,probability_table,table,prob_width,prob_height,new_prob_width,new_probability_table, map_table, new_map_table, stamps, new_stamps);
     gpuErrChk(cudaGetLastError());
     gpuErrChk(cudaDeviceSynchronize());
 }
@@ -219,72 +185,476 @@ new_map_table: class_max_gpu_buffer_->mutable_gpu_data()
 
 __global__ 
 void renderProbabilityMapKernel(cudaTextureObject_t ids, const int ids_width, const int ids_height, 
-                          const float* probability_table, const int prob_width, const int prob_height, 
+                          const float* probability_table, const TableLayout table, const int prob_height, 
                           float* rendered_probabilities) 
 {
     const int x = blockIdx.x * blockDim.x + threadIdx.x;
     const int y = blockIdx.y * blockDim.y + threadIdx.y;
     const int surfel_id = tex2D<int>(ids,x,y);
-    int projected_probability_offset = y * ids_width + x;
-    int probability_table_offset = surfel_id;
-    for (int class_id = 0; class_id < prob_height; ++class_id) {
-        if (surfel_id > 0) {
-            rendered_probabilities[projected_probability_offset] = probability_table[probability_table_offset];
-        } else {
-            rendered_probabilities[projected_probability_offset] = ((class_id == 0) ? 1.0 : 0.0);
-        }
-        projected_probability_offset += (ids_width * ids_height);
-        probability_table_offset += prob_width;
-    }
+    renderPixel(surfel_id,x,y,ids_width,ids_height,probability_table,table,prob_height,
+                rendered_probabilities);
 }
 
 
 __host__
 void renderProbabilityMap(cudaTextureObject_t ids, const int ids_width, const int ids_height, 
-                          const float* probability_table, const int prob_width, const int prob_height, 
+                          const float* probability_table, const TableLayout table, const int prob_height, 
                           float* rendered_probabilities) 
 {
     // NOTE Res must be pow 2 and > 32
     const int blocks = 32;
     dim3 dimGrid(blocks,blocks);
     dim3 dimBlock(ids_width/blocks,ids_height/blocks);
-    renderProbabilityMapKernel<<<dimGrid,dimBlock>>>(ids,ids_width,ids_height,probability_table,prob_width,prob_height,rendered_probabilities);
+    renderProbabilityMapKernel<<<dimGrid,dimBlock>>>(ids,ids_width,ids_height,probability_table,table,prob_height,rendered_probabilities);
     gpuErrChk(cudaGetLastError());
     gpuErrChk(cudaDeviceSynchronize());
 }
 
 __global__ 
-void updateMaxClassKernel(const int n, const float* probabilities, const int classes,
+void updateMaxClassKernel(const int n, const float* probabilities, const TableLayout table, const int classes,
                           float* map_max, const int map_size)
 {
     const int index = blockIdx.x * blockDim.x + threadIdx.x;
     if (index < n) {
-        // Reset the pointers to the beginning again
-        const float* probability = probabilities + index;
-        probability += map_size;
-        float max_probability = 0.0;
-        int max_class = -1;
-        for (int class_id = 1; class_id < classes; ++class_id) {
-            if (probability[0] > max_probability) {
-                max_probability = probability[0];
-                max_class = class_id;
-            }
-            probability += map_size;
-        }
-        map_max[index] = static_cast<float>(max_class);
-        map_max[index + map_size] = max_probability;
+        maxClassEntry(index,probabilities,table,classes,map_max,map_size);
     }
 }
 
 __host__ 
-void updateMaxClass(const int n, const float* probabilities, const int classes,
+void updateMaxClass(const int n, const float* probabilities, const TableLayout table, const int classes,
                     float* map_max, const int map_size)
 {
     const int threads = 512;
     const int blocks = (n + threads - 1) / threads;
     dim3 dimGrid(blocks);
     dim3 dimBlock(threads);
-    updateMaxClassKernel<<<dimGrid,dimBlock>>>(n,probabilities,classes,map_max,map_size);
+    updateMaxClassKernel<<<dimGrid,dimBlock>>>(n,probabilities,table,classes,map_max,map_size);
+    gpuErrChk(cudaGetLastError());
+    gpuErrChk(cudaDeviceSynchronize());
+}
+
+__global__ 
+void invertKeptIdsKernel(const int* kept_ids, const int num_kept, int* inverse_ids)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < num_kept) {
+        inverse_ids[kept_ids[index]] = index;
+    }
+}
+
+__global__ 
+void remapSurfelIdsKernel(const int n, const int* inverse_ids, int* surfel_ids)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        const int id = surfel_ids[index];
+        surfel_ids[index] = (id < 0) ? -1 : inverse_ids[id];
+    }
+}
+
+__host__ 
+void invertKeptIds(const int* kept_ids, const int num_kept, const int table_size, int* inverse_ids)
+{
+    // Surfels that were not kept map to -1
+    gpuErrChk(cudaMemset(inverse_ids, -1, table_size * sizeof(int)));
+    const int threads = 512;
+    if (num_kept > 0) {
+        invertKeptIdsKernel<<<(num_kept + threads - 1) / threads,threads>>>(kept_ids,num_kept,inverse_ids);
+        gpuErrChk(cudaGetLastError());
+    }
+    gpuErrChk(cudaDeviceSynchronize());
+}
+
+__host__ 
+void remapSurfelIds(const int* inverse_ids, int* surfel_ids, const int n)
+{
+    const int threads = 512;
+    const int blocks = (n + threads - 1) / threads;
+    dim3 dimGrid(blocks);
+    dim3 dimBlock(threads);
+    remapSurfelIdsKernel<<<dimGrid,dimBlock>>>(n,inverse_ids,surfel_ids);
     gpuErrChk(cudaGetLastError());
     gpuErrChk(cudaDeviceSynchronize());
 }
+
+__global__ 
+void mergeCrfProbabilitiesKernel(const int n, const int* surfel_ids, const float* factors,
+                                 const int classes, float* probability_table, const TableLayout table)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        const int surfel_id = surfel_ids[index];
+        if (surfel_id < 0) {
+            return;
+        }
+        const float* factor = factors + index * classes;
+        float total = 0.0;
+        for (int class_id = 0; class_id < classes; ++class_id) {
+            total += probability_table[table.index(surfel_id,class_id)] * factor[class_id];
+        }
+        if (!(total > 0.0) || isinf(total)) {
+            return;
+        }
+        for (int class_id = 0; class_id < classes; ++class_id) {
+            probability_table[table.index(surfel_id,class_id)] *= factor[class_id] / total;
+        }
+    }
+}
+
+__global__ 
+void mergeCrfQuantizedKernel(const int n, const int* surfel_ids, const float* factors,
+                             const int classes, float* probability_table, const TableLayout table)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        const int surfel_id = surfel_ids[index];
+        if (surfel_id < 0) {
+            return;
+        }
+        float* record = probability_table + surfel_id * table.surfel_stride;
+        const QuantizedLogs prior = quantizedLogs(record,table.code_bits);
+        const float* factor = factors + index * classes;
+        // The same check as the float table, on the decoded probabilities
+        float prior_total = 0.0;
+        float total = 0.0;
+        for (int class_id = 0; class_id < classes; ++class_id) {
+            const float probability = expf(prior(class_id));
+            prior_total += probability;
+            total += probability * factor[class_id];
+        }
+        total /= prior_total;
+        if (!(total > 0.0) || isinf(total)) {
+            return;
+        }
+        const ProbabilityLogs factor_logs = {factor, 1};
+        const ProductLogs<QuantizedLogs,ProbabilityLogs> merged = {prior,factor_logs};
+        encodeSurfel(record,table.code_bits,classes,merged);
+    }
+}
+
+__global__ 
+void mergeCrfSparseKernel(const int n, const int* surfel_ids, const float* factors,
+                          const int classes, float* probability_table, const TableLayout table)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        const int surfel_id = surfel_ids[index];
+        if (surfel_id < 0) {
+            return;
+        }
+        // Left alone on the same totals as the float table
+        float* record = probability_table + surfel_id * table.surfel_stride;
+        const ObservedProbabilities factor = {factors + index * classes, 1};
+        const ProductProbabilities<SparseProbabilities,ObservedProbabilities> merged =
+            {sparseProbabilities(record,table.top_k,classes),factor};
+        encodeTopK(record,table.top_k,classes,merged);
+    }
+}
+
+__host__ 
+void mergeCrfProbabilities(const int n, const int* surfel_ids, const float* factors,
+                           const int classes, float* probability_table, const TableLayout table)
+{
+    const int threads = 512;
+    const int blocks = (n + threads - 1) / threads;
+    dim3 dimGrid(blocks);
+    dim3 dimBlock(threads);
+    if (table.sparse()) {
+        mergeCrfSparseKernel<<<dimGrid,dimBlock>>>(n,surfel_ids,factors,classes,probability_table,table);
+    } else if (table.quantized()) {
+        mergeCrfQuantizedKernel<<<dimGrid,dimBlock>>>(n,surfel_ids,factors,classes,probability_table,table);
+    } else {
+        mergeCrfProbabilitiesKernel<<<dimGrid,dimBlock>>>(n,surfel_ids,factors,classes,probability_table,table);
+    }
+    gpuErrChk(cudaGetLastError());
+    gpuErrChk(cudaDeviceSynchronize());
+}
+
+__global__ 
+void gatherProbabilitiesKernel(const int* surfel_ids, const int n, const float* probability_table,
+                               const TableLayout table, const int classes, float* probabilities)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n * classes) {
+        const int i = index / classes;
+        const int class_id = index - i * classes;
+        probabilities[index] = probability_table[table.index(surfel_ids[i],class_id)];
+    }
+}
+
+__global__ 
+void gatherPackedKernel(const int* surfel_ids, const int n, const float* probability_table,
+                           const TableLayout table, const int classes, float* probabilities)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        const float* record = probability_table + surfel_ids[index] * table.surfel_stride;
+        if (table.sparse()) {
+            decodeTopK(record,table.top_k,classes,probabilities + index * classes,1);
+        } else {
+            decodeSurfel(record,table.code_bits,classes,probabilities + index * classes,1);
+        }
+    }
+}
+
+__host__ 
+void gatherProbabilities(const int* surfel_ids, const int n, const float* probability_table,
+                         const TableLayout table, const int classes, float* probabilities)
+{
+    const int threads = 512;
+    if (table.packed()) {
+        gatherPackedKernel<<<(n + threads - 1) / threads,threads>>>(surfel_ids,n,probability_table,table,
+                                                                    classes,probabilities);
+        gpuErrChk(cudaGetLastError());
+        gpuErrChk(cudaDeviceSynchronize());
+        return;
+    }
+    const int blocks = (n * classes + threads - 1) / threads;
+    dim3 dimGrid(blocks);
+    dim3 dimBlock(threads);
+    gatherProbabilitiesKernel<<<dimGrid,dimBlock>>>(surfel_ids,n,probability_table,table,classes,probabilities);
+    gpuErrChk(cudaGetLastError());
+    gpuErrChk(cudaDeviceSynchronize());
+}
+
+__global__ 
+void scatterProbabilitiesKernel(const int* surfel_ids, const int n, const float* probabilities,
+                                const int classes, float* probability_table, const TableLayout table)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n * classes) {
+        const int i = index / classes;
+        const int class_id = index - i * classes;
+        const float probability = probabilities[index];
+        // Sometimes the CRF returns nan probabilities... filter these out
+        if (probability > 0.0 && probability < 1.0) {
+            probability_table[table.index(surfel_ids[i],class_id)] = probability;
+        }
+    }
+}
+
+// The CRF probabilities of a surfel, with its old ones wherever the CRF gave
+// no probability
+struct ScatteredLogs {
+    QuantizedLogs prior;
+    float prior_log_total;
+    const float* probability;
+    __device__ float operator()(const int class_id) const {
+        const float value = probability[class_id];
+        if (value > 0.0 && value < 1.0) {
+            return logf(value);
+        }
+        return prior(class_id) - prior_log_total;
+    }
+};
+
+struct ScatteredProbabilities {
+    SparseProbabilities prior;
+    const float* probability;
+    __device__ float operator()(const int class_id) const {
+        const float value = probability[class_id];
+        if (value > 0.0 && value < 1.0) {
+            return value;
+        }
+        return prior(class_id);
+    }
+};
+
+__global__ 
+void scatterSparseKernel(const int* surfel_ids, const int n, const float* probabilities,
+                         const int classes, float* probability_table, const TableLayout table)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        float* record = probability_table + surfel_ids[index] * table.surfel_stride;
+        const ScatteredProbabilities scattered = {sparseProbabilities(record,table.top_k,classes),
+                                                  probabilities + index * classes};
+        encodeTopK(record,table.top_k,classes,scattered);
+    }
+}
+
+__global__ 
+void scatterQuantizedKernel(const int* surfel_ids, const int n, const float* probabilities,
+                            const int classes, float* probability_table, const TableLayout table)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        float* record = probability_table + surfel_ids[index] * table.surfel_stride;
+        const QuantizedLogs prior = quantizedLogs(record,table.code_bits);
+        float total = 0.0;
+        for (int class_id = 0; class_id < classes; ++class_id) {
+            total += expf(prior(class_id));
+        }
+        const ScatteredLogs scattered = {prior, logf(total), probabilities + index * classes};
+        encodeSurfel(record,table.code_bits,classes,scattered);
+    }
+}
+
+__host__ 
+void scatterProbabilities(const int* surfel_ids, const int n, const float* probabilities,
+                          const int classes, float* probability_table, const TableLayout table)
+{
+    const int threads = 512;
+    if (table.sparse()) {
+        scatterSparseKernel<<<(n + threads - 1) / threads,threads>>>(surfel_ids,n,probabilities,classes,
+                                                                     probability_table,table);
+        gpuErrChk(cudaGetLastError());
+        gpuErrChk(cudaDeviceSynchronize());
+        return;
+    }
+    if (table.quantized()) {
+        scatterQuantizedKernel<<<(n + threads - 1) / threads,threads>>>(surfel_ids,n,probabilities,classes,
+                                                                        probability_table,table);
+        gpuErrChk(cudaGetLastError());
+        gpuErrChk(cudaDeviceSynchronize());
+        return;
+    }
+    const int blocks = (n * classes + threads - 1) / threads;
+    dim3 dimGrid(blocks);
+    dim3 dimBlock(threads);
+    scatterProbabilitiesKernel<<<dimGrid,dimBlock>>>(surfel_ids,n,probabilities,classes,probability_table,table);
+    gpuErrChk(cudaGetLastError());
+    gpuErrChk(cudaDeviceSynchronize());
+}
+
+__global__ 
+void copyProbabilityTableKernel(const int n, const int classes, const float* probability_table,
+                                const TableLayout table, float* new_probability_table, const TableLayout new_table)
+{
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n * classes) {
+        // Consecutive threads write consecutive entries of the new table
+        int surfel_id, class_id;
+        if (new_table.surfel_major()) {
+            surfel_id = index / classes;
+            class_id = index - surfel_id * classes;
+        } else {
+            class_id = index / n;
+            surfel_id = index - class_id * n;
+        }
+        new_probability_table[new_table.index(surfel_id,class_id)] = probability_table[table.index(surfel_id,class_id)];
+    }
+}
+
+// Log and linear views of a distribution for converting between encodings
+template <typename Weights>
+struct WeightLogs {
+    Weights weights;
+    __device__ float operator()(const int class_id) const {
+        return logf(weights(class_id) + 1e-12f);
+    }
+};
+
+template <typename Logs>
+struct LogWeights {
+    Logs logs;
+    __device__ float operator()(const int class_id) const {
+        return expf(logs(class_id));
+    }
+};
+
+template <typename Weights>
+__device__ 
+void encodePacked(float* record, const TableLayout table, const int classes, const Weights& weights)
+{
+    if (table.sparse()) {
+        const float total = encodeTopK(record,table.top_k,classes,weights);
+        if (!(total > 0.0f && total <= FLT_MAX)) {
+            clearTopK(record,table.top_k);
+        }
+    } else {
+        const WeightLogs<Weights> logs = {weights};
+        encodeSurfel(record,table.code_bits,classes,logs);
+    }
+}
+
+__global__ 
+void copyPackedTableKernel(const int n, const int classes, const float* probability_table,
+                           const TableLayout table, float* new_probability_table, const TableLayout new_table)
+{
+    const int surfel_id = blockIdx.x * blockDim.x + threadIdx.x;
+    if (surfel_id < n) {
+        const float* source = probability_table + table.index(surfel_id,0);
+        if (!new_table.packed()) {
+            float* out = new_probability_table + new_table.index(surfel_id,0);
+            if (table.sparse()) {
+                decodeTopK(source,table.top_k,classes,out,new_table.class_stride);
+            } else {
+                decodeSurfel(source,table.code_bits,classes,out,new_table.class_stride);
+            }
+            return;
+        }
+        float* record = new_probability_table + surfel_id * new_table.surfel_stride;
+        if (table.sparse()) {
+            encodePacked(record,new_table,classes,sparseProbabilities(source,table.top_k,classes));
+        } else if (table.quantized() && new_table.quantized()) {
+            encodeSurfel(record,new_table.code_bits,classes,quantizedLogs(source,table.code_bits));
+        } else if (table.quantized()) {
+            const LogWeights<QuantizedLogs> weights = {quantizedLogs(source,table.code_bits)};
+            encodePacked(record,new_table,classes,weights);
+        } else {
+            const ObservedProbabilities weights = {source, table.class_stride};
+            encodePacked(record,new_table,classes,weights);
+        }
+    }
+}
+
+__host__ 
+void copyProbabilityTable(const int n, const int classes, const float* probability_table, const TableLayout table,
+                          float* new_probability_table, const TableLayout new_table)
+{
+    const int threads = 512;
+    if (table.packed() || new_table.packed()) {
+        if (n > 0) {
+            copyPackedTableKernel<<<(n + threads - 1) / threads,threads>>>(n,classes,probability_table,table,
+                                                                           new_probability_table,new_table);
+            gpuErrChk(cudaGetLastError());
+        }
+        gpuErrChk(cudaDeviceSynchronize());
+        return;
+    }
+    const int blocks = (n * classes + threads - 1) / threads;
+    if (blocks > 0) {
+        copyProbabilityTableKernel<<<blocks,threads>>>(n,classes,probability_table,table,new_probability_table,new_table);
+        gpuErrChk(cudaGetLastError());
+    }
+    gpuErrChk(cudaDeviceSynchronize());
+}
+
+static_assert(sizeof(cudaTextureObject_t) == sizeof(unsigned long long),
+              "SurfelIdImage::texture must hold a cudaTextureObject_t");
+
+void CudaSemanticFusionBackend::FuseProbabilities(const SurfelIdImage& ids, const float* probabilities,
+                                                  const int prob_width, const int prob_height, const int prob_channels,
+                                                  float* map_table, const TableLayout table, float* map_max, const int map_size,
+                                                  float* fusion_stamps, const float stamp)
+{
+    fuseSemanticProbabilities(ids.texture,ids.width,ids.height,probabilities,prob_width,prob_height,
+                              prob_channels,map_table,table,map_max,map_size,claims_,fusion_stamps,stamp);
+}
+
+void CudaSemanticFusionBackend::UpdateProbabilityTable(const int* kept_ids, const int num_kept, const int current_table_size,
+                                                       const float* probability_table, const TableLayout table,
+                                                       const int prob_width, const int prob_height,
+                                                       const int new_prob_width, float* new_probability_table,
+                                                       const float* map_table, float* new_map_table,
+                                                       const float* stamps, float* new_stamps)
+{
+    updateProbabilityTable(kept_ids,num_kept,current_table_size,probability_table,table,
+                           prob_width,prob_height,new_prob_width,new_probability_table,
+                           map_table,new_map_table,stamps,new_stamps);
+}
+
+void CudaSemanticFusionBackend::RenderProbabilityMap(const SurfelIdImage& ids, const float* probability_table,
+                                                     const TableLayout table, const int prob_height,
+                                                     float* rendered_probabilities)
+{
+    renderProbabilityMap(ids.texture,ids.width,ids.height,probability_table,table,prob_height,
+                         rendered_probabilities);
+}
+
+void CudaSemanticFusionBackend::UpdateMaxClass(const int n, const float* probabilities, const TableLayout table,
+                                               const int classes, float* map_max, const int map_size)
+{
+    updateMaxClass(n,probabilities,table,classes,map_max,map_size);
+}
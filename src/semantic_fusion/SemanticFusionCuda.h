@@ -16,22 +16,104 @@
  *
  */
 
+#ifndef SEMANTIC_FUSION_CUDA_H_
+#define SEMANTIC_FUSION_CUDA_H_
 #include <cuda_runtime.h>
 
+#include "SemanticFusionBackend.h"
+
+// Per surfel claim keys (see claimKey in SemanticFusionKernels.h) on the GPU,
+// shared by every kernel fusing only the first pixel showing a surfel
+class SurfelClaims {
+public:
+  SurfelClaims() : keys_(NULL), size_(0), pass_(0) {}
+  ~SurfelClaims();
+  // Starts a new pass over a table of map_size surfels, growing the keys if needed
+  unsigned int NextPass(const int map_size);
+  unsigned long long* keys() { return keys_; }
+
+private:
+  SurfelClaims(const SurfelClaims&) = delete;
+  SurfelClaims& operator=(const SurfelClaims&) = delete;
+
+  unsigned long long* keys_;
+  int size_;
+  unsigned int pass_;
+};
+
+// Claims every surfel of the ids region (x1,y1) to (x1+width,y1+height) for
+// its first pixel there, in a pass started with claims.NextPass
+void claimSurfels(cudaTextureObject_t ids, const int x1, const int y1, const int width, const int height,
+                  unsigned long long* claims, const unsigned int pass);
+
 void fuseSemanticProbabilities(cudaTextureObject_t ids, const int ids_width, const int ids_height, 
                           const float* probabilities, const int prob_width, const int prob_height, 
-                          const int prob_channels,float* map_table, float* map_max,
-                          const int map_size);
+                          const int prob_channels,float* map_table, const TableLayout table, float* map_max,
+                          const int map_size, SurfelClaims& claims,
+                          float* fusion_stamps = NULL, const float stamp = 0.0);
 
-void updateProbabilityTable(int* deleted_ids, const int num_deleted, const int current_table_size,
-                            float const* probability_table, const int prob_width, const int prob_height, 
+void updateProbabilityTable(const int* deleted_ids, const int num_deleted, const int current_table_size,
+                            float const* probability_table, const TableLayout table,
+                            const int prob_width, const int prob_height, 
                           const int new_prob_width, float* new_probability_table, 
-                          float const* map_table, float* new_map_table);
+                          float const* map_table, float* new_map_table,
+                          float const* stamps = NULL, float* new_stamps = NULL);
 
 void renderProbabilityMap(cudaTextureObject_t ids, const int ids_width, const int ids_height, 
-                          const float* probability_table, const int prob_width, const int prob_height, 
+                          const float* probability_table, const TableLayout table, const int prob_height, 
                           float* rendered_probabilities);
 
 
-void updateMaxClass(const int n, const float* probabilities, const int classes,
+void updateMaxClass(const int n, const float* probabilities, const TableLayout table, const int classes,
                     float* map_max, const int map_size);
+
+// Inverts the kept id list of updateProbabilityTable: inverse_ids[old index] is
+// the new index of a kept surfel, or -1 for a deleted one
+void invertKeptIds(const int* kept_ids, const int num_kept, const int table_size, int* inverse_ids);
+
+// Moves n surfel indices (-1 for none) through an inverse from invertKeptIds
+void remapSurfelIds(const int* inverse_ids, int* surfel_ids, const int n);
+
+// Multiplies the probabilities of surfel_ids[i] by factors[i * classes + class]
+// and renormalises, skipping surfels that are gone (-1)
+void mergeCrfProbabilities(const int n, const int* surfel_ids, const float* factors,
+                           const int classes, float* probability_table, const TableLayout table);
+
+// probabilities[i * classes + class] = table entry of surfel_ids[i]
+void gatherProbabilities(const int* surfel_ids, const int n, const float* probability_table,
+                         const TableLayout table, const int classes, float* probabilities);
+
+// The reverse of gatherProbabilities, leaving entries that are not in (0,1) alone
+void scatterProbabilities(const int* surfel_ids, const int n, const float* probabilities,
+                          const int classes, float* probability_table, const TableLayout table);
+
+// Copies the probabilities of the first n surfels between the tables, which
+// may differ in layout, packed (quantized or sparse) ones included
+void copyProbabilityTable(const int n, const int classes, const float* probability_table, const TableLayout table,
+                          float* new_probability_table, const TableLayout new_table);
+
+// The CUDA kernels above behind SemanticFusionBackend
+class CudaSemanticFusionBackend : public SemanticFusionBackend {
+public:
+  bool host() const { return false; }
+  void FuseProbabilities(const SurfelIdImage& ids, const float* probabilities,
+                         const int prob_width, const int prob_height, const int prob_channels,
+                         float* map_table, const TableLayout table, float* map_max, const int map_size,
+                         float* fusion_stamps, const float stamp);
+  void UpdateProbabilityTable(const int* kept_ids, const int num_kept, const int current_table_size,
+                              const float* probability_table, const TableLayout table,
+                              const int prob_width, const int prob_height,
+                              const int new_prob_width, float* new_probability_table,
+                              const float* map_table, float* new_map_table,
+                              const float* stamps, float* new_stamps);
+  void RenderProbabilityMap(const SurfelIdImage& ids, const float* probability_table,
+                            const TableLayout table, const int prob_height,
+                            float* rendered_probabilities);
+  void UpdateMaxClass(const int n, const float* probabilities, const TableLayout table,
+                      const int classes, float* map_max, const int map_size);
+
+private:
+  SurfelClaims claims_;
+};
+
+#endif /* SEMANTIC_FUSION_CUDA_H_ */
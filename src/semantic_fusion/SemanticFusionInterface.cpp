@@ -18,7 +18,14 @@
 
 #include "SemanticFusionInterface.h"
 #include "SemanticFusionCuda.h"
+#include "SemanticFusionCpu.h"
+#include "SemanticFusionKernels.h"
+#include "CrfSnapshot.h"
+#include "CRF/kernels.h"
 #include <utilities/Stopwatch.h>
+#include <utilities/ThreadPool.h>
+#include <algorithm>
+#include <cstdint>
 #include <set>
 #include <cmath>
 #include <Eigen/Core>
@@ -72,14 +79,89 @@ void remove_index(std::vector<T>& vector, const std::vector<int>& to_remove) {
 }
 
 void SemanticFusionInterface::CalculateProjectedProbabilityMap(const std::unique_ptr<ElasticFusionInterface>& map) {
-  const int id_width = map->width(); // 640
-  const int id_height = map->height(); //480
-  const int table_height = class_probabilities_gpu_->height(); // num_classes
-  const int table_width = class_probabilities_gpu_->width(); // max components
-  renderProbabilityMap(map->GetSurfelIdsGpu(),id_width,id_height,
-                       class_probabilities_gpu_->mutable_gpu_data(),
-                       table_width,table_height,
-                       rendered_class_probabilities_gpu_->mutable_gpu_data());
+  backend_->RenderProbabilityMap(SurfelIds(map),BackendData(class_probabilities_gpu_),
+                                 table_layout_,num_classes_,
+                                 MutableBackendData(rendered_class_probabilities_gpu_));
+}
+
+void SemanticFusionInterface::SetCpuBackend(const bool cpu) {
+  if (cpu) {
+    backend_.reset(new CpuSemanticFusionBackend());
+  } else {
+    backend_.reset(new CudaSemanticFusionBackend());
+  }
+}
+
+void SemanticFusionInterface::SetSurfelMajorTable(const bool surfel_major) {
+  ConvertTable(surfel_major ? TableLayout::SurfelMajor(num_classes_)
+                            : TableLayout::ClassMajor(max_components_));
+}
+
+void SemanticFusionInterface::SetQuantizedTable(const int code_bits) {
+  CHECK(code_bits == 0 || code_bits == 8 || code_bits == 16) << "Codes are 8 or 16 bits";
+  ConvertTable(code_bits ? TableLayout::Quantized(num_classes_,code_bits)
+                         : TableLayout::ClassMajor(max_components_));
+}
+
+void SemanticFusionInterface::SetSparseTable(const int top_k) {
+  CHECK(top_k >= 0 && top_k <= kMaxTopK) << "At most " << kMaxTopK << " classes per surfel";
+  CHECK_LT(num_classes_,static_cast<int>(kNoClass)) << "Sparse class ids are 16 bits";
+  ConvertTable(top_k ? TableLayout::Sparse(top_k) : TableLayout::ClassMajor(max_components_));
+}
+
+void SemanticFusionInterface::ConvertTable(const TableLayout layout) {
+  if (layout.surfel_stride == table_layout_.surfel_stride &&
+      layout.class_stride == table_layout_.class_stride &&
+      layout.code_bits == table_layout_.code_bits &&
+      layout.top_k == table_layout_.top_k) {
+    return;
+  }
+  std::shared_ptr<caffe::Blob<float> > table(NewProbabilityTable(layout));
+  copyProbabilityTable(current_table_size_,num_classes_,class_probabilities_gpu_->gpu_data(),table_layout_,
+                       table->mutable_gpu_data(),layout);
+  class_probabilities_gpu_ = table;
+  class_probabilities_gpu_buffer_.reset(NewProbabilityTable(layout));
+  table_layout_ = layout;
+}
+
+caffe::Blob<float>* SemanticFusionInterface::NewProbabilityTable(const TableLayout layout) const {
+  if (layout.surfel_major()) {
+    return new caffe::Blob<float>(1,1,max_components_,layout.surfel_stride);
+  }
+  return new caffe::Blob<float>(1,1,num_classes_,max_components_);
+}
+
+void SemanticFusionInterface::CopyProbabilitiesToHost(float* probabilities, const int num_surfels) {
+  if (!table_layout_.surfel_major()) {
+    cudaMemcpy2D(probabilities,sizeof(float) * num_surfels,
+                 class_probabilities_gpu_->gpu_data(),sizeof(float) * max_components_,
+                 sizeof(float) * num_surfels,num_classes_,cudaMemcpyDeviceToHost);
+    return;
+  }
+  // Transposed (and decoded) on the GPU, in the scratch of the blocking CRF updates
+  crf_probabilities_gpu_->Reshape(1,1,num_classes_,num_surfels);
+  copyProbabilityTable(num_surfels,num_classes_,class_probabilities_gpu_->gpu_data(),table_layout_,
+                       crf_probabilities_gpu_->mutable_gpu_data(),TableLayout::ClassMajor(num_surfels));
+  cudaMemcpy(probabilities,crf_probabilities_gpu_->gpu_data(),
+             sizeof(float) * num_surfels * num_classes_,cudaMemcpyDeviceToHost);
+}
+
+SurfelIdImage SemanticFusionInterface::SurfelIds(const std::unique_ptr<ElasticFusionInterface>& map) {
+  SurfelIdImage ids = {0, NULL, map->width(), map->height()};
+  if (backend_->host()) {
+    ids.data = map->GetSurfelIdsCpu().data();
+  } else {
+    ids.texture = map->GetSurfelIdsGpu();
+  }
+  return ids;
+}
+
+const float* SemanticFusionInterface::BackendData(const std::shared_ptr<caffe::Blob<float> >& blob) const {
+  return backend_->host() ? blob->cpu_data() : blob->gpu_data();
+}
+
+float* SemanticFusionInterface::MutableBackendData(const std::shared_ptr<caffe::Blob<float> >& blob) const {
+  return backend_->host() ? blob->mutable_cpu_data() : blob->mutable_gpu_data();
 }
 
 std::shared_ptr<caffe::Blob<float> > SemanticFusionInterface::get_rendered_probability() {
@@ -102,17 +184,42 @@ void SemanticFusionInterface::UpdateProbabilityTable(const std::unique_ptr<Elast
   // printf("new_table_width %i\n", new_table_width);
   const int num_deleted = map->GetMapSurfelDeletedCount();
   // printf("num_deleted %i\n", num_deleted);
-  const int table_width = class_probabilities_gpu_->width();  // max_components_
+  const int table_width = max_components_;
   // printf("table_width %i\n", table_width);
 
-  const int table_height = class_probabilities_gpu_->height();  // num_classes_
-  updateProbabilityTable(map->GetDeletedSurfelIdsGpu(),num_deleted,current_table_size_,
-                    class_probabilities_gpu_->gpu_data(), table_width, table_height,
-                    new_table_width, class_probabilities_gpu_buffer_->mutable_gpu_data(),
-                    class_max_gpu_->gpu_data(),class_max_gpu_buffer_->mutable_gpu_data());
+  const int table_height = num_classes_;
+  // Follow the surfels of a background CRF update and of the warm start
+  // marginals to their new indices
+  const int num_marginals = crf_workspace_.num_marginals();
+  if (crf_worker_.busy() || num_marginals > 0) {
+    crf_inverse_ids_gpu_->Reshape(1,1,1,std::max(current_table_size_,1));
+    invertKeptIds(map->GetDeletedSurfelIdsGpu(),num_deleted,current_table_size_,
+                  crf_inverse_ids_gpu_->mutable_gpu_data());
+    if (crf_worker_.busy()) {
+      remapSurfelIds(crf_inverse_ids_gpu_->gpu_data(),crf_surfel_ids_gpu_->mutable_gpu_data(),
+                     crf_worker_.num_surfels());
+    }
+    if (num_marginals > 0) {
+      remapSurfelIds(crf_inverse_ids_gpu_->gpu_data(),crf_marginal_ids_gpu_->mutable_gpu_data(),
+                     num_marginals);
+    }
+  }
+  const int* kept_ids = map->GetDeletedSurfelIdsGpu();
+  if (backend_->host()) {
+    kept_ids_host_.resize(num_deleted);
+    cudaMemcpy(kept_ids_host_.data(),kept_ids,sizeof(int) * num_deleted,cudaMemcpyDeviceToHost);
+    kept_ids = kept_ids_host_.data();
+  }
+  backend_->UpdateProbabilityTable(kept_ids,num_deleted,current_table_size_,
+                    BackendData(class_probabilities_gpu_), table_layout_, table_width, table_height,
+                    new_table_width, MutableBackendData(class_probabilities_gpu_buffer_),
+                    BackendData(class_max_gpu_),MutableBackendData(class_max_gpu_buffer_),
+                    fusion_stamps_gpu_ ? BackendData(fusion_stamps_gpu_) : NULL,
+                    fusion_stamps_gpu_ ? MutableBackendData(fusion_stamps_gpu_buffer_) : NULL);
   // We then swap the pointers from the buffer to the other one
   class_probabilities_gpu_.swap(class_probabilities_gpu_buffer_);
   class_max_gpu_.swap(class_max_gpu_buffer_);
+  fusion_stamps_gpu_.swap(fusion_stamps_gpu_buffer_);
   current_table_size_ = new_table_width;
 }
 
@@ -149,23 +256,23 @@ void SemanticFusionInterface::UpdateProbabilities(std::shared_ptr<caffe::Blob<fl
                                       const std::unique_ptr<ElasticFusionInterface>& map)
 {
   CHECK_EQ(num_classes_,probs->channels());
-  const int id_width = map->width();  //640
-  // printf("id_width: %i\n", id_width);
-  const int id_height = map->height();  //480
-  // printf("id_height: %i\n", id_height);
   const int prob_width = probs->width();  //224
   // printf("prob_width: %i\n", prob_width);  
   const int prob_height = probs->height();  //224
   // printf("prob_height: %i\n", prob_height);  
   const int prob_channels = probs->channels();  //14
   // printf("prob_channels: %i\n", prob_channels);
-  const int map_size = class_probabilities_gpu_->width();  //3000000
+  const int map_size = max_components_;  //3000000
   // printf("map_size: %i\n", map_size);
   
-  fuseSemanticProbabilities(map->GetSurfelIdsGpu(),id_width,id_height,probs->gpu_data(),
+  // Stamp the surfels this fusion touches, for WindowedCRFUpdate
+  ++fusion_count_;
+  backend_->FuseProbabilities(SurfelIds(map),BackendData(probs),
                     prob_width,prob_height,prob_channels,
-                    class_probabilities_gpu_->mutable_gpu_data(),
-                    class_max_gpu_->mutable_gpu_data(),map_size);
+                    MutableBackendData(class_probabilities_gpu_),table_layout_,
+                    MutableBackendData(class_max_gpu_),map_size,
+                    fusion_stamps_gpu_ ? MutableBackendData(fusion_stamps_gpu_) : NULL,
+                    static_cast<float>(fusion_count_));
   map->UpdateSurfelClassGpu(map_size,class_max_gpu_->gpu_data(),class_max_gpu_->gpu_data() + map_size,colour_threshold_);
   
   // For Debug: get the max probability and class label
@@ -182,46 +289,230 @@ void SemanticFusionInterface::UpdateProbabilities(std::shared_ptr<caffe::Blob<fl
   // std::cout<<"max_class"<<this_max_class<<std::endl;
 }
 
-void SemanticFusionInterface::CRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations) {
+int SemanticFusionInterface::CRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                                       const float tolerance, const bool warm_start) {
   float* surfel_map = map->GetMapSurfelsGpu();
-  // We very inefficiently allocate and clear a chunk of memory for every CRF update
-  float * my_surfels = new float[current_table_size_ * 12];
+  // The surfel copy, unaries and CRF all come from the workspace, which keeps
+  // its memory from one update to the next
+  float* my_surfels = crf_workspace_.Surfels(current_table_size_);
   cudaMemcpy(my_surfels,surfel_map, sizeof(float) * current_table_size_ * 12, cudaMemcpyDeviceToHost);
-  // Get the semantic table on CPU and add as unary potentials
-  float* prob_table = class_probabilities_gpu_->mutable_cpu_data();
-
-  std::vector<int> valid_ids;
+  std::vector<int>& valid_ids = crf_workspace_.valid_ids();
+  valid_ids.clear();
   for (int i = 0; i < current_table_size_; ++i) {
     valid_ids.push_back(i);
   }
-  std::vector<float> unary_potentials(valid_ids.size() * num_classes_);
-  for(int i = 0; i < static_cast<int>(valid_ids.size()); ++i) {
-    int id = valid_ids[i];
-    for (int j = 0; j < num_classes_; ++j) {
-       unary_potentials[i * num_classes_ + j] = -log(prob_table[j * max_components_ + id] + 1.0e-12);
+  return RunCRF(map,iterations,tolerance,warm_start);
+}
+
+// Adds the surfels fused at or after min_stamp to ids, followed by every other
+// surfel in or next to a voxel of size halo that holds one of them
+static void SelectRecentSurfels(const float* surfels, const float* stamps, const int n,
+                                const float min_stamp, const float halo,
+                                std::vector<int>& ids) {
+  const int surfel_size = 12;
+  std::unordered_set<int64_t> active_voxels;
+  auto voxel_key = [&](const float* position, const int dx, const int dy, const int dz) {
+    const int64_t x = static_cast<int64_t>(std::floor(position[0] / halo)) + dx + (1 << 20);
+    const int64_t y = static_cast<int64_t>(std::floor(position[1] / halo)) + dy + (1 << 20);
+    const int64_t z = static_cast<int64_t>(std::floor(position[2] / halo)) + dz + (1 << 20);
+    return (x << 42) | (y << 21) | z;
+  };
+  for (int i = 0; i < n; ++i) {
+    if (stamps[i] < min_stamp) {
+      continue;
+    }
+    ids.push_back(i);
+    if (halo > 0.0) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        for (int dy = -1; dy <= 1; ++dy) {
+          for (int dz = -1; dz <= 1; ++dz) {
+            active_voxels.insert(voxel_key(surfels + i * surfel_size,dx,dy,dz));
+          }
+        }
+      }
     }
   }
-  DenseCRF3D crf(valid_ids.size(),num_classes_,0.05,20,0.1);
-  crf.setUnaryEnergy(unary_potentials.data());
-  // Add pairwise energies
-  crf.addPairwiseGaussian(my_surfels,3,valid_ids);
-  crf.addPairwiseBilateral(my_surfels,10,valid_ids);
-  // Finally read the values back to the probability table 
-  float* resulting_probs = crf.runInference(iterations, 1.0);
-  for (int i = 0; i < static_cast<int>(valid_ids.size()); ++i) {
-    for (int j = 0; j < num_classes_; ++j) {
-	  const int id = valid_ids[i];
-      // Sometimes it returns nan resulting probs... filter these out
-      if (resulting_probs[i * num_classes_ + j] > 0.0 && resulting_probs[i * num_classes_ + j] < 1.0) {
-        prob_table[j * max_components_ + id] = resulting_probs[i * num_classes_ + j];
+  if (active_voxels.empty()) {
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    if (stamps[i] < min_stamp &&
+        active_voxels.count(voxel_key(surfels + i * surfel_size,0,0,0))) {
+      ids.push_back(i);
+    }
+  }
+}
+
+int SemanticFusionInterface::WindowedCRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                                               const int recent_fusions, const float halo,
+                                               const float tolerance, const bool warm_start) {
+  float* my_surfels = crf_workspace_.Surfels(current_table_size_);
+  cudaMemcpy(my_surfels,map->GetMapSurfelsGpu(), sizeof(float) * current_table_size_ * 12, cudaMemcpyDeviceToHost);
+  float* stamps = crf_workspace_.FusionStamps(current_table_size_);
+  if (!fusion_stamps_gpu_) {
+    // Start tracking, with every surfel so far counting as just fused
+    fusion_stamps_gpu_.reset(new caffe::Blob<float>(1,1,1,max_components_));
+    fusion_stamps_gpu_buffer_.reset(new caffe::Blob<float>(1,1,1,max_components_));
+    std::fill(stamps,stamps + current_table_size_,static_cast<float>(fusion_count_));
+    cudaMemcpy(fusion_stamps_gpu_->mutable_gpu_data(),stamps, sizeof(float) * current_table_size_, cudaMemcpyHostToDevice);
+  }
+  cudaMemcpy(stamps,fusion_stamps_gpu_->gpu_data(), sizeof(float) * current_table_size_, cudaMemcpyDeviceToHost);
+  std::vector<int>& valid_ids = crf_workspace_.valid_ids();
+  valid_ids.clear();
+  SelectRecentSurfels(my_surfels,stamps,current_table_size_,
+                      static_cast<float>(fusion_count_ - recent_fusions + 1),halo,valid_ids);
+  return RunCRF(map,iterations,tolerance,warm_start);
+}
+
+int SemanticFusionInterface::RunCRF(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                                    const float tolerance, const bool warm_start) {
+  const float* my_surfels = crf_workspace_.Surfels(current_table_size_);
+  if (crf_spatial_ordering_) {
+    crf_workspace_.SortAlongCurve(my_surfels);
+  }
+  const std::vector<int>& valid_ids = crf_workspace_.valid_ids();
+  const int num_variables = valid_ids.size();
+  if (num_variables == 0) {
+    return 0;
+  }
+  // Only the probabilities of the variables travel to and from the GPU
+  crf_ids_gpu_->Reshape(1,1,1,num_variables);
+  cudaMemcpy(crf_ids_gpu_->mutable_gpu_data(),valid_ids.data(), sizeof(int) * num_variables, cudaMemcpyHostToDevice);
+  crf_probabilities_gpu_->Reshape(1,1,num_variables,num_classes_);
+  gatherProbabilities(crf_ids_gpu_->gpu_data(),num_variables,class_probabilities_gpu_->gpu_data(),
+                      table_layout_,num_classes_,crf_probabilities_gpu_->mutable_gpu_data());
+  float* unary_potentials = crf_workspace_.UnaryPotentials(num_variables);
+  cudaMemcpy(unary_potentials,crf_probabilities_gpu_->gpu_data(),
+             sizeof(float) * num_variables * num_classes_, cudaMemcpyDeviceToHost);
+  // The gather already made them variable-major, so only the -log remains: a
+  // table of one class with a column per value
+  const TableKernels& table = tableKernels();
+  ThreadPool::Instance().ParallelFor(0,num_variables * num_classes_,16384,[&](int begin, int end) {
+    table.to_unary(unary_potentials,unary_potentials,0,NULL,begin,end,1);
+  });
+  if (crf_voxel_size_ > 0.0) {
+    return RunCellCRF(map,iterations,tolerance);
+  }
+  DenseCRF3D& crf = crf_workspace_.Crf(num_variables);
+  crf.setUnaryEnergy(unary_potentials);
+  const int num_marginals = crf_workspace_.num_marginals();
+  if (warm_start && num_marginals > 0) {
+    // Each surviving surfel starts from the marginal that followed it here,
+    // the others from their unary
+    const int* marginal_ids = crf_marginal_ids_gpu_->cpu_data();
+    int* surfel_marginals = crf_workspace_.SurfelMarginals(current_table_size_);
+    for (int i = 0; i < num_marginals; ++i) {
+      if (marginal_ids[i] >= 0) {
+        surfel_marginals[marginal_ids[i]] = i;
       }
     }
+    int* sources = crf_workspace_.MarginalSources(num_variables);
+    for (int i = 0; i < num_variables; ++i) {
+      sources[i] = surfel_marginals[valid_ids[i]];
+    }
+    crf.setInitialMarginals(crf_workspace_.marginals(),sources);
   }
-  const float* gpu_prob_table = class_probabilities_gpu_->gpu_data();
-  float* gpu_max_map = class_max_gpu_->mutable_gpu_data();
-  updateMaxClass(current_table_size_,gpu_prob_table,num_classes_,gpu_max_map,max_components_);
+  // Add pairwise energies
+  crf.addPairwiseGaussianAndBilateral(my_surfels,3,10,valid_ids);
+  // Finally read the values back to the probability table 
+  float* resulting_probs = crf.runInference(iterations, 1.0, tolerance);
+  crf_workspace_.FinishUpdate();
+  if (warm_start) {
+    crf_workspace_.StoreMarginals(resulting_probs,num_variables);
+    crf_marginal_ids_gpu_->Reshape(1,1,1,num_variables);
+    std::copy(valid_ids.begin(),valid_ids.end(),crf_marginal_ids_gpu_->mutable_cpu_data());
+  }
+  StoreCRFProbabilities(map,resulting_probs,num_variables);
+  return crf.iterations();
+}
+
+int SemanticFusionInterface::RunCellCRF(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                                        const float tolerance) {
+  const float* my_surfels = crf_workspace_.Surfels(current_table_size_);
+  const int num_variables = crf_workspace_.valid_ids().size();
+  float* unary_potentials = crf_workspace_.UnaryPotentials(num_variables);
+  const int num_cells = crf_workspace_.BuildCells(my_surfels,unary_potentials,crf_voxel_size_);
+  DenseCRF3D& crf = crf_workspace_.Crf(num_cells);
+  crf.setUnaryEnergy(crf_workspace_.cell_unaries());
+  crf.addPairwiseGaussianAndBilateral(crf_workspace_.cell_surfels(),3,10,crf_workspace_.cell_ids());
+  const float* cell_probs = crf.runInference(iterations, 1.0, tolerance);
+  crf_workspace_.FinishUpdate();
+  // The surfel unaries make way for the probabilities sent back to the table
+  crf_workspace_.BroadcastCells(cell_probs,crf_cell_weight_,unary_potentials);
+  StoreCRFProbabilities(map,unary_potentials,num_variables);
+  return crf.iterations();
+}
+
+void SemanticFusionInterface::StoreCRFProbabilities(const std::unique_ptr<ElasticFusionInterface>& map,
+                                                    const float* probabilities, const int num_variables) {
+  cudaMemcpy(crf_probabilities_gpu_->mutable_gpu_data(),probabilities,
+             sizeof(float) * num_variables * num_classes_, cudaMemcpyHostToDevice);
+  scatterProbabilities(crf_ids_gpu_->gpu_data(),num_variables,crf_probabilities_gpu_->gpu_data(),
+                       num_classes_,class_probabilities_gpu_->mutable_gpu_data(),table_layout_);
+  backend_->UpdateMaxClass(current_table_size_,BackendData(class_probabilities_gpu_),table_layout_,num_classes_,
+                           MutableBackendData(class_max_gpu_),max_components_);
   map->UpdateSurfelClassGpu(max_components_,class_max_gpu_->gpu_data(),class_max_gpu_->gpu_data() + max_components_,colour_threshold_);
-  delete [] my_surfels;
+}
+
+bool SemanticFusionInterface::StartCRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                                             const float tolerance) {
+  const int num_surfels = current_table_size_;
+  if (crf_worker_.busy() || num_surfels == 0) {
+    return false;
+  }
+  // Only the snapshot copies happen on this thread
+  cudaMemcpy(crf_worker_.Surfels(num_surfels),map->GetMapSurfelsGpu(),
+             sizeof(float) * num_surfels * 12, cudaMemcpyDeviceToHost);
+  CopyProbabilitiesToHost(crf_worker_.Probabilities(num_surfels),num_surfels);
+  // Snapshot surfel i starts out at index i of the table
+  crf_surfel_ids_gpu_->Reshape(1,1,1,num_surfels);
+  int* surfel_ids = crf_surfel_ids_gpu_->mutable_cpu_data();
+  for (int i = 0; i < num_surfels; ++i) {
+    surfel_ids[i] = i;
+  }
+  crf_worker_.set_memory_budget(crf_memory_budget_);
+  crf_worker_.set_label_budget(crf_label_budget_);
+  crf_worker_.set_spatial_ordering(crf_spatial_ordering_);
+  crf_worker_.Start(num_surfels,iterations,tolerance);
+  return true;
+}
+
+void SemanticFusionInterface::SetCRFMemoryBudget(const size_t bytes) {
+  crf_memory_budget_ = bytes;
+  // The background workspace may be in use, it picks the budget up when started
+  crf_workspace_.set_memory_budget(bytes);
+}
+
+void SemanticFusionInterface::SetCRFLabelBudget(const int labels) {
+  crf_label_budget_ = labels;
+  crf_workspace_.set_label_budget(labels);
+}
+
+bool SemanticFusionInterface::MergeCRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map) {
+  if (!crf_worker_.busy() || !crf_worker_.finished()) {
+    return false;
+  }
+  const int num_surfels = crf_worker_.num_surfels();
+  const float* factors = crf_worker_.Collect();
+  crf_factors_gpu_->Reshape(1,1,num_classes_,num_surfels);
+  cudaMemcpy(crf_factors_gpu_->mutable_gpu_data(),factors,
+             sizeof(float) * num_surfels * num_classes_, cudaMemcpyHostToDevice);
+  mergeCrfProbabilities(num_surfels,crf_surfel_ids_gpu_->gpu_data(),crf_factors_gpu_->gpu_data(),
+                        num_classes_,class_probabilities_gpu_->mutable_gpu_data(),table_layout_);
+  backend_->UpdateMaxClass(current_table_size_,BackendData(class_probabilities_gpu_),table_layout_,num_classes_,
+                           MutableBackendData(class_max_gpu_),max_components_);
+  map->UpdateSurfelClassGpu(max_components_,class_max_gpu_->gpu_data(),class_max_gpu_->gpu_data() + max_components_,colour_threshold_);
+  return true;
+}
+
+bool SemanticFusionInterface::SaveCRFSnapshot(const std::string& filename,const std::unique_ptr<ElasticFusionInterface>& map) {
+  const int num_surfels = current_table_size_;
+  // The workspace copies are free between blocking updates
+  float* surfels = crf_workspace_.Surfels(num_surfels);
+  cudaMemcpy(surfels,map->GetMapSurfelsGpu(), sizeof(float) * num_surfels * 12, cudaMemcpyDeviceToHost);
+  float* probabilities = crf_workspace_.UnaryPotentials(num_surfels);
+  CopyProbabilitiesToHost(probabilities,num_surfels);
+  return SaveCrfSnapshot(filename,surfels,probabilities,num_surfels,num_classes_);
 }
 
 void SemanticFusionInterface::SaveArgMaxPredictions(std::string& filename,const std::unique_ptr<ElasticFusionInterface>& map) {
@@ -30,41 +30,162 @@
 #include <cassert>
 
 #include "CRF/densecrf.h"
+#include "CrfWorker.h"
+#include "CrfWorkspace.h"
+#include "SemanticFusionBackend.h"
 
 class SemanticFusionInterface {
 public:
   SemanticFusionInterface(const int num_classes, const int prior_sample_size, 
                           const int max_components = 3000000, const float colour_threshold = 0.0)
     : current_table_size_(0)
+    , fusion_count_(0)
     , num_classes_(num_classes) 
     , prior_sample_size_(prior_sample_size)
     , max_components_(max_components)
     , colour_threshold_(colour_threshold)
+    , table_layout_(TableLayout::ClassMajor(max_components))
+    , crf_memory_budget_(0)
+    , crf_label_budget_(0)
+    , crf_spatial_ordering_(false)
+    , crf_voxel_size_(0.0)
+    , crf_cell_weight_(1.0)
+    , crf_workspace_(num_classes)
+    , crf_worker_(num_classes)
   { 
     // This table contains for each component (surfel) the probability of
     // it being associated with each class
-    class_probabilities_gpu_.reset(new caffe::Blob<float>(1,1,num_classes_,max_components_));
-    class_probabilities_gpu_buffer_.reset(new caffe::Blob<float>(1,1,num_classes_,max_components_));
+    class_probabilities_gpu_.reset(NewProbabilityTable(table_layout_));
+    class_probabilities_gpu_buffer_.reset(NewProbabilityTable(table_layout_));
     // This contains two rows - one is the max class (if none then negative) the
     // other is the probability
     class_max_gpu_.reset(new caffe::Blob<float>(1,1,3,max_components_));
     class_max_gpu_buffer_.reset(new caffe::Blob<float>(1,1,3,max_components_));
     rendered_class_probabilities_gpu_.reset(new caffe::Blob<float>(1,num_classes_,640,480));
+    // Background CRF bookkeeping, sized when an update starts
+    crf_surfel_ids_gpu_.reset(new caffe::Blob<int>(1,1,1,1));
+    crf_inverse_ids_gpu_.reset(new caffe::Blob<int>(1,1,1,1));
+    crf_factors_gpu_.reset(new caffe::Blob<float>(1,1,1,1));
+    crf_marginal_ids_gpu_.reset(new caffe::Blob<int>(1,1,1,1));
+    crf_ids_gpu_.reset(new caffe::Blob<int>(1,1,1,1));
+    crf_probabilities_gpu_.reset(new caffe::Blob<float>(1,1,1,1));
+    SetCpuBackend(false);
   }
   virtual ~SemanticFusionInterface() {}
 
+  // Runs the fusion, table update, rendering and max class operations on the
+  // CPU (see CpuSemanticFusionBackend) rather than with the CUDA kernels. The
+  // tables then live in host memory; the steps that stay on the GPU, like the
+  // CRF transfers and the map's class colouring, pay for Caffe syncing them.
+  void SetCpuBackend(const bool cpu);
+  // Keeps the class probabilities of each surfel together in the table (see
+  // TableLayout) rather than a row per class. Fusion, rendering and the max
+  // class updates then read one or two cache lines per surfel, for about 15%
+  // more table memory with 14 classes. The surfels so far are carried over.
+  void SetSurfelMajorTable(const bool surfel_major);
+  // Stores each surfel's distribution as 8 or 16 bit log probabilities with a
+  // per surfel scale (see TableLayout), or as floats again (class-major) for
+  // 0. With 14 classes the table takes 32 rather than 56 bytes per surfel at
+  // 16 bits and 20 at 8 bits. Classes more than e^20 less likely than the
+  // best one are held at that ratio, otherwise 16 bit codes track the float
+  // table closely; 8 bit ones can move a near tie to the other class. The
+  // exp and log calls make fusion a few times slower. The surfels so far are
+  // carried over.
+  void SetQuantizedTable(const int code_bits);
+  // Keeps only the top_k (at most kMaxTopK) most likely classes of each
+  // surfel and the residual mass of the rest (see TableLayout), or floats
+  // again (class-major) for 0. A record takes 4 * (1 + top_k + (top_k + 1) / 2)
+  // bytes whatever the class count, 28 at top_k 4 against 56 for 14 float
+  // classes and 324 for 81. The surfels so far are carried over.
+  void SetSparseTable(const int top_k);
+
   int UpdateSurfelProbabilities(const int surfel_id, const std::vector<float>& class_probs);
   void UpdateProbabilities(std::shared_ptr<caffe::Blob<float> > probs,const std::unique_ptr<ElasticFusionInterface>& map);
   void UpdateProbabilityTable(const std::unique_ptr<ElasticFusionInterface>& map);
   void CalculateProjectedProbabilityMap(const std::unique_ptr<ElasticFusionInterface>& map);
 
-  void CRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations);
+  // Runs at most iterations mean-field steps, fewer once a step changes no
+  // probability by more than a positive tolerance. Returns the steps taken.
+  // With warm_start the surfels start from the marginals of the previous warm
+  // started update rather than from their unaries, so a few steps suffice.
+  int CRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                const float tolerance = 0.0, const bool warm_start = false);
+  // CRFUpdate restricted to the surfels observed by the last recent_fusions
+  // UpdateProbabilities calls and those within about halo metres of them. Only
+  // their probabilities are read and written, the rest of the map is left alone.
+  // The surfels are only tracked from the first call on, which covers the whole
+  // map.
+  int WindowedCRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                        const int recent_fusions, const float halo,
+                        const float tolerance = 0.0, const bool warm_start = false);
+  // Non-blocking CRFUpdate: snapshots the map and runs the CRF on a background
+  // thread. Returns false, doing nothing, while an earlier update is unmerged.
+  // It always covers the whole map and starts from the unaries, there is no
+  // windowed or warm started background update.
+  bool StartCRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                      const float tolerance = 0.0);
+  // Merges a finished background update into the table, following the surfels
+  // through the deletions since the snapshot. Returns whether it merged.
+  bool MergeCRFUpdate(const std::unique_ptr<ElasticFusionInterface>& map);
+  // Mean-field steps the last merged background update took
+  int merged_crf_iterations() const { return crf_worker_.iterations(); }
+  // Caps the memory of each CRF (foreground and background) at about bytes, 0
+  // for no limit. Past it the CRF falls back to its lean layout, see
+  // DenseCRF::setMemoryBudget. Takes effect from the next update started.
+  void SetCRFMemoryBudget(const size_t bytes);
+  // Approximate CRF that tracks only the labels most likely for each surfel
+  // plus one bucket for the rest, see DenseCRF::setLabelBudget. Worth it for
+  // models with many classes, of which a scene only shows a few. 0 (the
+  // default) for all labels. Takes effect from the next update started.
+  void SetCRFLabelBudget(const int labels);
+  // Runs the CRF variables along a Morton curve over the surfel positions
+  // rather than in table order, which keeps the lattice memory accesses close
+  // to sequential. Takes effect from the next update started.
+  void SetCRFSpatialOrdering(const bool ordered) { crf_spatial_ordering_ = ordered; }
+  // With a positive voxel_size the blocking updates run the CRF over cubic
+  // cells of that size rather than over single surfels, see
+  // CrfWorkspace::BuildCells, and each surfel ends up with cell_weight of its
+  // cell's marginal plus 1 - cell_weight of its own probability. The number of
+  // variables falls roughly with the cube of voxel_size, at the cost of
+  // blurring labels across boundaries inside a cell. Warm starts are not
+  // available in this mode. 0 (the default) for one variable per surfel.
+  void SetCRFVoxelSize(const float voxel_size, const float cell_weight = 1.0) {
+    crf_voxel_size_ = voxel_size;
+    crf_cell_weight_ = cell_weight;
+  }
+  // Most CRF memory the last blocking update held
+  size_t crf_peak_bytes() const { return crf_workspace_.peak_bytes(); }
 
   void SaveArgMaxPredictions(std::string& filename,const std::unique_ptr<ElasticFusionInterface>& map);
+  // Writes the surfel map and probability table to filename for tools/crf_sweep,
+  // see CrfSnapshot.h. Returns false if the file couldn't be written.
+  bool SaveCRFSnapshot(const std::string& filename,const std::unique_ptr<ElasticFusionInterface>& map);
   std::shared_ptr<caffe::Blob<float> > get_rendered_probability();
   std::shared_ptr<caffe::Blob<float> > get_class_max_gpu();
   int max_num_components() const;
 private:
+  // Runs the CRF over the surfels listed in the workspace's valid_ids, whose
+  // surfel copy must be current
+  int RunCRF(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+             const float tolerance, const bool warm_start);
+  // RunCRF over the cells of crf_voxel_size_, once the unaries are in the workspace
+  int RunCellCRF(const std::unique_ptr<ElasticFusionInterface>& map, const int iterations,
+                 const float tolerance);
+  // Writes the probabilities of the CRF variables (num_classes each) back to
+  // the table and refreshes the map's class colours
+  void StoreCRFProbabilities(const std::unique_ptr<ElasticFusionInterface>& map,
+                             const float* probabilities, const int num_variables);
+  // The surfel id image and blob contents in the memory the backend works in
+  SurfelIdImage SurfelIds(const std::unique_ptr<ElasticFusionInterface>& map);
+  const float* BackendData(const std::shared_ptr<caffe::Blob<float> >& blob) const;
+  float* MutableBackendData(const std::shared_ptr<caffe::Blob<float> >& blob) const;
+  // Moves the probability table over to layout
+  void ConvertTable(const TableLayout layout);
+  // An uninitialised probability table of max_components_ surfels in layout
+  caffe::Blob<float>* NewProbabilityTable(const TableLayout layout) const;
+  // Copies the table entries of the first num_surfels surfels to host memory
+  // laid out class-major, num_surfels floats per class
+  void CopyProbabilitiesToHost(float* probabilities, const int num_surfels);
 
   // Returns negative if the class is below the threshold - otherwise returns the class
   std::vector<std::vector<float> > class_probabilities_;
@@ -74,12 +195,40 @@ private:
   std::shared_ptr<caffe::Blob<float> > class_probabilities_gpu_buffer_;
   std::shared_ptr<caffe::Blob<float> > class_max_gpu_;
   std::shared_ptr<caffe::Blob<float> > class_max_gpu_buffer_;
+  // The number of the last UpdateProbabilities call that observed each surfel,
+  // allocated by the first WindowedCRFUpdate
+  std::shared_ptr<caffe::Blob<float> > fusion_stamps_gpu_;
+  std::shared_ptr<caffe::Blob<float> > fusion_stamps_gpu_buffer_;
+  int fusion_count_;
   // This stores the rendered probabilities of surfels from the map
   std::shared_ptr<caffe::Blob<float> > rendered_class_probabilities_gpu_;
   const int num_classes_;
   const int prior_sample_size_;
   const int max_components_;
   const float colour_threshold_;
+  // Layout of class_probabilities_gpu_ and its buffer
+  TableLayout table_layout_;
+  size_t crf_memory_budget_;
+  int crf_label_budget_;
+  bool crf_spatial_ordering_;
+  float crf_voxel_size_;
+  float crf_cell_weight_;
+  // Buffers and lattices reused by every CRFUpdate
+  CrfWorkspace crf_workspace_;
+  // Background CRF, with the current table index of each snapshot surfel (-1
+  // once deleted), scratch for remapping it and the factors to merge
+  CrfWorker crf_worker_;
+  std::shared_ptr<caffe::Blob<int> > crf_surfel_ids_gpu_;
+  std::shared_ptr<caffe::Blob<int> > crf_inverse_ids_gpu_;
+  std::shared_ptr<caffe::Blob<float> > crf_factors_gpu_;
+  // Current table index of each marginal kept in the workspace for warm starts
+  std::shared_ptr<caffe::Blob<int> > crf_marginal_ids_gpu_;
+  // Surfel ids of the CRF variables and their probabilities on the GPU
+  std::shared_ptr<caffe::Blob<int> > crf_ids_gpu_;
+  std::shared_ptr<caffe::Blob<float> > crf_probabilities_gpu_;
+  std::unique_ptr<SemanticFusionBackend> backend_;
+  // Host copy of the map's kept surfel list for the CPU backend
+  std::vector<int> kept_ids_host_;
 };
 
 #endif /* SEMANTIC_FUSION_INTERFACE_H_ */
@@ -0,0 +1,609 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#ifndef SEMANTIC_FUSION_KERNELS_H_
+#define SEMANTIC_FUSION_KERNELS_H_
+
+#include <float.h>
+#include <math.h>
+
+#include "SemanticFusionBackend.h"
+
+// The per pixel and per table entry work of the semantic fusion operations,
+// shared by the CUDA kernels and the CPU backend so that both run the same
+// arithmetic in the same order
+
+// Only the first pixel (in row-major order) showing a surfel fuses into it.
+// Every pixel claims its surfel with claimKey(pass, pixel index) and keeps
+// the minimum per surfel; the pixel whose key survives is the first. Later
+// passes give smaller keys, so the keys left by older passes (or by surfels
+// since moved in the table) need no clearing as long as they start out as
+// all ones.
+SEMANTIC_FUSION_HOST_DEVICE inline
+unsigned long long claimKey(const unsigned int pass, const int pixel)
+{
+    return (static_cast<unsigned long long>(~pass) << 32) | static_cast<unsigned int>(pixel);
+}
+
+// Quantized table records (see TableLayout). Codes only need to tell the
+// classes that matter apart: anything more than kQuantizedLogRange below the
+// most likely class gets the largest code, which keeps the resolution of the
+// other codes at kQuantizedLogRange / (2^code_bits - 1) in log probability.
+const float kQuantizedLogRange = 20.0f;
+
+SEMANTIC_FUSION_HOST_DEVICE inline
+unsigned int quantizedCode(const float* record, const int code_bits, const int class_id)
+{
+    if (code_bits == 8) {
+        return reinterpret_cast<const unsigned char*>(record + 1)[class_id];
+    }
+    return reinterpret_cast<const unsigned short*>(record + 1)[class_id];
+}
+
+SEMANTIC_FUSION_HOST_DEVICE inline
+void setQuantizedCode(float* record, const int code_bits, const int class_id, const unsigned int code)
+{
+    if (code_bits == 8) {
+        reinterpret_cast<unsigned char*>(record + 1)[class_id] = static_cast<unsigned char>(code);
+    } else {
+        reinterpret_cast<unsigned short*>(record + 1)[class_id] = static_cast<unsigned short>(code);
+    }
+}
+
+// Log probabilities for encodeSurfel, up to a constant shared by all classes.
+// Those of a record cache its scale, so encoding a record over itself is fine.
+struct QuantizedLogs {
+    const float* record;
+    int code_bits;
+    float scale;
+    SEMANTIC_FUSION_HOST_DEVICE float operator()(const int class_id) const {
+        return -static_cast<float>(quantizedCode(record,code_bits,class_id)) * scale;
+    }
+};
+
+struct ProbabilityLogs {
+    const float* probability;
+    int stride;
+    SEMANTIC_FUSION_HOST_DEVICE float operator()(const int class_id) const {
+        return logf(probability[class_id * stride] + 1e-12f);
+    }
+};
+
+// The product of two distributions
+template <typename A, typename B>
+struct ProductLogs {
+    A a;
+    B b;
+    SEMANTIC_FUSION_HOST_DEVICE float operator()(const int class_id) const {
+        return a(class_id) + b(class_id);
+    }
+};
+
+SEMANTIC_FUSION_HOST_DEVICE inline
+QuantizedLogs quantizedLogs(const float* record, const int code_bits)
+{
+    const QuantizedLogs logs = {record, code_bits, record[0]};
+    return logs;
+}
+
+// Normalises the distribution logs(class) and stores it in record. Reads each
+// class of logs twice, the second time just before writing its code.
+template <typename Logs>
+SEMANTIC_FUSION_HOST_DEVICE inline
+void encodeSurfel(float* record, const int code_bits, const int classes, const Logs& logs)
+{
+    float max_log = logs(0);
+    float min_log = max_log;
+    for (int class_id = 1; class_id < classes; ++class_id) {
+        const float log = logs(class_id);
+        max_log = log > max_log ? log : max_log;
+        min_log = log < min_log ? log : min_log;
+    }
+    const float max_code = static_cast<float>((1u << code_bits) - 1);
+    // Also catches the infinite and NaN ranges of degenerate distributions
+    float range = max_log - min_log;
+    if (!(range < kQuantizedLogRange)) {
+        range = kQuantizedLogRange;
+    }
+    const float scale = range / max_code;
+    for (int class_id = 0; class_id < classes; ++class_id) {
+        float code = 0.0f;
+        if (scale > 0.0f) {
+            code = (max_log - logs(class_id)) / scale;
+            code = code < max_code ? rintf(code) : max_code;
+        }
+        setQuantizedCode(record,code_bits,class_id,static_cast<unsigned int>(code));
+    }
+    record[0] = scale;
+}
+
+// Writes the probabilities of a record to out[class * stride]
+SEMANTIC_FUSION_HOST_DEVICE inline
+void decodeSurfel(const float* record, const int code_bits, const int classes, float* out, const int stride)
+{
+    const QuantizedLogs logs = quantizedLogs(record,code_bits);
+    float total = 0.0f;
+    for (int class_id = 0; class_id < classes; ++class_id) {
+        total += expf(logs(class_id));
+    }
+    for (int class_id = 0; class_id < classes; ++class_id) {
+        out[class_id * stride] = expf(logs(class_id)) / total;
+    }
+}
+
+// Most likely class of a record other than class 0, and its probability
+SEMANTIC_FUSION_HOST_DEVICE inline
+void quantizedMaxClass(const float* record, const int code_bits, const int classes,
+                       int& max_class, float& max_probability)
+{
+    const QuantizedLogs logs = quantizedLogs(record,code_bits);
+    float total = 0.0f;
+    for (int class_id = 0; class_id < classes; ++class_id) {
+        total += expf(logs(class_id));
+    }
+    max_class = -1;
+    unsigned int min_code = 0xffffffffu;
+    for (int class_id = 1; class_id < classes; ++class_id) {
+        const unsigned int code = quantizedCode(record,code_bits,class_id);
+        if (code < min_code) {
+            min_code = code;
+            max_class = class_id;
+        }
+    }
+    max_probability = max_class < 0 ? 0.0f : expf(logs(max_class)) / total;
+}
+
+// Sparse table records (see TableLayout) keep at most kMaxTopK classes, the
+// unused slots at the end having the class kNoClass
+const int kMaxTopK = 8;
+const unsigned int kNoClass = 0xffff;
+
+SEMANTIC_FUSION_HOST_DEVICE inline
+unsigned int sparseClass(const float* record, const int top_k, const int slot)
+{
+    return reinterpret_cast<const unsigned short*>(record + 1 + top_k)[slot];
+}
+
+SEMANTIC_FUSION_HOST_DEVICE inline
+void setSparseClass(float* record, const int top_k, const int slot, const unsigned int class_id)
+{
+    reinterpret_cast<unsigned short*>(record + 1 + top_k)[slot] = static_cast<unsigned short>(class_id);
+}
+
+// Probabilities of a sparse record, share being that of each class left out.
+// Holds its own copy of the listed classes so that the lookup is a few
+// selects. The loops over the slots here and in encodeTopK run to kMaxTopK
+// and break at top_k, which unrolls them and keeps the arrays in registers
+// on the GPU.
+struct SparseProbabilities {
+    int top_k;
+    unsigned int classes[kMaxTopK];
+    float probabilities[kMaxTopK];
+    float share;
+    SEMANTIC_FUSION_HOST_DEVICE float operator()(const int class_id) const {
+        float probability = share;
+        for (int slot = 0; slot < kMaxTopK; ++slot) {
+            if (slot == top_k) {
+                break;
+            }
+            probability = classes[slot] == static_cast<unsigned int>(class_id) ? probabilities[slot] : probability;
+        }
+        return probability;
+    }
+};
+
+SEMANTIC_FUSION_HOST_DEVICE inline
+SparseProbabilities sparseProbabilities(const float* record, const int top_k, const int classes)
+{
+    SparseProbabilities sparse;
+    sparse.top_k = top_k;
+    int listed = 0;
+    for (int slot = 0; slot < kMaxTopK; ++slot) {
+        sparse.classes[slot] = slot < top_k ? sparseClass(record,top_k,slot) : kNoClass;
+        sparse.probabilities[slot] = slot < top_k ? record[1 + slot] : 0.0f;
+        listed += sparse.classes[slot] != kNoClass;
+    }
+    sparse.share = classes > listed ? record[0] / (classes - listed) : 0.0f;
+    return sparse;
+}
+
+struct ObservedProbabilities {
+    const float* probability;
+    int stride;
+    SEMANTIC_FUSION_HOST_DEVICE float operator()(const int class_id) const {
+        return probability[class_id * stride];
+    }
+};
+
+template <typename A, typename B>
+struct ProductProbabilities {
+    A a;
+    B b;
+    SEMANTIC_FUSION_HOST_DEVICE float operator()(const int class_id) const {
+        return a(class_id) * b(class_id);
+    }
+};
+
+// The empty record, all classes sharing the whole mass
+SEMANTIC_FUSION_HOST_DEVICE inline
+void clearTopK(float* record, const int top_k)
+{
+    record[0] = 1.0f;
+    for (int slot = 0; slot < top_k; ++slot) {
+        record[1 + slot] = 0.0f;
+        setSparseClass(record,top_k,slot,kNoClass);
+    }
+}
+
+// Keeps the top_k classes with the largest weights(class), normalised, and
+// the normalised mass of the rest as the residual; ties go to the lower
+// class. The weights needn't sum to one and may read the record, which is
+// only written once they have all been read, and not at all when they sum
+// to zero, infinity or NaN. Returns the sum of the weights.
+template <typename Weights>
+SEMANTIC_FUSION_HOST_DEVICE inline
+float encodeTopK(float* record, const int top_k, const int classes, const Weights& weights)
+{
+    // Kept in decreasing order, the unused slots holding weight -1
+    float top_weight[kMaxTopK];
+    int top_class[kMaxTopK];
+    for (int slot = 0; slot < kMaxTopK; ++slot) {
+        top_weight[slot] = -1.0f;
+        top_class[slot] = kNoClass;
+    }
+    float smallest = -1.0f;
+    float total = 0.0f;
+    float rest = 0.0f;
+    for (int class_id = 0; class_id < classes; ++class_id) {
+        float weight = weights(class_id);
+        total += weight;
+        if (weight > smallest) {
+            // Bubbles the new weight into place, shifting the smaller ones down
+            int moved_class = class_id;
+            for (int slot = 0; slot < kMaxTopK; ++slot) {
+                if (slot == top_k) {
+                    break;
+                }
+                const bool swap = weight > top_weight[slot];
+                const float swapped_weight = swap ? top_weight[slot] : weight;
+                const int swapped_class = swap ? top_class[slot] : moved_class;
+                top_weight[slot] = swap ? weight : top_weight[slot];
+                top_class[slot] = swap ? moved_class : top_class[slot];
+                weight = swapped_weight;
+                moved_class = swapped_class;
+                if (slot == top_k - 1) {
+                    smallest = top_weight[slot];
+                }
+            }
+        }
+        // What fell off the end, if anything did
+        rest += weight > 0.0f ? weight : 0.0f;
+    }
+    if (!(total > 0.0f && total <= FLT_MAX)) {
+        return total;
+    }
+    record[0] = rest / total;
+    for (int slot = 0; slot < top_k; ++slot) {
+        record[1 + slot] = top_weight[slot] > 0.0f ? top_weight[slot] / total : 0.0f;
+        setSparseClass(record,top_k,slot,top_class[slot]);
+    }
+    return total;
+}
+
+// Writes the probabilities of a sparse record to out[class * stride]
+SEMANTIC_FUSION_HOST_DEVICE inline
+void decodeTopK(const float* record, const int top_k, const int classes, float* out, const int stride)
+{
+    const SparseProbabilities probabilities = sparseProbabilities(record,top_k,classes);
+    for (int class_id = 0; class_id < classes; ++class_id) {
+        out[class_id * stride] = probabilities(class_id);
+    }
+}
+
+// Most likely class of a sparse record other than class 0, and its
+// probability. The listed classes are in decreasing order; a class left out
+// only wins when the residual share beats them all.
+SEMANTIC_FUSION_HOST_DEVICE inline
+void sparseMaxClass(const float* record, const int top_k, const int classes,
+                    int& max_class, float& max_probability)
+{
+    max_class = -1;
+    max_probability = 0.0f;
+    for (int slot = 0; slot < top_k; ++slot) {
+        const unsigned int class_id = sparseClass(record,top_k,slot);
+        if (class_id != 0 && class_id != kNoClass) {
+            if (record[1 + slot] > 0.0f) {
+                max_class = class_id;
+                max_probability = record[1 + slot];
+            }
+            break;
+        }
+    }
+    const SparseProbabilities probabilities = sparseProbabilities(record,top_k,classes);
+    if (probabilities.share > max_probability) {
+        for (int class_id = 1; class_id < classes; ++class_id) {
+            if (probabilities(class_id) == probabilities.share) {
+                max_class = class_id;
+                max_probability = probabilities.share;
+                break;
+            }
+        }
+    }
+}
+
+// Multiplies the probabilities of surfel_id by those of its pixel
+// (prob_x,prob_y), renormalises and refreshes its max class
+SEMANTIC_FUSION_HOST_DEVICE inline
+void fuseSurfel(const int surfel_id, const int prob_x, const int prob_y,
+                const float* probabilities, const int prob_width, const int prob_height,
+                const int prob_channels, float* map_table, const TableLayout table,
+                float* map_max, const int map_size, float* fusion_stamps, const float stamp)
+{
+    // memory offset of the probability of the neighborhood class at the same pixel of probability image
+    const int channel_offset = prob_width * prob_height; 
+    
+    if (table.sparse()) {
+        float* record = map_table + surfel_id * table.surfel_stride;
+        const ObservedProbabilities observed = {probabilities + (prob_y * prob_width + prob_x), channel_offset};
+        const ProductProbabilities<SparseProbabilities,ObservedProbabilities> fused =
+            {sparseProbabilities(record,table.top_k,prob_channels),observed};
+        int max_class = -1;
+        float max_probability = 0.0f;
+        // The prior sums to one, so this is the reinitialisation test below
+        if (!(encodeTopK(record,table.top_k,prob_channels,fused) > 1e-5f)) {
+            clearTopK(record,table.top_k);
+        } else {
+            sparseMaxClass(record,table.top_k,prob_channels,max_class,max_probability);
+        }
+        map_max[surfel_id] = static_cast<float>(max_class);
+        map_max[surfel_id + map_size] = max_probability;
+        map_max[surfel_id + map_size + map_size] += 1.0;
+        if (fusion_stamps) {
+            fusion_stamps[surfel_id] = stamp;
+        }
+        return;
+    }
+    if (table.quantized()) {
+        float* record = map_table + surfel_id * table.surfel_stride;
+        const QuantizedLogs prior = quantizedLogs(record,table.code_bits);
+        const ProbabilityLogs observed = {probabilities + (prob_y * prob_width + prob_x), channel_offset};
+        // The same reinitialisation test as below, on the unnormalised prior
+        float prior_total = 0.0f;
+        float total = 0.0f;
+        for (int class_id = 0; class_id < prob_channels; ++class_id) {
+            const float weight = expf(prior(class_id));
+            prior_total += weight;
+            total += weight * observed.probability[class_id * channel_offset];
+        }
+        int max_class = -1;
+        float max_probability = 0.0f;
+        if (total <= 1e-5f * prior_total) {
+            // The all zero record is the uniform distribution
+            for (int class_id = 0; class_id < prob_channels; ++class_id) {
+                setQuantizedCode(record,table.code_bits,class_id,0);
+            }
+            record[0] = 0.0f;
+        } else {
+            // The product is a sum of logs and the encoding normalises it
+            const ProductLogs<QuantizedLogs,ProbabilityLogs> fused = {prior,observed};
+            encodeSurfel(record,table.code_bits,prob_channels,fused);
+            quantizedMaxClass(record,table.code_bits,prob_channels,max_class,max_probability);
+        }
+        map_max[surfel_id] = static_cast<float>(max_class);
+        map_max[surfel_id + map_size] = max_probability;
+        map_max[surfel_id + map_size + map_size] += 1.0;
+        if (fusion_stamps) {
+            fusion_stamps[surfel_id] = stamp;
+        }
+        return;
+    }
+    
+    // pointer at (prob_x,prob_y)
+    const float* probability = probabilities + (prob_y * prob_width + prob_x);
+
+    // pointer at the surfel in prob_table
+    float* prior_probability = map_table + table.index(surfel_id,0);
+
+    // go though all class channels to update prob of the correspond surfel
+    float total = 0.0;
+    for (int class_id = 0; class_id < prob_channels; ++class_id) {
+        prior_probability[0] *= probability[0]; // use prob of a class of a pixel to update its correponsded surfel
+        total += prior_probability[0];  // sum prob of all classes
+        probability += channel_offset;  // go to the next class prob on prob image
+        prior_probability += table.class_stride;  // go to the next class prob on surfel map
+    }
+
+    // Reset the pointers to the beginning again
+    probability = probabilities + (prob_y * prob_width + prob_x);
+    prior_probability = map_table + table.index(surfel_id,0);
+    float max_probability = 0.0;
+    int max_class = -1;
+    float new_total = 0.0;
+    // normalize probs and search the class with max prob
+    for (int class_id = 0; class_id < prob_channels; ++class_id) {
+        // Something has gone unexpectedly wrong - reinitialse
+        if (total <= 1e-5) {
+            prior_probability[0] = 1.0f / prob_channels;
+        } else {
+            prior_probability[0] /= total; // normalize prob 
+            if (class_id > 0 && prior_probability[0] > max_probability) {
+                max_probability = prior_probability[0];
+                max_class = class_id;
+            }
+        }
+        new_total += prior_probability[0];
+        probability += channel_offset;
+        prior_probability += table.class_stride;
+    }
+    map_max[surfel_id] = static_cast<float>(max_class);
+    map_max[surfel_id + map_size] = max_probability;
+    map_max[surfel_id + map_size + map_size] += 1.0;
+    if (fusion_stamps) {
+        fusion_stamps[surfel_id] = stamp;
+    }
+}
+
+// Entries per surfel updateTableEntry goes through
+SEMANTIC_FUSION_HOST_DEVICE inline
+int tableEntries(const TableLayout table, const int classes)
+{
+    return table.packed() ? table.surfel_stride : classes;
+}
+
+// Bits of word of a new surfel's record: the all zero quantized record or
+// the empty sparse one (see clearTopK)
+SEMANTIC_FUSION_HOST_DEVICE inline
+unsigned int priorRecordWord(const TableLayout table, const int word)
+{
+    if (table.quantized()) {
+        return 0u;
+    }
+    if (word == 0) {
+        return 0x3f800000u; // a residual of 1.0f
+    }
+    return word <= table.top_k ? 0u : 0xffffffffu; // no probabilities, no classes
+}
+
+// Entry index of the table rebuilt by updateProbabilityTable, with the max
+// class rows and stamps (prob_width per row) moved along with class 0. The
+// entries are numbered in table order so neighbouring indices stay close. The
+// entries of a packed table are the words of its records (tableEntries),
+// copied as bits.
+SEMANTIC_FUSION_HOST_DEVICE inline
+void updateTableEntry(const int index, const int* deleted_ids, const int num_deleted,
+                      float const* probability_table, const TableLayout table,
+                      const int prob_width, const int prob_height, 
+                      const int new_prob_width, float* new_probability_table, float const * map_table, float* new_map_table,
+                      float const* stamps, float* new_stamps)
+{
+    const int entries = tableEntries(table,prob_height);
+    int class_id, component_id;
+    if (table.surfel_major()) {
+        component_id = index / entries;
+        class_id = index - (component_id * entries);
+    } else {
+        class_id = index / new_prob_width;  // get class id of current kernal in new table
+        component_id = index - (class_id * new_prob_width);  // get surfel id of current kernal in new table
+    }
+    const int new_id = table.index(component_id,class_id); // get table index of the entry in the new table
+    if (component_id >= num_deleted) {
+        // Initialise to prior (prob height is the number of classes)
+        if (table.packed()) {
+            reinterpret_cast<unsigned int*>(new_probability_table)[new_id] = priorRecordWord(table,class_id);
+        } else {
+            new_probability_table[new_id] = 1.0f / prob_height;
+        }
+        if (class_id == 0) {
+            // Reset the max class surfel colouring lookup
+            new_map_table[component_id] = -1.0;
+            new_map_table[component_id + prob_width] = -1.0;
+            new_map_table[component_id + prob_width + prob_width] = 0.0;
+            // Not fused yet
+            if (new_stamps) {
+                new_stamps[component_id] = -1.0;
+            }
+        }
+    } else {
+        int offset = deleted_ids[component_id]; // get corresponded surf_id in previous table
+        if (table.packed()) {
+            reinterpret_cast<unsigned int*>(new_probability_table)[new_id] =
+                reinterpret_cast<const unsigned int*>(probability_table)[table.index(offset,class_id)];
+        } else {
+            new_probability_table[new_id] = probability_table[table.index(offset,class_id)];
+        }
+        if (class_id == 0) {
+            // Also must update our max class mapping
+            new_map_table[component_id] = map_table[offset];
+            new_map_table[component_id + prob_width] = map_table[prob_width + offset];
+            new_map_table[component_id + prob_width + prob_width] = map_table[prob_width + prob_width + offset];
+            if (new_stamps) {
+                new_stamps[component_id] = stamps[offset];
+            }
+        }
+    }
+}
+
+// Class-major probabilities of the pixel (x,y) showing surfel_id, certain
+// class 0 where no surfel is visible
+SEMANTIC_FUSION_HOST_DEVICE inline
+void renderPixel(const int surfel_id, const int x, const int y, const int ids_width, const int ids_height, 
+                 const float* probability_table, const TableLayout table, const int prob_height, 
+                 float* rendered_probabilities)
+{
+    int projected_probability_offset = y * ids_width + x;
+    if (surfel_id > 0 && table.sparse()) {
+        decodeTopK(probability_table + surfel_id * table.surfel_stride,table.top_k,prob_height,
+                   rendered_probabilities + projected_probability_offset,ids_width * ids_height);
+        return;
+    }
+    if (surfel_id > 0 && table.quantized()) {
+        decodeSurfel(probability_table + surfel_id * table.surfel_stride,table.code_bits,prob_height,
+                     rendered_probabilities + projected_probability_offset,ids_width * ids_height);
+        return;
+    }
+    int probability_table_offset = table.index(surfel_id,0);
+    for (int class_id = 0; class_id < prob_height; ++class_id) {
+        if (surfel_id > 0) {
+            rendered_probabilities[projected_probability_offset] = probability_table[probability_table_offset];
+        } else {
+            rendered_probabilities[projected_probability_offset] = ((class_id == 0) ? 1.0 : 0.0);
+        }
+        projected_probability_offset += (ids_width * ids_height);
+        probability_table_offset += table.class_stride;
+    }
+}
+
+// Most likely class of table entry index other than class 0, -1 if none has
+// a positive probability
+SEMANTIC_FUSION_HOST_DEVICE inline
+void maxClassEntry(const int index, const float* probabilities, const TableLayout table,
+                   const int classes, float* map_max, const int map_size)
+{
+    if (table.sparse()) {
+        int max_class;
+        float max_probability;
+        sparseMaxClass(probabilities + index * table.surfel_stride,table.top_k,classes,max_class,max_probability);
+        map_max[index] = static_cast<float>(max_class);
+        map_max[index + map_size] = max_probability;
+        return;
+    }
+    if (table.quantized()) {
+        int max_class;
+        float max_probability;
+        quantizedMaxClass(probabilities + index * table.surfel_stride,table.code_bits,classes,
+                          max_class,max_probability);
+        map_max[index] = static_cast<float>(max_class);
+        map_max[index + map_size] = max_probability;
+        return;
+    }
+    const float* probability = probabilities + table.index(index,0);
+    probability += table.class_stride;
+    float max_probability = 0.0;
+    int max_class = -1;
+    for (int class_id = 1; class_id < classes; ++class_id) {
+        if (probability[0] > max_probability) {
+            max_probability = probability[0];
+            max_class = class_id;
+        }
+        probability += table.class_stride;
+    }
+    map_max[index] = static_cast<float>(max_class);
+    map_max[index + map_size] = max_probability;
+}
+
+#endif /* SEMANTIC_FUSION_KERNELS_H_ */
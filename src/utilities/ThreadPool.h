@@ -0,0 +1,189 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that execute ParallelFor ranges. Ranges are
+// cut into chunks of a fixed grain, so the chunk boundaries (and therefore any
+// per-chunk reduction) never depend on how many threads are running. The
+// calling thread works on its own range too, which makes nested ParallelFor
+// calls from inside a chunk safe.
+class ThreadPool {
+public:
+  static ThreadPool& Instance() {
+    static ThreadPool instance(std::thread::hardware_concurrency());
+    return instance;
+  }
+
+  explicit ThreadPool(const int num_threads) : stop_(false) {
+    Start(num_threads);
+  }
+  ~ThreadPool() {
+    Stop();
+  }
+
+  // Total number of threads that work on a range, including the caller
+  int num_threads() const { return static_cast<int>(workers_.size()) + 1; }
+
+  // Must not be called while a range is running
+  void SetNumThreads(const int num_threads) {
+    Stop();
+    Start(num_threads);
+  }
+
+  // Calls fn(chunk_begin, chunk_end) for consecutive chunks of at most grain
+  // elements covering [begin, end) and returns once all of them are done.
+  // The job lives on the caller's stack, so a range never allocates memory.
+  template <typename Fn>
+  void ParallelFor(const int begin, const int end, const int grain, const Fn& fn) {
+    if (end <= begin) {
+      return;
+    }
+    const int chunk = std::max(grain, 1);
+    const int num_chunks = (end - begin + chunk - 1) / chunk;
+    if (workers_.empty() || num_chunks == 1) {
+      for (int c = begin; c < end; c += chunk) {
+        fn(c, std::min(c + chunk, end));
+      }
+      return;
+    }
+    Job job(&CallChunk<Fn>, &fn, begin, end, chunk, num_chunks);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(&job);
+    }
+    work_available_.notify_all();
+    while (RunChunk(job)) {}
+    // No worker can pick the job up once it is unlisted, so it only remains to
+    // wait for the ones still holding it
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Unlist(&job);
+    }
+    std::unique_lock<std::mutex> lock(job.mutex);
+    job.finished.wait(lock, [&job] { return job.done == job.num_chunks && job.users == 0; });
+  }
+
+private:
+  struct Job {
+    Job(void (*call)(const void*,int,int), const void* fn, int begin, int end, int grain, int num_chunks)
+      : call(call), fn(fn), begin(begin), end(end), grain(grain), num_chunks(num_chunks), next(0), users(0), done(0) {}
+    void (* const call)(const void*,int,int);
+    const void* const fn;
+    const int begin, end, grain, num_chunks;
+    std::atomic<int> next;
+    // Workers currently holding a pointer to the job
+    std::atomic<int> users;
+    int done;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+
+  template <typename Fn>
+  static void CallChunk(const void* fn, const int chunk_begin, const int chunk_end) {
+    (*static_cast<const Fn*>(fn))(chunk_begin, chunk_end);
+  }
+
+  // Claims and runs one chunk of job, returns false once none are left
+  bool RunChunk(Job& job) {
+    const int c = job.next++;
+    if (c >= job.num_chunks) {
+      return false;
+    }
+    const int chunk_begin = job.begin + c * job.grain;
+    job.call(job.fn, chunk_begin, std::min(chunk_begin + job.grain, job.end));
+    std::lock_guard<std::mutex> lock(job.mutex);
+    if (++job.done == job.num_chunks && job.users == 0) {
+      job.finished.notify_all();
+    }
+    return true;
+  }
+
+  // Must hold mutex_
+  void Unlist(Job* job) {
+    std::vector<Job*>::iterator it = std::find(jobs_.begin(), jobs_.end(), job);
+    if (it != jobs_.end()) {
+      jobs_.erase(it);
+    }
+  }
+
+  // Must hold mutex_, drops the jobs with no chunks left to claim
+  bool HasWork() {
+    while (!jobs_.empty() && jobs_.front()->next >= jobs_.front()->num_chunks) {
+      jobs_.erase(jobs_.begin());
+    }
+    return !jobs_.empty();
+  }
+
+  void WorkerLoop() {
+    while (true) {
+      Job* job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_available_.wait(lock, [this] { return stop_ || HasWork(); });
+        if (stop_) {
+          return;
+        }
+        job = jobs_.front();
+        ++job->users;
+      }
+      RunChunk(*job);
+      std::lock_guard<std::mutex> lock(job->mutex);
+      if (--job->users == 0 && job->done == job->num_chunks) {
+        job->finished.notify_all();
+      }
+    }
+  }
+
+  void Start(const int num_threads) {
+    stop_ = false;
+    // Enough room for the nested ranges of every thread, so listing a job never reallocates
+    jobs_.reserve(4 * std::max(num_threads, 1));
+    for (int i = 1; i < num_threads; ++i) {
+      workers_.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+    }
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_available_.notify_all();
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      workers_[i].join();
+    }
+    workers_.clear();
+  }
+
+  std::vector<std::thread> workers_;
+  std::vector<Job*> jobs_;
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  bool stop_;
+};
+
+#endif /* THREAD_POOL_H_ */
@@ -0,0 +1,377 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+// CRF microbenchmarks over a synthetic map: surfels on five planes, each split
+// into two labels along a wavy line, with noisy unaries that favour the true
+// label by --bonus. Every mode reports times in milliseconds, best of --repeats.
+//
+//   crf_bench simd  [--surfels 200000] [--classes 14,81]   lattice kernels at
+//                                                          each SIMD level
+//   crf_bench hash  [--keys 1400000] [--distinct 94000]    lattice hash table
+//                   [--surfels 200000]                     and lattice setup
+//   crf_bench alloc [--surfels 100000]                     allocations of
+//                                                          three updates
+//   crf_bench knn   [--surfels 1000000] [--k 4,8,16,32]    kNN graph against
+//                   [--radius 0.15]                        the lattice
+//
+// Common options: [--iterations 5] [--bonus 0.15] [--repeats 3] [--threads n].
+// Lists are comma separated.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <utilities/ThreadPool.h>
+#include "CRF/densecrf.h"
+#include "CRF/kernels.h"
+#include "CRF/permutohedral.h"
+#include "CRF/util.h"
+#include "CrfWorkspace.h"
+
+// Every operator new of the process, for the alloc mode
+static std::atomic<size_t> heap_allocations(0);
+
+void* operator new(size_t bytes) {
+  ++heap_allocations;
+  void* block = std::malloc(bytes ? bytes : 1);
+  if (!block) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+void operator delete(void* block) noexcept {
+  std::free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+  std::free(block);
+}
+
+namespace {
+
+const int kSurfelSize = 12;
+
+std::vector<float> ParseList(const char* list) {
+  std::vector<float> values;
+  const char* start = list;
+  while (*start) {
+    char* end;
+    values.push_back(static_cast<float>(std::strtod(start,&end)));
+    if (end == start) {
+      values.clear();
+      break;
+    }
+    start = *end == ',' ? end + 1 : end;
+  }
+  return values;
+}
+
+double MillisecondsSince(const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int Argmax(const float* values, const int n) {
+  return static_cast<int>(std::max_element(values,values + n) - values);
+}
+
+struct Scene {
+  std::vector<float> surfels;
+  std::vector<float> unaries;
+  std::vector<int> labels;
+  std::vector<int> valid_ids;
+  int num_surfels;
+  int num_classes;
+};
+
+// Surfels in the order of CrfWorkspace::SortAlongCurve, like CRFUpdate with
+// spatial ordering
+Scene MakeScene(const int num_surfels, const int num_classes, const float bonus) {
+  Scene scene;
+  scene.num_surfels = num_surfels;
+  scene.num_classes = num_classes;
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> uniform(0.0f,1.0f);
+  std::vector<float> surfels(static_cast<size_t>(num_surfels) * kSurfelSize,0.0f);
+  std::vector<int> labels(num_surfels);
+  for (int i = 0; i < num_surfels; ++i) {
+    float* surfel = &surfels[static_cast<size_t>(i) * kSurfelSize];
+    const int plane = i % 5;
+    surfel[0] = uniform(rng) * 2.0f;
+    surfel[1] = uniform(rng) * 2.0f;
+    surfel[2] = plane * 0.3f + uniform(rng) * 0.01f;
+    labels[i] = (plane * 2 + (surfel[0] > 1.0f + 0.3f * std::sin(3.0f * surfel[1]))) % num_classes;
+    const int r = (labels[i] * 25) % 256, g = static_cast<int>(uniform(rng) * 40) + plane * 20, b = 100;
+    surfel[4] = static_cast<float>((r << 16) | (g << 8) | b);
+    surfel[9] = plane % 2 ? 1.0f : 0.0f;
+    surfel[10] = plane % 2 ? 0.0f : 1.0f;
+  }
+  std::vector<float> unaries(static_cast<size_t>(num_surfels) * num_classes);
+  std::vector<float> p(num_classes);
+  for (int i = 0; i < num_surfels; ++i) {
+    float total = 0.0f;
+    for (int j = 0; j < num_classes; ++j) {
+      p[j] = uniform(rng) + (j == labels[i] ? bonus : 0.0f);
+      total += p[j];
+    }
+    for (int j = 0; j < num_classes; ++j) {
+      unaries[static_cast<size_t>(i) * num_classes + j] = -std::log(p[j] / total + 1.0e-12f);
+    }
+  }
+  CrfWorkspace workspace(num_classes);
+  std::vector<int>& order = workspace.valid_ids();
+  for (int i = 0; i < num_surfels; ++i) {
+    order.push_back(i);
+  }
+  workspace.SortAlongCurve(surfels.data());
+  scene.surfels.resize(surfels.size());
+  scene.unaries.resize(unaries.size());
+  scene.labels.resize(num_surfels);
+  scene.valid_ids.resize(num_surfels);
+  for (int i = 0; i < num_surfels; ++i) {
+    std::copy(&surfels[static_cast<size_t>(order[i]) * kSurfelSize],&surfels[static_cast<size_t>(order[i] + 1) * kSurfelSize],
+              &scene.surfels[static_cast<size_t>(i) * kSurfelSize]);
+    std::copy(&unaries[static_cast<size_t>(order[i]) * num_classes],&unaries[static_cast<size_t>(order[i] + 1) * num_classes],
+              &scene.unaries[static_cast<size_t>(i) * num_classes]);
+    scene.labels[i] = labels[order[i]];
+    scene.valid_ids[i] = i;
+  }
+  return scene;
+}
+
+struct Options {
+  std::vector<float> classes;
+  std::vector<float> k;
+  int surfels;
+  int keys;
+  int distinct;
+  int iterations;
+  int repeats;
+  float bonus;
+  float radius;
+};
+
+const char* SimdName(const int level) {
+  static const char* names[] = {"scalar","sse","avx2"};
+  return names[level];
+}
+
+// Inference time and marginals at each SIMD level the CPU has
+int RunSimd(const Options& options) {
+  const int best = detectSimdLevel();
+  std::printf("classes\tsimd\tinference ms\tmax diff to scalar\n");
+  for (size_t c = 0; c < options.classes.size(); ++c) {
+    const Scene scene = MakeScene(options.surfels,static_cast<int>(options.classes[c]),options.bonus);
+    const size_t size = static_cast<size_t>(scene.num_surfels) * scene.num_classes;
+    std::vector<float> scalar;
+    for (int level = SIMD_SCALAR; level <= best; ++level) {
+      setSimdLevel(static_cast<SimdLevel>(level));
+      DenseCRF3D crf(scene.num_surfels,scene.num_classes,0.05,20,0.1);
+      crf.setUnaryEnergy(scene.unaries.data());
+      crf.addPairwiseGaussianAndBilateral(scene.surfels.data(),3,10,scene.valid_ids);
+      double best_ms = 1.0e30;
+      const float* marginals = NULL;
+      for (int r = 0; r < options.repeats; ++r) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        marginals = crf.runInference(options.iterations,1.0);
+        best_ms = std::min(best_ms,MillisecondsSince(start));
+      }
+      if (level == SIMD_SCALAR) {
+        scalar.assign(marginals,marginals + size);
+      }
+      double max_diff = 0;
+      for (size_t i = 0; i < size; ++i) {
+        max_diff = std::max(max_diff,static_cast<double>(std::fabs(marginals[i] - scalar[i])));
+      }
+      std::printf("%d\t%s\t%.1f\t%.2g\n",scene.num_classes,SimdName(level),best_ms,max_diff);
+    }
+    setSimdLevel(static_cast<SimdLevel>(best));
+  }
+  return 0;
+}
+
+// The lattice hash table on its own, then the lattices of a scene
+int RunHash(const Options& options) {
+  const int key_size = 6;
+  std::mt19937 rng(3);
+  std::vector<short> pool(static_cast<size_t>(options.distinct) * key_size);
+  for (size_t i = 0; i < pool.size(); ++i) {
+    pool[i] = static_cast<short>(rng() % 256) - 128;
+  }
+  std::vector<short> keys(static_cast<size_t>(options.keys) * key_size);
+  for (int i = 0; i < options.keys; ++i) {
+    const int k = rng() % options.distinct;
+    std::copy(&pool[static_cast<size_t>(k) * key_size],&pool[static_cast<size_t>(k + 1) * key_size],
+              &keys[static_cast<size_t>(i) * key_size]);
+  }
+  double insert_ns = 1.0e30, find_ns = 1.0e30;
+  int vertices = 0;
+  long checksum = 0;
+  for (int r = 0; r < options.repeats; ++r) {
+    HashTable table(key_size,options.keys);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < options.keys; ++i) {
+      checksum += table.find(&keys[static_cast<size_t>(i) * key_size],true);
+    }
+    insert_ns = std::min(insert_ns,MillisecondsSince(start) * 1.0e6 / options.keys);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < options.keys; ++i) {
+      checksum += table.find(&keys[static_cast<size_t>(i) * key_size]);
+    }
+    find_ns = std::min(find_ns,MillisecondsSince(start) * 1.0e6 / options.keys);
+    vertices = table.size();
+  }
+  std::printf("%d keys, %d distinct: insert %.1f ns, find %.1f ns per key (checksum %ld)\n",
+              options.keys,vertices,insert_ns,find_ns,checksum);
+  const Scene scene = MakeScene(options.surfels,14,options.bonus);
+  double gaussian_ms = 1.0e30, bilateral_ms = 1.0e30;
+  for (int r = 0; r < options.repeats; ++r) {
+    DenseCRF3D crf(scene.num_surfels,scene.num_classes,0.05,20,0.1);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    crf.addPairwiseGaussian(scene.surfels.data(),3,scene.valid_ids);
+    gaussian_ms = std::min(gaussian_ms,MillisecondsSince(start));
+    start = std::chrono::steady_clock::now();
+    crf.addPairwiseBilateral(scene.surfels.data(),10,scene.valid_ids);
+    bilateral_ms = std::min(bilateral_ms,MillisecondsSince(start));
+  }
+  std::printf("%d surfels: Gaussian lattice %.1f ms, bilateral lattice %.1f ms\n",
+              scene.num_surfels,gaussian_ms,bilateral_ms);
+  return 0;
+}
+
+// Heap and CRF buffer allocations of three updates of one CRF, over all, half
+// and all of the surfels, like CRFUpdate with a CrfWorkspace
+int RunAlloc(const Options& options) {
+  const Scene scene = MakeScene(options.surfels,14,options.bonus);
+  DenseCRF3D crf(scene.num_surfels,scene.num_classes,0.05,20,0.1);
+  std::printf("update\tsurfels\tsetup new\tsetup buffers\tinference new\tinference buffers\n");
+  for (int update = 0; update < 3; ++update) {
+    const int n = update == 1 ? scene.num_surfels / 2 : scene.num_surfels;
+    const std::vector<int> valid_ids(scene.valid_ids.begin(),scene.valid_ids.begin() + n);
+    const size_t setup_new = heap_allocations, setup_buffers = allocationCount();
+    crf.reset(n);
+    crf.setUnaryEnergy(scene.unaries.data());
+    crf.addPairwiseGaussianAndBilateral(scene.surfels.data(),3,10,valid_ids);
+    const size_t inference_new = heap_allocations, inference_buffers = allocationCount();
+    crf.runInference(options.iterations,1.0);
+    std::printf("%d\t%d\t%zu\t%zu\t%zu\t%zu\n",update,n,inference_new - setup_new,inference_buffers - setup_buffers,
+                heap_allocations - inference_new,allocationCount() - inference_buffers);
+  }
+  return 0;
+}
+
+// Setup and inference time and accuracy of the kNN graph for each k, against
+// the lattice
+int RunKnn(const Options& options) {
+  const Scene scene = MakeScene(options.surfels,14,options.bonus);
+  const int n = scene.num_surfels, m = scene.num_classes;
+  // The lowest unary is the most likely label
+  int unary_correct = 0;
+  for (int i = 0; i < n; ++i) {
+    const float* row = &scene.unaries[static_cast<size_t>(i) * m];
+    unary_correct += static_cast<int>(std::min_element(row,row + m) - row) == scene.labels[i];
+  }
+  std::printf("%d surfels, unary accuracy %.4f\n",n,static_cast<double>(unary_correct) / n);
+  std::printf("graph\tsetup ms\tinference ms\taccuracy\tagreement with lattice\n");
+  std::vector<int> lattice_labels(n);
+  for (int g = -1; g < static_cast<int>(options.k.size()); ++g) {
+    const int k = g < 0 ? 0 : static_cast<int>(options.k[g]);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    DenseCRF3D crf(n,m,0.05,20,0.1);
+    crf.setUnaryEnergy(scene.unaries.data());
+    if (k == 0) {
+      crf.addPairwiseGaussianAndBilateral(scene.surfels.data(),3,10,scene.valid_ids);
+    } else {
+      crf.addPairwiseKnn(scene.surfels.data(),3,10,scene.valid_ids,k,options.radius);
+    }
+    const double setup_ms = MillisecondsSince(start);
+    start = std::chrono::steady_clock::now();
+    const float* marginals = crf.runInference(options.iterations,1.0);
+    const double inference_ms = MillisecondsSince(start);
+    int correct = 0, agree = 0;
+    for (int i = 0; i < n; ++i) {
+      const int label = Argmax(marginals + static_cast<size_t>(i) * m,m);
+      if (k == 0) {
+        lattice_labels[i] = label;
+      }
+      correct += label == scene.labels[i];
+      agree += label == lattice_labels[i];
+    }
+    std::printf("%s\t%.1f\t%.1f\t%.4f\t%.4f\n",k == 0 ? "lattice" : ("k=" + std::to_string(k)).c_str(),
+                setup_ms,inference_ms,static_cast<double>(correct) / n,static_cast<double>(agree) / n);
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string mode = argc > 1 ? argv[1] : "";
+  if (mode != "simd" && mode != "hash" && mode != "alloc" && mode != "knn") {
+    std::printf("usage: %s simd|hash|alloc|knn [--surfels n] [--classes n,...] [--keys n] [--distinct n]\n"
+                "       [--k n,...] [--radius r] [--iterations n] [--bonus b] [--repeats n] [--threads n]\n",argv[0]);
+    return 1;
+  }
+  Options options;
+  options.classes.push_back(14.0f);
+  options.classes.push_back(81.0f);
+  const float k[] = {4.0f,8.0f,16.0f,32.0f};
+  options.k.assign(k,k + 4);
+  options.surfels = mode == "knn" ? 1000000 : mode == "alloc" ? 100000 : 200000;
+  options.keys = 1400000;
+  options.distinct = 94000;
+  options.iterations = 5;
+  options.repeats = 3;
+  options.bonus = 0.15f;
+  options.radius = 0.15f;
+  for (int a = 2; a + 1 < argc; a += 2) {
+    const std::string option(argv[a]);
+    const std::vector<float> values = ParseList(argv[a + 1]);
+    if (values.empty()) {
+      std::printf("Bad value list '%s' for %s\n",argv[a + 1],argv[a]);
+      return 1;
+    }
+    if (option == "--surfels") options.surfels = std::max(1,static_cast<int>(values[0]));
+    else if (option == "--classes") options.classes = values;
+    else if (option == "--keys") options.keys = std::max(1,static_cast<int>(values[0]));
+    else if (option == "--distinct") options.distinct = std::max(1,static_cast<int>(values[0]));
+    else if (option == "--k") options.k = values;
+    else if (option == "--radius") options.radius = values[0];
+    else if (option == "--iterations") options.iterations = std::max(0,static_cast<int>(values[0]));
+    else if (option == "--bonus") options.bonus = values[0];
+    else if (option == "--repeats") options.repeats = std::max(1,static_cast<int>(values[0]));
+    else if (option == "--threads") ThreadPool::Instance().SetNumThreads(std::max(1,static_cast<int>(values[0])));
+    else {
+      std::printf("Unknown option %s\n",argv[a]);
+      return 1;
+    }
+  }
+  std::printf("%d threads, best SIMD level %s\n",ThreadPool::Instance().num_threads(),SimdName(detectSimdLevel()));
+  if (mode == "simd") return RunSimd(options);
+  if (mode == "hash") return RunHash(options);
+  if (mode == "alloc") return RunAlloc(options);
+  return RunKnn(options);
+}
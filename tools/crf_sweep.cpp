@@ -0,0 +1,291 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+// Offline CRF tuning: loads a map saved by SemanticFusionInterface::SaveCRFSnapshot,
+// builds the Gaussian and bilateral lattices once for each combination of
+// stddevs, then runs mean-field for every combination of pairwise weights at
+// once and reports how the labels change after each requested number of
+// iterations.
+//
+//   crf_sweep snapshot [--spatial 0.05] [--colour 20] [--normal 0.1]
+//             [--gaussian 3] [--bilateral 10] [--iterations 5,10]
+//             [--batch 8] [--threads n]
+//
+// Every option takes a comma separated list and the sweep covers all their
+// combinations. --batch weight combinations share each lattice pass, which
+// costs batch times the marginals in memory. Each row gives the inference time
+// per combination (its share of the batch), the fraction of surfels whose label
+// differs from their unary's, the fraction that changed since the previous
+// iteration count and the mean probability of the chosen labels.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <utilities/ThreadPool.h>
+#include "CRF/densecrf.h"
+#include "CRF/kernels.h"
+#include "CRF/util.h"
+#include "CrfSnapshot.h"
+
+namespace {
+
+const int kRowGrain = 1024;
+
+std::vector<float> ParseList(const char* list) {
+  std::vector<float> values;
+  const char* start = list;
+  while (*start) {
+    char* end;
+    values.push_back(static_cast<float>(std::strtod(start,&end)));
+    if (end == start) {
+      values.clear();
+      break;
+    }
+    start = *end == ',' ? end + 1 : end;
+  }
+  return values;
+}
+
+double MillisecondsSince(const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// DenseCRF3D whose two potentials, built with weight 1, are applied for a
+// batch of weight pairs at once. The marginals of the batch are interleaved,
+// num_classes per combination for each surfel, so every lattice pass filters
+// all of them together.
+class SweepCRF : public DenseCRF3D {
+public:
+  SweepCRF(const int num_surfels, const int num_classes, const float spatial_stddev,
+           const float colour_stddev, const float normal_stddev)
+    : DenseCRF3D(num_surfels,num_classes,spatial_stddev,colour_stddev,normal_stddev)
+    , scratch_(NULL)
+    , scratch_capacity_(0)
+  {}
+  ~SweepCRF() {
+    releaseBuffer(scratch_,scratch_capacity_);
+  }
+
+  // Runs iterations mean-field steps for batch combinations, weights holding a
+  // Gaussian and a bilateral weight for each. report(step, marginals) is
+  // called after every step.
+  template <typename Fn>
+  void Sweep(const float* weights, const int batch, const int iterations, const Fn& report) {
+    const int values = batch * M_;
+    const size_t size = static_cast<size_t>(N_) * values;
+    current_batch_.resize(size);
+    next_batch_.resize(size);
+    messages_.resize(size);
+    tmp_batch_.resize(size);
+    SetUnary();
+    Normalize();
+    for (int step = 1; step <= iterations; ++step) {
+      SetUnary();
+      for (size_t p = 0; p < pairwise_.size(); ++p) {
+        std::fill(messages_.begin(),messages_.end(),0.0f);
+        pairwise_[p]->apply(messages_.data(),current_batch_.data(),tmp_batch_.data(),values);
+        ThreadPool::Instance().ParallelFor(0,N_,kRowGrain,[&](int begin, int end) {
+          for (int i = begin; i < end; ++i) {
+            for (int b = 0; b < batch; ++b) {
+              const float w = weights[2 * b + p];
+              const size_t row = static_cast<size_t>(i) * values + b * M_;
+              for (int j = 0; j < M_; ++j) {
+                next_batch_[row + j] += w * messages_[row + j];
+              }
+            }
+          }
+        });
+      }
+      Normalize();
+      report(step,current_batch_.data());
+    }
+  }
+
+private:
+  // next = -unary for every combination
+  void SetUnary() {
+    const int batch = static_cast<int>(next_batch_.size() / (static_cast<size_t>(N_) * M_));
+    ThreadPool::Instance().ParallelFor(0,N_,kRowGrain,[&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        for (int b = 0; b < batch; ++b) {
+          float* row = &next_batch_[(static_cast<size_t>(i) * batch + b) * M_];
+          for (int j = 0; j < M_; ++j) {
+            row[j] = -unary_[i * M_ + j];
+          }
+        }
+      }
+    });
+  }
+  // current = softmax(next), a row of M_ labels at a time
+  void Normalize() {
+    const MeanFieldKernels& kernels = meanFieldKernels(M_);
+    const int padded = simdPad(M_,kernels.width);
+    const int rows = static_cast<int>(next_batch_.size() / M_);
+    const int chunks = (rows + kRowGrain - 1) / kRowGrain;
+    reserveBuffer(scratch_,scratch_capacity_,static_cast<size_t>(chunks) * padded);
+    ThreadPool::Instance().ParallelFor(0,rows,kRowGrain,[&](int begin, int end) {
+      double sum_change = 0;
+      kernels.exp_normalize(current_batch_.data(),next_batch_.data(),scratch_ + (begin / kRowGrain) * padded,
+                            begin,end,M_,1.0,1.0,NULL,&sum_change);
+    });
+  }
+
+  std::vector<float> current_batch_;
+  std::vector<float> next_batch_;
+  std::vector<float> messages_;
+  std::vector<float> tmp_batch_;
+  float* scratch_;
+  size_t scratch_capacity_;
+};
+
+int Argmax(const float* values, const int n) {
+  return static_cast<int>(std::max_element(values,values + n) - values);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::printf("usage: %s snapshot [--spatial s,...] [--colour s,...] [--normal s,...]\n"
+                "       [--gaussian w,...] [--bilateral w,...] [--iterations n,...] [--batch n] [--threads n]\n",argv[0]);
+    return 1;
+  }
+  std::vector<float> spatial(1,0.05f), colour(1,20.0f), normal(1,0.1f);
+  std::vector<float> gaussian(1,3.0f), bilateral(1,10.0f), iteration_counts(1,5.0f);
+  iteration_counts.push_back(10.0f);
+  int batch = 8;
+  for (int a = 2; a + 1 < argc; a += 2) {
+    const std::string option(argv[a]);
+    const std::vector<float> values = ParseList(argv[a + 1]);
+    if (values.empty()) {
+      std::printf("Bad value list '%s' for %s\n",argv[a + 1],argv[a]);
+      return 1;
+    }
+    if (option == "--spatial") spatial = values;
+    else if (option == "--colour") colour = values;
+    else if (option == "--normal") normal = values;
+    else if (option == "--gaussian") gaussian = values;
+    else if (option == "--bilateral") bilateral = values;
+    else if (option == "--iterations") iteration_counts = values;
+    else if (option == "--batch") batch = std::max(1,static_cast<int>(values[0]));
+    else if (option == "--threads") ThreadPool::Instance().SetNumThreads(std::max(1,static_cast<int>(values[0])));
+    else {
+      std::printf("Unknown option %s\n",argv[a]);
+      return 1;
+    }
+  }
+  std::sort(iteration_counts.begin(),iteration_counts.end());
+  const int max_iterations = static_cast<int>(iteration_counts.back());
+
+  CrfSnapshot snapshot;
+  if (!LoadCrfSnapshot(argv[1],snapshot)) {
+    std::printf("Could not read the snapshot %s\n",argv[1]);
+    return 1;
+  }
+  const int num_surfels = snapshot.num_surfels;
+  const int num_classes = snapshot.num_classes;
+  std::printf("%d surfels, %d classes, %d threads\n",num_surfels,num_classes,
+              ThreadPool::Instance().num_threads());
+  // The unaries CRFUpdate would use, and the labels they give on their own
+  std::vector<float> unaries(static_cast<size_t>(num_surfels) * num_classes);
+  std::vector<int> unary_labels(num_surfels);
+  for (int i = 0; i < num_surfels; ++i) {
+    for (int j = 0; j < num_classes; ++j) {
+      unaries[i * num_classes + j] = -std::log(snapshot.probabilities[static_cast<size_t>(j) * num_surfels + i] + 1.0e-12f);
+    }
+  }
+  for (int i = 0; i < num_surfels; ++i) {
+    float best = unaries[i * num_classes];
+    unary_labels[i] = 0;
+    for (int j = 1; j < num_classes; ++j) {
+      if (unaries[i * num_classes + j] < best) {
+        best = unaries[i * num_classes + j];
+        unary_labels[i] = j;
+      }
+    }
+  }
+  std::vector<int> valid_ids(num_surfels);
+  for (int i = 0; i < num_surfels; ++i) {
+    valid_ids[i] = i;
+  }
+  std::vector<float> weights;
+  for (size_t g = 0; g < gaussian.size(); ++g) {
+    for (size_t b = 0; b < bilateral.size(); ++b) {
+      weights.push_back(gaussian[g]);
+      weights.push_back(bilateral[b]);
+    }
+  }
+  const int num_weights = static_cast<int>(weights.size() / 2);
+  // Labels of each combination of the batch at the previous reported count
+  std::vector<int> previous_labels;
+
+  std::printf("spatial\tcolour\tnormal\tgaussian\tbilateral\titerations\tms\tchanged\tflipped\tconfidence\n");
+  for (size_t s = 0; s < spatial.size(); ++s) {
+    for (size_t c = 0; c < colour.size(); ++c) {
+      for (size_t n = 0; n < normal.size(); ++n) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        SweepCRF crf(num_surfels,num_classes,spatial[s],colour[c],normal[n]);
+        crf.setUnaryEnergy(unaries.data());
+        crf.addPairwiseGaussianAndBilateral(snapshot.surfels.data(),1.0,1.0,valid_ids);
+        std::printf("# lattices for spatial %g colour %g normal %g built in %.1f ms\n",
+                    spatial[s],colour[c],normal[n],MillisecondsSince(start));
+        for (int first = 0; first < num_weights; first += batch) {
+          const int count = std::min(batch,num_weights - first);
+          previous_labels.assign(static_cast<size_t>(num_surfels) * count,-1);
+          size_t next_count = 0;
+          double elapsed = 0;
+          start = std::chrono::steady_clock::now();
+          crf.Sweep(&weights[2 * first],count,max_iterations,[&](int step, const float* marginals) {
+            if (next_count == iteration_counts.size() || step != static_cast<int>(iteration_counts[next_count])) {
+              return;
+            }
+            ++next_count;
+            // The time per combination, the batch shares it
+            elapsed += MillisecondsSince(start);
+            const double ms = elapsed / count;
+            for (int b = 0; b < count; ++b) {
+              int changed = 0, flipped = 0;
+              double confidence = 0;
+              for (int i = 0; i < num_surfels; ++i) {
+                const float* row = marginals + (static_cast<size_t>(i) * count + b) * num_classes;
+                const int label = Argmax(row,num_classes);
+                int& previous = previous_labels[static_cast<size_t>(i) * count + b];
+                changed += label != unary_labels[i];
+                flipped += previous >= 0 && label != previous;
+                previous = label;
+                confidence += row[label];
+              }
+              std::printf("%g\t%g\t%g\t%g\t%g\t%d\t%.1f\t%.4f\t%.4f\t%.4f\n",spatial[s],colour[c],normal[n],
+                          weights[2 * (first + b)],weights[2 * (first + b) + 1],step,ms,
+                          static_cast<double>(changed) / num_surfels,static_cast<double>(flipped) / num_surfels,
+                          confidence / num_surfels);
+            }
+            start = std::chrono::steady_clock::now();
+          });
+        }
+      }
+    }
+  }
+  return 0;
+}
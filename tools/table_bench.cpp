@@ -0,0 +1,365 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+// Probability table benchmarks on the CPU backend (CpuSemanticFusionBackend),
+// with synthetic views of a 640x480 surfel id image and 224x224 CNN outputs.
+//
+//   table_bench layout    [--classes 14,40] [--map 3000000] [--repeats 5]
+//
+// times fuse, render, max class and table update for the class-major and the
+// surfel-major layouts over one view scattered across a map of --map surfels,
+// best of --repeats, and checks that both give the same results.
+//
+//   table_bench quantized [--classes 14,40] [--frames 30] [--map 3000000]
+//
+// fuses --frames noisy views of a planar grid of surfels into a float32 table
+// and into the 16-bit, 8-bit and top-2/4/8 layouts, compacts the tables to
+// every other surfel and reports each layout's memory for --map surfels (both
+// tables and the class_max rows), its time per frame and how far its
+// probabilities and most likely classes are from those of float32.
+//
+// Common options: [--threads n]. Lists are comma separated.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <utilities/ThreadPool.h>
+#include "SemanticFusionCpu.h"
+#include "SemanticFusionKernels.h"
+
+namespace {
+
+const int kImageWidth = 640;
+const int kImageHeight = 480;
+const int kProbWidth = 224;
+const int kProbHeight = 224;
+// Surfel grid the quantized benchmark views a window of
+const int kGridWidth = 700;
+const int kGridHeight = 340;
+
+std::vector<float> ParseList(const char* list) {
+  std::vector<float> values;
+  const char* start = list;
+  while (*start) {
+    char* end;
+    values.push_back(static_cast<float>(std::strtod(start,&end)));
+    if (end == start) {
+      values.clear();
+      break;
+    }
+    start = *end == ',' ? end + 1 : end;
+  }
+  return values;
+}
+
+double MillisecondsSince(const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string LayoutName(const TableLayout& layout) {
+  if (layout.sparse()) return "top-" + std::to_string(layout.top_k);
+  if (layout.quantized()) return std::to_string(layout.code_bits) + "-bit";
+  return layout.surfel_major() ? "surfel-major" : "class-major";
+}
+
+// The probabilities of a surfel, whatever the layout
+void SurfelProbabilities(const std::vector<float>& table, const TableLayout& layout, const int surfel_id,
+                         const int classes, float* out) {
+  if (layout.sparse()) {
+    decodeTopK(&table[static_cast<size_t>(surfel_id) * layout.surfel_stride],layout.top_k,classes,out,1);
+  } else if (layout.quantized()) {
+    decodeSurfel(&table[static_cast<size_t>(surfel_id) * layout.surfel_stride],layout.code_bits,classes,out,1);
+  } else {
+    for (int c = 0; c < classes; ++c) {
+      out[c] = table[layout.index(surfel_id,c)];
+    }
+  }
+}
+
+// A table of map_size surfels in layout, with the class_max rows and stamps
+struct Table {
+  TableLayout layout;
+  std::vector<float> probabilities;
+  std::vector<float> max_class;
+  std::vector<float> stamps;
+  CpuSemanticFusionBackend backend;
+  double fuse_ms, render_ms, max_class_ms, update_ms;
+
+  Table(const TableLayout table_layout, const int classes, const int map_size)
+    : layout(table_layout)
+    , probabilities(table_layout.size(classes,map_size),0.0f)
+    , max_class(3 * static_cast<size_t>(map_size),0.0f)
+    , stamps(map_size,-1.0f)
+    , fuse_ms(0.0)
+    , render_ms(0.0)
+    , max_class_ms(0.0)
+    , update_ms(0.0)
+  {}
+};
+
+// Class-major and surfel-major over the same view and starting table
+int RunLayout(const std::vector<float>& classes, const int map_size, const int repeats) {
+  std::printf("classes\tlayout\tfuse ms\trender ms\tmax class ms\ttable update ms\n");
+  for (size_t k = 0; k < classes.size(); ++k) {
+    const int num_classes = static_cast<int>(classes[k]);
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<float> uniform(0.0f,1.0f);
+    // A view of 2x2 pixel surfels whose ids are scattered over the table, with
+    // a corner that shows no surfel
+    std::vector<int> ids(kImageWidth * kImageHeight);
+    for (int y = 0; y < kImageHeight; ++y) {
+      for (int x = 0; x < kImageWidth; ++x) {
+        const long long block = (y / 2) * (kImageWidth / 2) + x / 2;
+        ids[y * kImageWidth + x] = x < 30 && y < 30 ? 0 : 1 + static_cast<int>((block * 7919) % (map_size - 1));
+      }
+    }
+    const SurfelIdImage image = {0,ids.data(),kImageWidth,kImageHeight};
+    std::vector<float> probabilities(static_cast<size_t>(num_classes) * kProbWidth * kProbHeight);
+    for (size_t i = 0; i < probabilities.size(); ++i) {
+      probabilities[i] = uniform(rng);
+    }
+    std::vector<float> initial(static_cast<size_t>(num_classes) * map_size);
+    for (size_t i = 0; i < initial.size(); ++i) {
+      initial[i] = uniform(rng);
+    }
+    std::vector<int> kept_ids;
+    for (int i = 0; i < map_size; ++i) {
+      if (i % 19) {
+        kept_ids.push_back(i);
+      }
+    }
+    const int new_map_size = map_size * 96 / 100;
+    std::vector<float> rendered(static_cast<size_t>(num_classes) * kImageWidth * kImageHeight);
+    // Class-major copies of the results of each layout
+    std::vector<float> results[2];
+    for (int l = 0; l < 2; ++l) {
+      const TableLayout layout = l == 0 ? TableLayout::ClassMajor(map_size) : TableLayout::SurfelMajor(num_classes);
+      Table table(layout,num_classes,map_size);
+      for (int s = 0; s < map_size; ++s) {
+        for (int c = 0; c < num_classes; ++c) {
+          table.probabilities[layout.index(s,c)] = initial[static_cast<size_t>(c) * map_size + s];
+        }
+      }
+      table.fuse_ms = table.render_ms = table.max_class_ms = 1.0e30;
+      for (int r = 0; r < repeats; ++r) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        table.backend.FuseProbabilities(image,probabilities.data(),kProbWidth,kProbHeight,num_classes,
+                                        table.probabilities.data(),layout,table.max_class.data(),map_size,
+                                        table.stamps.data(),static_cast<float>(r));
+        table.fuse_ms = std::min(table.fuse_ms,MillisecondsSince(start));
+        start = std::chrono::steady_clock::now();
+        table.backend.RenderProbabilityMap(image,table.probabilities.data(),layout,num_classes,rendered.data());
+        table.render_ms = std::min(table.render_ms,MillisecondsSince(start));
+        start = std::chrono::steady_clock::now();
+        table.backend.UpdateMaxClass(map_size,table.probabilities.data(),layout,num_classes,table.max_class.data(),map_size);
+        table.max_class_ms = std::min(table.max_class_ms,MillisecondsSince(start));
+      }
+      // The rebuilt table has the size and layout of the old one, like the
+      // buffer SemanticFusionInterface swaps in
+      std::vector<float> new_probabilities(table.probabilities.size(),0.0f);
+      std::vector<float> new_max_class(table.max_class.size()), new_stamps(table.stamps.size());
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      table.backend.UpdateProbabilityTable(kept_ids.data(),static_cast<int>(kept_ids.size()),map_size,
+                                           table.probabilities.data(),layout,map_size,num_classes,new_map_size,
+                                           new_probabilities.data(),table.max_class.data(),new_max_class.data(),
+                                           table.stamps.data(),new_stamps.data());
+      table.update_ms = MillisecondsSince(start);
+      std::printf("%d\t%s\t%.1f\t%.1f\t%.1f\t%.1f\n",num_classes,LayoutName(layout).c_str(),
+                  table.fuse_ms,table.render_ms,table.max_class_ms,table.update_ms);
+      std::vector<float>& result = results[l];
+      for (int s = 0; s < new_map_size; ++s) {
+        for (int c = 0; c < num_classes; ++c) {
+          result.push_back(new_probabilities[layout.index(s,c)]);
+        }
+      }
+      for (int row = 0; row < 3; ++row) {
+        result.insert(result.end(),new_max_class.begin() + static_cast<size_t>(row) * map_size,
+                      new_max_class.begin() + static_cast<size_t>(row) * map_size + new_map_size);
+      }
+      result.insert(result.end(),new_stamps.begin(),new_stamps.begin() + new_map_size);
+      result.insert(result.end(),rendered.begin(),rendered.end());
+    }
+    std::printf("# %d classes: the layouts give %s results\n",num_classes,
+                std::memcmp(results[0].data(),results[1].data(),results[0].size() * sizeof(float)) == 0
+                ? "bit-identical" : "DIFFERENT");
+  }
+  return 0;
+}
+
+// Quantized and sparse tables against float32 over a noisy sequence
+int RunQuantized(const std::vector<float>& classes, const int frames, const int memory_map_size) {
+  const int map_size = 1 + kGridWidth * kGridHeight;
+  std::printf("classes\tlayout\tMB\tfuse ms\trender ms\tmax class ms\tmean |dp|\tmax |dp|\targmax agreement\n");
+  for (size_t k = 0; k < classes.size(); ++k) {
+    const int num_classes = static_cast<int>(classes[k]);
+    std::vector<TableLayout> layouts;
+    layouts.push_back(TableLayout::ClassMajor(map_size));
+    layouts.push_back(TableLayout::Quantized(num_classes,16));
+    layouts.push_back(TableLayout::Quantized(num_classes,8));
+    for (int top_k = 2; top_k <= 8 && top_k < num_classes; top_k *= 2) {
+      layouts.push_back(TableLayout::Sparse(top_k));
+    }
+    std::vector<Table*> tables;
+    for (size_t l = 0; l < layouts.size(); ++l) {
+      Table* table = new Table(layouts[l],num_classes,map_size);
+      // A table of new surfels, all at the prior
+      table->backend.UpdateProbabilityTable(NULL,0,0,table->probabilities.data(),table->layout,map_size,num_classes,
+                                            map_size,table->probabilities.data(),table->max_class.data(),
+                                            table->max_class.data(),table->stamps.data(),table->stamps.data());
+      tables.push_back(table);
+    }
+    std::mt19937 rng(7);
+    std::normal_distribution<float> noise(0.0f,1.5f);
+    std::uniform_int_distribution<int> offset(0,99);
+    std::vector<int> ids(kImageWidth * kImageHeight);
+    std::vector<float> probabilities(static_cast<size_t>(num_classes) * kProbWidth * kProbHeight);
+    std::vector<float> rendered(static_cast<size_t>(num_classes) * kImageWidth * kImageHeight);
+    std::vector<float> logits(num_classes);
+    for (int f = 0; f < frames; ++f) {
+      // A window of 2x2 pixel surfels on the grid, whose regions of 20x25
+      // surfels each have a class
+      const int offset_x = offset(rng), offset_y = offset(rng);
+      for (int y = 0; y < kImageHeight; ++y) {
+        for (int x = 0; x < kImageWidth; ++x) {
+          ids[y * kImageWidth + x] = 1 + (y / 2 + offset_y) * kGridWidth + x / 2 + offset_x;
+        }
+      }
+      for (int y = 0; y < kProbHeight; ++y) {
+        for (int x = 0; x < kProbWidth; ++x) {
+          const int surfel_id = ids[(y * kImageHeight / kProbHeight) * kImageWidth + x * kImageWidth / kProbWidth];
+          const int truth = ((surfel_id / kGridWidth) / 20 * 7 + (surfel_id % kGridWidth) / 25) % num_classes;
+          float max_logit = -1.0e30f;
+          for (int c = 0; c < num_classes; ++c) {
+            logits[c] = noise(rng) + (c == truth ? 2.5f : 0.0f);
+            max_logit = std::max(max_logit,logits[c]);
+          }
+          float total = 0.0f;
+          for (int c = 0; c < num_classes; ++c) {
+            logits[c] = std::exp(logits[c] - max_logit);
+            total += logits[c];
+          }
+          for (int c = 0; c < num_classes; ++c) {
+            probabilities[(static_cast<size_t>(c) * kProbHeight + y) * kProbWidth + x] = logits[c] / total;
+          }
+        }
+      }
+      const SurfelIdImage image = {0,ids.data(),kImageWidth,kImageHeight};
+      for (size_t l = 0; l < tables.size(); ++l) {
+        Table& table = *tables[l];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        table.backend.FuseProbabilities(image,probabilities.data(),kProbWidth,kProbHeight,num_classes,
+                                        table.probabilities.data(),table.layout,table.max_class.data(),map_size,
+                                        table.stamps.data(),static_cast<float>(f));
+        table.fuse_ms += MillisecondsSince(start);
+        start = std::chrono::steady_clock::now();
+        table.backend.RenderProbabilityMap(image,table.probabilities.data(),table.layout,num_classes,rendered.data());
+        table.render_ms += MillisecondsSince(start);
+        start = std::chrono::steady_clock::now();
+        table.backend.UpdateMaxClass(map_size,table.probabilities.data(),table.layout,num_classes,
+                                     table.max_class.data(),map_size);
+        table.max_class_ms += MillisecondsSince(start);
+      }
+    }
+    // Compaction to every other surfel
+    std::vector<int> kept_ids;
+    for (int i = 0; i < map_size; i += 2) {
+      kept_ids.push_back(i);
+    }
+    const int num_kept = static_cast<int>(kept_ids.size());
+    for (size_t l = 0; l < tables.size(); ++l) {
+      Table& table = *tables[l];
+      std::vector<float> new_probabilities(table.probabilities.size());
+      std::vector<float> new_max_class(table.max_class.size()), new_stamps(table.stamps.size());
+      table.backend.UpdateProbabilityTable(kept_ids.data(),num_kept,map_size,table.probabilities.data(),table.layout,
+                                           map_size,num_classes,num_kept,new_probabilities.data(),
+                                           table.max_class.data(),new_max_class.data(),
+                                           table.stamps.data(),new_stamps.data());
+      table.probabilities.swap(new_probabilities);
+    }
+    std::vector<float> reference(num_classes), probs(num_classes);
+    for (size_t l = 0; l < tables.size(); ++l) {
+      const Table& table = *tables[l];
+      double sum_diff = 0.0, max_diff = 0.0;
+      int agree = 0;
+      for (int s = 0; s < num_kept; ++s) {
+        SurfelProbabilities(tables[0]->probabilities,tables[0]->layout,s,num_classes,reference.data());
+        SurfelProbabilities(table.probabilities,table.layout,s,num_classes,probs.data());
+        for (int c = 0; c < num_classes; ++c) {
+          const double diff = std::fabs(reference[c] - probs[c]);
+          sum_diff += diff;
+          max_diff = std::max(max_diff,diff);
+        }
+        agree += std::max_element(reference.begin(),reference.end()) == reference.begin() +
+                 (std::max_element(probs.begin(),probs.end()) - probs.begin());
+      }
+      // Both tables and the class_max rows and their buffer
+      const TableLayout memory_layout = layouts[l].surfel_major() ? layouts[l] : TableLayout::ClassMajor(memory_map_size);
+      const double megabytes = (2.0 * memory_layout.size(num_classes,memory_map_size) + 6.0 * memory_map_size)
+                             * sizeof(float) / 1.0e6;
+      std::printf("%d\t%s\t%.0f\t%.2f\t%.2f\t%.2f\t%.2g\t%.2g\t%.5f\n",num_classes,
+                  l == 0 ? "float32" : LayoutName(layouts[l]).c_str(),megabytes,table.fuse_ms / frames,
+                  table.render_ms / frames,table.max_class_ms / frames,sum_diff / (static_cast<double>(num_kept) * num_classes),
+                  max_diff,static_cast<double>(agree) / num_kept);
+    }
+    for (size_t l = 0; l < tables.size(); ++l) {
+      delete tables[l];
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string mode = argc > 1 ? argv[1] : "";
+  if (mode != "layout" && mode != "quantized") {
+    std::printf("usage: %s layout|quantized [--classes n,...] [--map n] [--repeats n] [--frames n] [--threads n]\n",
+                argv[0]);
+    return 1;
+  }
+  std::vector<float> classes(1,14.0f);
+  classes.push_back(40.0f);
+  int map_size = 3000000, repeats = 5, frames = 30;
+  for (int a = 2; a + 1 < argc; a += 2) {
+    const std::string option(argv[a]);
+    const std::vector<float> values = ParseList(argv[a + 1]);
+    if (values.empty()) {
+      std::printf("Bad value list '%s' for %s\n",argv[a + 1],argv[a]);
+      return 1;
+    }
+    if (option == "--classes") classes = values;
+    else if (option == "--map") map_size = std::max(2,static_cast<int>(values[0]));
+    else if (option == "--repeats") repeats = std::max(1,static_cast<int>(values[0]));
+    else if (option == "--frames") frames = std::max(1,static_cast<int>(values[0]));
+    else if (option == "--threads") ThreadPool::Instance().SetNumThreads(std::max(1,static_cast<int>(values[0])));
+    else {
+      std::printf("Unknown option %s\n",argv[a]);
+      return 1;
+    }
+  }
+  std::printf("%d threads\n",ThreadPool::Instance().num_threads());
+  if (mode == "layout") return RunLayout(classes,map_size,repeats);
+  return RunQuantized(classes,frames,map_size);
+}
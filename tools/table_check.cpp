@@ -0,0 +1,340 @@
+/*
+ * This file is part of SemanticFusion.
+ *
+ * Copyright (C) 2017 Imperial College London
+ * 
+ * The use of the code within this file and all code within files that 
+ * make up the software that is SemanticFusion is permitted for 
+ * non-commercial purposes only.  The full terms and conditions that 
+ * apply to the code within this file are detailed within the LICENSE.txt 
+ * file and at <http://www.imperial.ac.uk/dyson-robotics-lab/downloads/semantic-fusion/semantic-fusion-license/> 
+ * unless explicitly stated.  By downloading this file you agree to 
+ * comply with these terms.
+ *
+ * If you wish to use any of this code for commercial purposes then 
+ * please email researchcontracts.engineering@imperial.ac.uk.
+ *
+ */
+
+// Runs the CUDA backend (CudaSemanticFusionBackend) against the CPU backend
+// on the same synthetic views of a 640x480 surfel id image and 224x224 CNN
+// outputs, for every table layout:
+//
+//   table_check [--classes 3,14,40] [--map 100000] [--frames 10] [--tolerance 1e-3]
+//               [--mismatches 0]
+//
+// fuses --frames views into a table of --map surfels, rendering and updating
+// the most likely classes after each, then compacts the table to two thirds
+// of its surfels with some new ones. It reports the largest differences of
+// the rendered probabilities and of the compacted tables (read back with
+// gatherProbabilities), how often a most likely class differs after a frame
+// or the compaction and how many fusion stamps differ. It fails on a
+// difference above --tolerance, plus one code step for quantized tables, on
+// more than --mismatches classes that differ, or on any stamp that differs.
+// The backends round differently (see SemanticFusionCpu.h): expect a few ulp,
+// and classes of equal probability can come out either way.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cuda_runtime.h>
+#include "SemanticFusionCpu.h"
+#include "SemanticFusionCuda.h"
+#include "SemanticFusionKernels.h"
+
+namespace {
+
+const int kImageWidth = 640;
+const int kImageHeight = 480;
+const int kProbWidth = 224;
+const int kProbHeight = 224;
+
+void CheckCuda(const cudaError_t code, const char* what) {
+  if (code != cudaSuccess) {
+    std::fprintf(stderr,"%s: %s\n",what,cudaGetErrorString(code));
+    std::exit(2);
+  }
+}
+
+std::vector<float> ParseList(const char* list) {
+  std::vector<float> values;
+  const char* start = list;
+  while (*start) {
+    char* end;
+    values.push_back(static_cast<float>(std::strtod(start,&end)));
+    if (end == start) {
+      values.clear();
+      break;
+    }
+    start = *end == ',' ? end + 1 : end;
+  }
+  return values;
+}
+
+std::string LayoutName(const TableLayout& layout) {
+  if (layout.sparse()) return "top-" + std::to_string(layout.top_k);
+  if (layout.quantized()) return std::to_string(layout.code_bits) + "-bit";
+  return layout.surfel_major() ? "surfel-major" : "class-major";
+}
+
+// A device copy of a host array
+template <typename T>
+class DeviceArray {
+public:
+  explicit DeviceArray(const size_t size) : data_(NULL), size_(size) {
+    CheckCuda(cudaMalloc(&data_,sizeof(T) * std::max<size_t>(size,1)),"cudaMalloc");
+  }
+  ~DeviceArray() { cudaFree(data_); }
+  T* data() { return data_; }
+  void Upload(const std::vector<T>& host) {
+    CheckCuda(cudaMemcpy(data_,host.data(),sizeof(T) * size_,cudaMemcpyHostToDevice),"upload");
+  }
+  std::vector<T> Download() const {
+    std::vector<T> host(size_);
+    CheckCuda(cudaMemcpy(host.data(),data_,sizeof(T) * size_,cudaMemcpyDeviceToHost),"download");
+    return host;
+  }
+
+private:
+  DeviceArray(const DeviceArray&) = delete;
+  DeviceArray& operator=(const DeviceArray&) = delete;
+
+  T* data_;
+  size_t size_;
+};
+
+// The surfel id image as a texture, like the one ElasticFusion hands over
+class IdTexture {
+public:
+  IdTexture() : pitch_(0) {
+    CheckCuda(cudaMallocPitch(reinterpret_cast<void**>(&data_),&pitch_,sizeof(int) * kImageWidth,kImageHeight),
+              "cudaMallocPitch");
+    cudaResourceDesc resource;
+    std::memset(&resource,0,sizeof(resource));
+    resource.resType = cudaResourceTypePitch2D;
+    resource.res.pitch2D.devPtr = data_;
+    resource.res.pitch2D.desc = cudaCreateChannelDesc<int>();
+    resource.res.pitch2D.width = kImageWidth;
+    resource.res.pitch2D.height = kImageHeight;
+    resource.res.pitch2D.pitchInBytes = pitch_;
+    cudaTextureDesc texture;
+    std::memset(&texture,0,sizeof(texture));
+    texture.addressMode[0] = texture.addressMode[1] = cudaAddressModeClamp;
+    texture.filterMode = cudaFilterModePoint;
+    texture.readMode = cudaReadModeElementType;
+    texture.normalizedCoords = 0;
+    CheckCuda(cudaCreateTextureObject(&texture_,&resource,&texture,NULL),"cudaCreateTextureObject");
+  }
+  ~IdTexture() {
+    cudaDestroyTextureObject(texture_);
+    cudaFree(data_);
+  }
+  cudaTextureObject_t texture() const { return texture_; }
+  void Upload(const std::vector<int>& ids) {
+    CheckCuda(cudaMemcpy2D(data_,pitch_,ids.data(),sizeof(int) * kImageWidth,sizeof(int) * kImageWidth,
+                           kImageHeight,cudaMemcpyHostToDevice),"upload ids");
+  }
+
+private:
+  IdTexture(const IdTexture&) = delete;
+  IdTexture& operator=(const IdTexture&) = delete;
+
+  int* data_;
+  size_t pitch_;
+  cudaTextureObject_t texture_;
+};
+
+// The probabilities of a surfel of a host table, whatever the layout
+void SurfelProbabilities(const std::vector<float>& table, const TableLayout& layout, const int surfel_id,
+                         const int classes, float* out) {
+  if (layout.sparse()) {
+    decodeTopK(&table[static_cast<size_t>(surfel_id) * layout.surfel_stride],layout.top_k,classes,out,1);
+  } else if (layout.quantized()) {
+    decodeSurfel(&table[static_cast<size_t>(surfel_id) * layout.surfel_stride],layout.code_bits,classes,out,1);
+  } else {
+    for (int c = 0; c < classes; ++c) {
+      out[c] = table[layout.index(surfel_id,c)];
+    }
+  }
+}
+
+double MaxDifference(const std::vector<float>& a, const std::vector<float>& b) {
+  double max_diff = 0.0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (std::isnan(a[i]) || std::isnan(b[i])) {
+      if (std::isnan(a[i]) != std::isnan(b[i])) return INFINITY;
+      continue;
+    }
+    max_diff = std::max(max_diff,static_cast<double>(std::fabs(a[i] - b[i])));
+  }
+  return max_diff;
+}
+
+// Both backends over the same views and compaction, false if they disagree
+bool CheckLayout(const TableLayout layout, const int num_classes, const int map_size, const int frames,
+                 const double tolerance, const int max_mismatches) {
+  const size_t table_size = layout.size(num_classes,map_size);
+  std::vector<float> table(table_size,0.0f), max_class(3 * static_cast<size_t>(map_size),0.0f);
+  std::vector<float> stamps(map_size,-1.0f);
+  DeviceArray<float> table_gpu(table_size), max_class_gpu(max_class.size()), stamps_gpu(stamps.size());
+  CpuSemanticFusionBackend cpu;
+  CudaSemanticFusionBackend gpu;
+  // A table of new surfels, all at the prior
+  cpu.UpdateProbabilityTable(NULL,0,0,table.data(),layout,map_size,num_classes,map_size,table.data(),
+                             max_class.data(),max_class.data(),stamps.data(),stamps.data());
+  gpu.UpdateProbabilityTable(NULL,0,0,table_gpu.data(),layout,map_size,num_classes,map_size,table_gpu.data(),
+                             max_class_gpu.data(),max_class_gpu.data(),stamps_gpu.data(),stamps_gpu.data());
+
+  std::mt19937 rng(num_classes);
+  std::uniform_real_distribution<float> uniform(0.0f,1.0f);
+  std::vector<int> ids(kImageWidth * kImageHeight);
+  std::vector<float> probabilities(static_cast<size_t>(num_classes) * kProbWidth * kProbHeight);
+  std::vector<float> rendered(static_cast<size_t>(num_classes) * kImageWidth * kImageHeight);
+  IdTexture ids_gpu;
+  DeviceArray<float> probabilities_gpu(probabilities.size()), rendered_gpu(rendered.size());
+  double render_diff = 0.0;
+  int class_mismatches = 0;
+  for (int f = 0; f < frames; ++f) {
+    // 2x2 pixel surfels, each view a shifted window over the map, with a
+    // corner that shows no surfel
+    const int offset = f * 4099;
+    for (int y = 0; y < kImageHeight; ++y) {
+      for (int x = 0; x < kImageWidth; ++x) {
+        const int block = (y / 2) * (kImageWidth / 2) + x / 2 + offset;
+        ids[y * kImageWidth + x] = x < 30 && y < 30 ? 0 : 1 + block % (map_size - 1);
+      }
+    }
+    for (int p = 0; p < kProbWidth * kProbHeight; ++p) {
+      float total = 0.0f;
+      for (int c = 0; c < num_classes; ++c) {
+        float& probability = probabilities[static_cast<size_t>(c) * kProbWidth * kProbHeight + p];
+        probability = std::exp(4.0f * uniform(rng));
+        total += probability;
+      }
+      for (int c = 0; c < num_classes; ++c) {
+        probabilities[static_cast<size_t>(c) * kProbWidth * kProbHeight + p] /= total;
+      }
+    }
+    ids_gpu.Upload(ids);
+    probabilities_gpu.Upload(probabilities);
+    const SurfelIdImage image = {0,ids.data(),kImageWidth,kImageHeight};
+    const SurfelIdImage image_gpu = {ids_gpu.texture(),NULL,kImageWidth,kImageHeight};
+    cpu.FuseProbabilities(image,probabilities.data(),kProbWidth,kProbHeight,num_classes,table.data(),layout,
+                          max_class.data(),map_size,stamps.data(),static_cast<float>(f));
+    gpu.FuseProbabilities(image_gpu,probabilities_gpu.data(),kProbWidth,kProbHeight,num_classes,table_gpu.data(),
+                          layout,max_class_gpu.data(),map_size,stamps_gpu.data(),static_cast<float>(f));
+    cpu.RenderProbabilityMap(image,table.data(),layout,num_classes,rendered.data());
+    gpu.RenderProbabilityMap(image_gpu,table_gpu.data(),layout,num_classes,rendered_gpu.data());
+    render_diff = std::max(render_diff,MaxDifference(rendered,rendered_gpu.Download()));
+    cpu.UpdateMaxClass(map_size,table.data(),layout,num_classes,max_class.data(),map_size);
+    gpu.UpdateMaxClass(map_size,table_gpu.data(),layout,num_classes,max_class_gpu.data(),map_size);
+    const std::vector<float> max_class_result = max_class_gpu.Download();
+    for (int s = 0; s < map_size; ++s) {
+      class_mismatches += max_class[s] != max_class_result[s];
+    }
+  }
+
+  // Compaction to two thirds of the surfels, with new ones at the end. The
+  // rebuilt table has the size and layout of the old one, like the buffer
+  // SemanticFusionInterface swaps in
+  std::vector<int> kept_ids;
+  for (int i = 0; i < map_size; ++i) {
+    if (i % 3) {
+      kept_ids.push_back(i);
+    }
+  }
+  const int num_kept = static_cast<int>(kept_ids.size());
+  const int new_map_size = std::min(map_size,num_kept + 1000);
+  DeviceArray<int> kept_ids_gpu(kept_ids.size());
+  kept_ids_gpu.Upload(kept_ids);
+  std::vector<float> new_table(table_size), new_max_class(max_class.size()), new_stamps(stamps.size());
+  DeviceArray<float> new_table_gpu(table_size), new_max_class_gpu(max_class.size()), new_stamps_gpu(stamps.size());
+  cpu.UpdateProbabilityTable(kept_ids.data(),num_kept,map_size,table.data(),layout,map_size,num_classes,new_map_size,
+                             new_table.data(),max_class.data(),new_max_class.data(),stamps.data(),new_stamps.data());
+  gpu.UpdateProbabilityTable(kept_ids_gpu.data(),num_kept,map_size,table_gpu.data(),layout,map_size,num_classes,
+                             new_map_size,new_table_gpu.data(),max_class_gpu.data(),new_max_class_gpu.data(),
+                             stamps_gpu.data(),new_stamps_gpu.data());
+
+  // Only the first new_map_size surfels are defined
+  std::vector<int> surfel_ids(new_map_size);
+  for (int i = 0; i < new_map_size; ++i) {
+    surfel_ids[i] = i;
+  }
+  DeviceArray<int> surfel_ids_gpu(surfel_ids.size());
+  surfel_ids_gpu.Upload(surfel_ids);
+  DeviceArray<float> gathered_gpu(static_cast<size_t>(new_map_size) * num_classes);
+  gatherProbabilities(surfel_ids_gpu.data(),new_map_size,new_table_gpu.data(),layout,num_classes,
+                      gathered_gpu.data());
+  const std::vector<float> gathered = gathered_gpu.Download();
+  std::vector<float> decoded(gathered.size());
+  for (int s = 0; s < new_map_size; ++s) {
+    SurfelProbabilities(new_table,layout,s,num_classes,&decoded[static_cast<size_t>(s) * num_classes]);
+  }
+  const double table_diff = MaxDifference(decoded,gathered);
+  const std::vector<float> max_class_result = new_max_class_gpu.Download();
+  const std::vector<float> stamps_result = new_stamps_gpu.Download();
+  int stamp_mismatches = 0;
+  for (int s = 0; s < new_map_size; ++s) {
+    class_mismatches += new_max_class[s] != max_class_result[s];
+    stamp_mismatches += new_stamps[s] != stamps_result[s];
+  }
+  // A code apart changes a probability by at most its relative step
+  const double layout_tolerance = tolerance +
+      (layout.quantized() ? std::expm1(kQuantizedLogRange / ((1 << layout.code_bits) - 1)) : 0.0);
+  const bool ok = render_diff <= layout_tolerance && table_diff <= layout_tolerance &&
+                  class_mismatches <= max_mismatches && stamp_mismatches == 0;
+  std::printf("%d\t%s\t%.3g\t%.3g\t%d\t%d\t%s\n",num_classes,LayoutName(layout).c_str(),render_diff,table_diff,
+              class_mismatches,stamp_mismatches,ok ? "ok" : "FAIL");
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::vector<float> classes(1,3.0f);
+  classes.push_back(14.0f);
+  classes.push_back(40.0f);
+  int map_size = 100000, frames = 10, max_mismatches = 0;
+  double tolerance = 1.0e-3;
+  for (int a = 1; a + 1 < argc; a += 2) {
+    const std::string option(argv[a]);
+    const std::vector<float> values = ParseList(argv[a + 1]);
+    if (values.empty()) {
+      std::printf("Bad value list '%s' for %s\n",argv[a + 1],argv[a]);
+      return 1;
+    }
+    if (option == "--classes") classes = values;
+    else if (option == "--map") map_size = std::max(2,static_cast<int>(values[0]));
+    else if (option == "--frames") frames = std::max(1,static_cast<int>(values[0]));
+    else if (option == "--tolerance") tolerance = values[0];
+    else if (option == "--mismatches") max_mismatches = std::max(0,static_cast<int>(values[0]));
+    else {
+      std::printf("Unknown option %s\n",argv[a]);
+      return 1;
+    }
+  }
+  std::printf("classes\tlayout\tmax |d rendered|\tmax |d table|\tclass mismatches\tstamp mismatches\n");
+  int failures = 0;
+  for (size_t k = 0; k < classes.size(); ++k) {
+    const int num_classes = std::max(2,static_cast<int>(classes[k]));
+    std::vector<TableLayout> layouts;
+    layouts.push_back(TableLayout::ClassMajor(map_size));
+    layouts.push_back(TableLayout::SurfelMajor(num_classes));
+    layouts.push_back(TableLayout::Quantized(num_classes,16));
+    layouts.push_back(TableLayout::Quantized(num_classes,8));
+    for (int top_k = 2; top_k <= 8 && top_k < num_classes; top_k *= 2) {
+      layouts.push_back(TableLayout::Sparse(top_k));
+    }
+    for (size_t l = 0; l < layouts.size(); ++l) {
+      failures += !CheckLayout(layouts[l],num_classes,map_size,frames,tolerance,max_mismatches);
+    }
+  }
+  std::printf("# %d layouts differ\n",failures);
+  return failures == 0 ? 0 : 1;
+}